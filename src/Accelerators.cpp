@@ -1,79 +1,131 @@
 #include "Primitive.h"
-#include "threading.hpp"
+#include "Threading.hpp"
 #include "RenderLog.h"
+#include "Arena.hpp"
 
 #include <algorithm>
 #include <functional>
+#include <cstring>
 
 #include <iostream>
 #include <bitset>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <random>
+
+#include <xmmintrin.h>
+
+/// Hint the CPU to start loading the cache line at @address, does not block
+inline void prefetch(const void* address) {
+	_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+}
+
+/// Number of rays a single thread interleaves in IntersectionAccelerator::intersectBatch
+static const int PIPELINE_WIDTH = 8;
+
+/// How many times a build over BuildParameters::maxBytes is retried with coarser settings before keeping the capped tree
+static const int MAX_BUDGET_RETRIES = 3;
 
 struct OctTree : IntersectionAccelerator {
 	struct Node {
 		BBox box;
 		Node *children[8] = {nullptr, };
-		std::vector<Intersectable*> primitives;
+		int *primitives = nullptr;
+		int primitiveCount = 0;
 		bool isLeaf() const {
 			return children[0] == nullptr;
 		}
 	};
 
-	std::vector<Intersectable*> allPrimitives;
+	PrimitiveList *list = nullptr;
 	Node *root = nullptr;
+	Arena arena; ///< Nodes and primitive lists of leaves
+	std::vector<int> candidates; ///< Reused while distributing primitives to children
 	int depth = 0;
 	int leafSize = 0;
 	int nodes = 0;
+	int64_t bytes = 0; ///< Nodes and primitive indices of the tree
+	bool overBudget = false; ///< Some node was left a leaf to stay under BuildParameters::maxBytes
 	int MAX_DEPTH = 35;
 	int MIN_PRIMITIVES = 10;
+	static constexpr size_t MIN_TREE_BLOCK_SIZE = 1024;
+	BuildParameters parameters;
 
-	void clear(Node *n) {
-		if (!n) {
-			return;
-		}
+	void clear() {
+		arena.release();
+		root = nullptr;
+	}
 
-		for (int c = 0; c < 8; c++) {
-			clear(n->children[c]);
-			delete n->children[c];
-		}
+	void setPrimitives(PrimitiveList *primitives) override {
+		list = primitives;
 	}
 
-	void clear() {
-		clear(root);
-		allPrimitives.clear();
+	void setParameters(const BuildParameters &buildParameters) override {
+		parameters = buildParameters;
 	}
 
-	void addPrimitive(Intersectable* prim) override {
-		allPrimitives.push_back(prim);
+	/// @brief Move the primitives of @n from the build scratch to the tree
+	void makeLeaf(Node *n) {
+		int *primitives = arena.allocateUninitialized<int>(n->primitiveCount);
+		std::copy(n->primitives, n->primitives + n->primitiveCount, primitives);
+		n->primitives = primitives;
+		leafSize = std::max(leafSize, n->primitiveCount);
 	}
 
-	void build(Node *n, int currentDepth = 0) {
-		if (currentDepth >= MAX_DEPTH || n->primitives.size() <= MIN_PRIMITIVES) {
-			leafSize = std::max(leafSize, int(n->primitives.size()));
+	/// @param scratch - primitive lists of nodes still being split, freed after the build
+	void build(Node *n, Arena &scratch, int currentDepth = 0) {
+		if (currentDepth >= MAX_DEPTH || n->primitiveCount <= MIN_PRIMITIVES) {
+			makeLeaf(n);
 			return;
 		}
 
-		depth = std::max(depth, currentDepth);
 		BBox childBoxes[8];
 		n->box.octSplit(childBoxes);
 
+		const int parentCount = n->primitiveCount;
+		int *childPrimitives[8];
+		int childCounts[8];
+		int64_t childBytes = 8 * sizeof(Node) - parentCount * sizeof(int);
 		for (int c = 0; c < 8; c++) {
-			Node *& child = n->children[c];
-			child = new Node;
-			nodes++;
-			memset(child->children, 0, sizeof(child->children));
-			child->box = childBoxes[c];
-			for (int r = 0; r < n->primitives.size(); r++) {
-				if (n->primitives[r]->boxIntersect(child->box)) {
-					child->primitives.push_back(n->primitives[r]);
+			candidates.clear();
+			for (int r = 0; r < parentCount; r++) {
+				if (list->primitiveBoxIntersect(n->primitives[r], childBoxes[c])) {
+					candidates.push_back(n->primitives[r]);
 				}
 			}
-			if (child->primitives.size() == n->primitives.size()) {
-				build(child, MAX_DEPTH + 1);
+			childCounts[c] = int(candidates.size());
+			childPrimitives[c] = scratch.allocateUninitialized<int>(candidates.size());
+			std::copy(candidates.begin(), candidates.end(), childPrimitives[c]);
+			childBytes += candidates.size() * sizeof(int);
+		}
+
+		// Over the budget the node stays a leaf, the rest of the tree is still built within what is left
+		if (parameters.maxBytes >= 0 && bytes + childBytes > parameters.maxBytes) {
+			overBudget = true;
+			makeLeaf(n);
+			return;
+		}
+
+		depth = std::max(depth, currentDepth);
+		nodes += 8;
+		bytes += childBytes;
+		Node *children = arena.allocate<Node>(8);
+		n->primitives = nullptr;
+		n->primitiveCount = 0;
+		for (int c = 0; c < 8; c++) {
+			Node *child = &children[c];
+			n->children[c] = child;
+			child->box = childBoxes[c];
+			child->primitives = childPrimitives[c];
+			child->primitiveCount = childCounts[c];
+			if (child->primitiveCount == parentCount) {
+				build(child, scratch, MAX_DEPTH + 1);
 			} else {
-				build(child, currentDepth + 1);
+				build(child, scratch, currentDepth + 1);
 			}
 		}
-		n->primitives.clear();
 	}
 
 	void build(Purpose purpose) override {
@@ -87,23 +139,44 @@ struct OctTree : IntersectionAccelerator {
 			MIN_PRIMITIVES = 20;
 			treePurpose = " mesh";
 		}
-
-		if (root) {
-			clear(root);
-			delete root;
+		if (parameters.maxDepth > 0) {
+			MAX_DEPTH = parameters.maxDepth;
+		}
+		if (parameters.maxLeafPrimitives > 0) {
+			MIN_PRIMITIVES = parameters.maxLeafPrimitives;
 		}
 
-		printf("Building%s oct tree with %d primitives... ", treePurpose, int(allPrimitives.size()));
+		clear();
+
+		const int primitiveCount = list->primitiveCount();
+		printf("Building%s oct tree with %d primitives... ", treePurpose, primitiveCount);
 		Timer timer;
-		nodes = leafSize = depth = 0;
-		root = new Node();
-		root->primitives.swap(allPrimitives);
-		for (int c = 0; c < root->primitives.size(); c++) {
-			root->primitives[c]->expandBox(root->box);
-		}
-		build(root);
-		LOG_ACCEL_BUILD(AcceleratorType::Octtree, timer.toMs<float>(timer.elapsedNs() / 1000.0f), nodes, nodes * sizeof(Node) + sizeof(*this) + allPrimitives.size() * sizeof(allPrimitives[0]));
-		allPrimitives.clear();
+		Arena scratch(std::max<size_t>(Arena::DEFAULT_BLOCK_SIZE, primitiveCount * sizeof(int)));
+		// Trees of small meshes are a node and a few leaves, a full default block for each of many such meshes adds up
+		arena.setBlockSize(std::clamp<size_t>(primitiveCount * (sizeof(Node) + sizeof(int)), MIN_TREE_BLOCK_SIZE, Arena::DEFAULT_BLOCK_SIZE));
+		for (int attempt = 0; ; attempt++) {
+			nodes = leafSize = depth = 0;
+			overBudget = false;
+			root = arena.allocate<Node>();
+			root->primitives = scratch.allocateUninitialized<int>(primitiveCount);
+			root->primitiveCount = primitiveCount;
+			for (int c = 0; c < primitiveCount; c++) {
+				root->primitives[c] = c;
+				list->expandPrimitiveBox(c, root->box);
+			}
+			bytes = sizeof(Node) + primitiveCount * sizeof(int);
+			build(root, scratch);
+			if (!overBudget || attempt == MAX_BUDGET_RETRIES || parameters.maxBytes == 0) {
+				break;
+			}
+			// Budget ran out in the first branches built, a shallower tree spreads it over the whole scene
+			arena.reset();
+			scratch.reset();
+			MAX_DEPTH = std::max(1, std::min(MAX_DEPTH, depth) * 2 / 3);
+			MIN_PRIMITIVES *= 2;
+			printf("over memory budget, retrying with depth %d... ", MAX_DEPTH);
+		}
+		LOG_ACCEL_BUILD(AcceleratorType::Octtree, timer.toMs<float>(timer.elapsedNs() / 1000.0f), nodes, uint32_t(byteCount()));
 		printf(" done in %lldms, nodes %d, depth %d, %d leaf size\n", timer.toMs(timer.elapsedNs()), nodes, depth, leafSize);
 	}
 
@@ -111,8 +184,8 @@ struct OctTree : IntersectionAccelerator {
 		bool hasHit = false;
 
 		if (n->isLeaf()) {
-			for (int c = 0; c < n->primitives.size(); c++) {
-				if (n->primitives[c]->intersect(ray, tMin, tMax, intersection)) {
+			for (int c = 0; c < n->primitiveCount; c++) {
+				if (list->intersectPrimitive(n->primitives[c], ray, tMin, tMax, intersection)) {
 					tMax = intersection.t;
 					hasHit = true;
 				}
@@ -135,10 +208,31 @@ struct OctTree : IntersectionAccelerator {
 		return intersect(root, ray, tMin, tMax, intersection);
 	}
 
+	void frustumCull(Node *n, const Frustum &frustum, std::vector<int> &visible) {
+		if (!frustum.testBox(n->box)) {
+			return;
+		}
+		if (n->isLeaf()) {
+			visible.insert(visible.end(), n->primitives, n->primitives + n->primitiveCount);
+		} else {
+			for (int c = 0; c < 8; c++) {
+				frustumCull(n->children[c], frustum, visible);
+			}
+		}
+	}
+
+	void frustumCull(const Frustum &frustum, std::vector<int> &visible) override {
+		frustumCull(root, frustum, visible);
+	}
+
 	bool isBuilt() const override {
 		return root != nullptr;
 	}
 
+	int64_t byteCount() const override {
+		return root ? int64_t(arena.bytesUsed() + sizeof(*this)) : 0;
+	}
+
 	~OctTree() override {
 		clear();
 	}
@@ -146,6 +240,26 @@ struct OctTree : IntersectionAccelerator {
 
 // HLBVH
 struct BVHTree : IntersectionAccelerator {
+	enum class Builder
+	{
+		HLBVH, ///< Morton code treelets connected with SAH
+		PLOC ///< Bottom up parallel locally ordered clustering
+	};
+
+	/// How far along the Morton order PLOC looks for the nearest neighbour of each cluster
+	static const int PLOC_SEARCH_RADIUS = 16;
+
+	static const int CACHE_LINE_SIZE = 64;
+	/// Nodes the traversal keeps to visit later, trees are never deeper than this and PLOC rebuilds subtrees that would be
+	static const int TRAVERSAL_STACK_SIZE = 64;
+	/// PLOC subtrees starting this deep are rebuilt balanced when they are taller than the stack has room left for
+	///	Balanced subtrees of up to 2^31 primitives are at most 32 levels tall, so no tree goes over TRAVERSAL_STACK_SIZE
+	static const int MAX_PLOC_DEPTH = TRAVERSAL_STACK_SIZE - 32;
+	/// Most primitives a leaf can hold, LinearNode keeps the count in 16 bits
+	static constexpr uint32_t MAX_LEAF_PRIMITIVES = UINT16_MAX;
+	/// Levels of sibling pairs stored together with NodeLayout::Treelets, 2^6-1 pairs of 64 bytes take just under 4K
+	static const int TREELET_DEPTH = 6;
+	static constexpr NodeLayout DEFAULT_LAYOUT = NodeLayout::DepthFirst;
 
 	struct PrimInfo
 	{
@@ -200,38 +314,57 @@ struct BVHTree : IntersectionAccelerator {
 		{
 			int primitivesOffset;
 			int secondChildOffset;
+			int childrenOffset; // NodeLayout::Treelets, first child is here and the second right after it
 		};
 
 		uint16_t primitiveCount;
 		uint8_t axis; // axis interior nodes were split on
 		uint8_t pad[1]; // padding for 32b
 	};
+	static_assert(sizeof(LinearNode) * 2 == CACHE_LINE_SIZE, "sibling pairs fill a cache line");
 
+	PrimitiveList* m_List = nullptr;
 	std::vector<PrimInfo> m_Primitives;
-	std::vector<Intersectable*> m_OrderedPrims;
-	std::vector<Intersectable*> m_FinalPrims;
+	std::vector<int> m_OrderedPrims;
+	std::vector<int> m_FinalPrims;
 	LinearNode* m_SearchNodes = nullptr;
+	Arena m_Arena{ 0 }; // holds only m_SearchNodes, so blocks are sized to it exactly
 	uint32_t m_MaxPrimsPerNode = 1;
 	float m_IntersectionCost = 1.0f; // cost of calculating intersection
-
-	uint32_t m_PrimIdx = 0;
+	bool m_ForceLeaves = false; // collapse PLOC subtrees up to m_MaxPrimsPerNode regardless of SAH, to fit the memory budget
+	int m_NodeCount = 0;
+	NodeLayout m_Layout = NodeLayout::DepthFirst;
+	BuildParameters m_Parameters;
+	Builder m_Builder;
+	ThreadManager* m_Threads = nullptr;
+
+	explicit BVHTree(Builder builder) : m_Builder(builder)
+	{
+	}
 
 	~BVHTree()
 	{
 		clear();
 	}
 
-	void addPrimitive(Intersectable *prim) override
+	void setPrimitives(PrimitiveList* list) override
 	{
-		BBox box;
-		prim->expandBox(box);
-		m_Primitives.push_back({ m_PrimIdx++, box });
-		m_FinalPrims.push_back(prim);
+		m_List = list;
+	}
+
+	void setParameters(const BuildParameters& parameters) override
+	{
+		m_Parameters = parameters;
+	}
+
+	void setThreadManager(ThreadManager* threads) override
+	{
+		m_Threads = threads;
 	}
 
 	void clear() override
 	{
-		delete[] m_SearchNodes;
+		m_Arena.release();
 		m_SearchNodes = nullptr;
 	}
 
@@ -255,15 +388,69 @@ struct BVHTree : IntersectionAccelerator {
 		if (purpose == Purpose::Instances) // maybe makes a difference?
 		{
 			m_MaxPrimsPerNode = 1;
-			m_IntersectionCost = 2.0f
+			m_IntersectionCost = 2.0f;
 		}
 		else
 		{
 			m_MaxPrimsPerNode = 4;
-			m_IntersectionCost = 1.0f
+			m_IntersectionCost = 1.0f;
 		}
+		if (m_Parameters.maxLeafPrimitives > 0)
+			m_MaxPrimsPerNode = m_Parameters.maxLeafPrimitives;
+		if (m_Parameters.intersectionCost > 0.f)
+			m_IntersectionCost = m_Parameters.intersectionCost;
 		Timer timer;
-		printf("Building %s BVH with %d primitives\n", purpose == Purpose::Instances ? "instancing" : "mesh", (int)m_Primitives.size());
+		const int listCount = m_List->primitiveCount();
+		if (!m_Parameters.quiet)
+			printf("Building %s %s BVH with %d primitives\n", purpose == Purpose::Instances ? "instancing" : "mesh", m_Builder == Builder::PLOC ? "PLOC" : "HLBVH", listCount);
+		m_ForceLeaves = false;
+		if (m_Parameters.maxBytes == 0)
+		{
+			// Nothing left in the budget, the fewest nodes the leaves can hold
+			m_MaxPrimsPerNode = MAX_LEAF_PRIMITIVES;
+			m_ForceLeaves = true;
+		}
+		Arena scratch;
+		for (int attempt = 0; ; attempt++)
+		{
+			buildTree(scratch);
+			scratch.reset();
+			if (m_Parameters.maxBytes < 0 || byteCount() <= m_Parameters.maxBytes || attempt == MAX_BUDGET_RETRIES || m_MaxPrimsPerNode == MAX_LEAF_PRIMITIVES)
+				break;
+			// Node count is bounded by the leaves, so bigger leaves are the only way to a smaller tree
+			clear();
+			m_MaxPrimsPerNode = std::min<uint32_t>(m_MaxPrimsPerNode * 4, MAX_LEAF_PRIMITIVES);
+			m_ForceLeaves = true;
+			printf("BVH over memory budget, retrying with leaves of up to %d primitives\n", m_MaxPrimsPerNode);
+		}
+		const AcceleratorType type = m_Builder == Builder::PLOC ? AcceleratorType::PLOCBVH : AcceleratorType::BVH;
+		LOG_ACCEL_BUILD(type, timer.toMs<float>(timer.elapsedNs() / 1000.0f), m_NodeCount, uint32_t(byteCount()));
+		if (!m_Parameters.quiet)
+			printf("Built %s BVH with %d nodes in %f seconds\n", m_Builder == Builder::PLOC ? "PLOC" : "HLBVH", m_NodeCount, Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
+	}
+
+	int64_t byteCount() const override
+	{
+		if (!isBuilt())
+			return 0;
+		return m_Arena.bytesUsed() + sizeof(*this) + sizeof(m_FinalPrims[0]) * m_FinalPrims.size();
+	}
+
+	/// Build the tree with the current parameters into m_SearchNodes
+	///	@param scratch - nodes before flattening, can be reset after
+	void buildTree(Arena& scratch)
+	{
+		const int listCount = m_List->primitiveCount();
+		m_NodeCount = 0;
+		m_Primitives.clear();
+		m_Primitives.reserve(listCount);
+		for (int i = 0; i < listCount; i++)
+		{
+			BBox box;
+			m_List->expandPrimitiveBox(i, box);
+			m_Primitives.push_back({ size_t(i), box });
+		}
+
 		BBox bounds;
 		for (const auto& prim : m_Primitives) // Bounding box of all primitives
 			bounds.add(prim.centroid);
@@ -281,6 +468,12 @@ struct BVHTree : IntersectionAccelerator {
 
 		std::sort(mortonPrims.begin(), mortonPrims.end(), [](const MortonPrim& l, const MortonPrim& r){ return l.mortonCode < r.mortonCode; }); // pbr book uses radix sort here
 
+		if (m_Builder == Builder::PLOC)
+		{
+			buildPLOC(mortonPrims, scratch);
+			return;
+		}
+
 		std::vector<Treelet> treeletsToBuild;
 		int start = 0;
 		for (int end = 1; end < (int)mortonPrims.size(); end++)
@@ -290,17 +483,18 @@ struct BVHTree : IntersectionAccelerator {
 			{
 				int primitiveCount = end - start;
 				int maxBVHNodes = 2 * primitiveCount;
-				Node* nodes = new Node[maxBVHNodes];
+				Node* nodes = scratch.allocate<Node>(maxBVHNodes);
 				treeletsToBuild.push_back({ start, primitiveCount, nodes });
 				start = end;
 			}
 		}
 
-		printf("%lld treelets", treeletsToBuild.size() + 1);
+		if (!m_Parameters.quiet)
+			printf("%lld treelets", treeletsToBuild.size() + 1);
 
 		int primitiveCount = mortonPrims.size() - start;
 		int maxBVHNodes = 2 * primitiveCount;
-		treeletsToBuild.push_back({ start, primitiveCount, new Node[maxBVHNodes] });
+		treeletsToBuild.push_back({ start, primitiveCount, scratch.allocate<Node>(maxBVHNodes) });
 
 		// Could also do this in parallel
 		int orderedPrimsOffset = 0;
@@ -314,8 +508,7 @@ struct BVHTree : IntersectionAccelerator {
 		finishedTreelets.reserve(treeletsToBuild.size());
 		for (Treelet& treelet : treeletsToBuild)
 			finishedTreelets.push_back(treelet.nodes);
-		Node* root = connectTreelets(finishedTreelets, 0, finishedTreelets.size(), totalNodes);
-		m_SearchNodes = new LinearNode[totalNodes];
+		Node* root = connectTreelets(finishedTreelets, 0, finishedTreelets.size(), totalNodes, scratch);
 		m_FinalPrims.swap(m_OrderedPrims);
 		m_Primitives.clear();
 
@@ -332,10 +525,7 @@ struct BVHTree : IntersectionAccelerator {
 				printBVH(node->children[1], prefix + (isLeft ? "|   " : "    "), false);
 		};
 		// printBVH(root, "", false);
-		int32_t offset = 0;
-		flatten(root, offset); // pbr book
-		LOG_ACCEL_BUILD(AcceleratorType::BVH, timer.toMs<float>(timer.elapsedNs() / 1000.0f), totalNodes, totalNodes * sizeof(LinearNode) + sizeof(*this) + sizeof(m_FinalPrims[0]) * m_FinalPrims.size());
-		printf("Built BVH with %d nodes in %f seconds\n", totalNodes, Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
+		layoutNodes(root, totalNodes);
 	}
 
 	Node* buildTreelets(Node *&buildNodes, MortonPrim* mortonPrims, int primitiveCount, int& totalNodes, int& orderedPrimsOffset, int bitIdx)
@@ -350,7 +540,7 @@ struct BVHTree : IntersectionAccelerator {
 			for (int i = 0; i < primitiveCount; i++)
 			{
 				int primitiveIdx = mortonPrims[i].primitiveIndex;
-				m_OrderedPrims[firstPrimOffset + i] = m_FinalPrims[primitiveIdx];
+				m_OrderedPrims[firstPrimOffset + i] = primitiveIdx;
 				bounds.add(m_Primitives[primitiveIdx].boundingBox);
 			}
 			node->initLeaf(firstPrimOffset, primitiveCount, bounds);
@@ -383,633 +573,2456 @@ struct BVHTree : IntersectionAccelerator {
 		}
 	}
 
-	Node* connectTreelets(std::vector<Node*>& roots, int start, int end, int& totalNodes) const;
+	Node* connectTreelets(std::vector<Node*>& roots, int start, int end, int& totalNodes, Arena& arena) const;
 
 	bool isBuilt() const override { return m_SearchNodes != nullptr; }
 
-	int flatten(Node* node, int& offset)
+	/// Start of a saved tree, the nodes follow at CACHE_LINE_SIZE and the primitive indices right after them
+	struct SavedTree
 	{
-		// Store the tree in dfs parent left right order
-		LinearNode* linearNode = &m_SearchNodes[offset];
-		linearNode->bounds = node->bounds;
-		int myOffset = offset++;
-		if (node->primitiveCount > 0)
+		uint32_t builder;
+		uint32_t layout;
+		int32_t nodeCount;
+		int32_t listCount; // the tree is valid only for a list of the same primitives
+		int32_t finalPrimCount;
+	};
+	static_assert(sizeof(SavedTree) <= CACHE_LINE_SIZE, "nodes start at the next cache line");
+
+	/// Nodes in m_SearchNodes, including the padding after the root of NodeLayout::Treelets
+	int linearNodeCount() const
+	{
+		return m_NodeCount + (m_Layout == NodeLayout::Treelets ? 1 : 0);
+	}
+
+	bool save(std::vector<char>& data) const override
+	{
+		if (!isBuilt())
+			return false;
+		const SavedTree saved{ uint32_t(m_Builder), uint32_t(m_Layout), m_NodeCount, m_List->primitiveCount(), int32_t(m_FinalPrims.size()) };
+		const size_t nodeBytes = size_t(linearNodeCount()) * sizeof(LinearNode);
+		const size_t start = data.size();
+		data.resize(start + CACHE_LINE_SIZE + nodeBytes + m_FinalPrims.size() * sizeof(int), 0);
+		memcpy(&data[start], &saved, sizeof(saved));
+		memcpy(&data[start + CACHE_LINE_SIZE], m_SearchNodes, nodeBytes);
+		memcpy(&data[start + CACHE_LINE_SIZE + nodeBytes], m_FinalPrims.data(), m_FinalPrims.size() * sizeof(int));
+		return true;
+	}
+
+	bool load(const char* data, size_t size) override
+	{
+		SavedTree saved;
+		if (size < CACHE_LINE_SIZE)
+			return false;
+		memcpy(&saved, data, sizeof(saved));
+		const NodeLayout layout = m_Parameters.layout == NodeLayout::Default ? DEFAULT_LAYOUT : m_Parameters.layout;
+		if (saved.builder != uint32_t(m_Builder) || saved.layout != uint32_t(layout) || saved.listCount != m_List->primitiveCount())
+			return false;
+		const int32_t nodeCount = saved.nodeCount + (layout == NodeLayout::Treelets ? 1 : 0);
+		if (saved.nodeCount <= 0 || saved.finalPrimCount < 0)
+			return false;
+		const size_t nodeBytes = size_t(nodeCount) * sizeof(LinearNode);
+		if (size - CACHE_LINE_SIZE < nodeBytes || size - CACHE_LINE_SIZE - nodeBytes < size_t(saved.finalPrimCount) * sizeof(int))
+			return false;
+		if (reinterpret_cast<uintptr_t>(data) % alignof(LinearNode) != 0)
+			return false;
+
+		Timer timer;
+		clear();
+		m_Layout = layout;
+		m_NodeCount = saved.nodeCount;
+		// Traversal only reads the nodes, so they are used where they are
+		m_SearchNodes = const_cast<LinearNode*>(reinterpret_cast<const LinearNode*>(data + CACHE_LINE_SIZE));
+		const int* finalPrims = reinterpret_cast<const int*>(data + CACHE_LINE_SIZE + nodeBytes);
+		m_FinalPrims.assign(finalPrims, finalPrims + saved.finalPrimCount);
+		if (!validate(nodeCount))
 		{
-			linearNode->primitivesOffset = node->firstPrimOffset;
-			linearNode->primitiveCount = node->primitiveCount;
+			printf("Saved BVH has offsets out of range, rebuilding it\n");
+			clear();
+			return false;
 		}
-		else
+		const AcceleratorType type = m_Builder == Builder::PLOC ? AcceleratorType::PLOCBVH : AcceleratorType::BVH;
+		LOG_ACCEL_BUILD(type, timer.toMs<float>(timer.elapsedNs() / 1000.0f), m_NodeCount, uint32_t(byteCount()));
+		return true;
+	}
+
+	/// @brief Check the loaded nodes reference only nodes after them and primitives of the list, once instead of on every ray
+	///	       Every node reachable from the root is visited once at most, so a corrupt file can't loop or overflow the traversal stack
+	/// @param nodeCount - nodes in m_SearchNodes
+	bool validate(int nodeCount) const
+	{
+		const int listCount = m_List->primitiveCount();
+		for (const int primitive : m_FinalPrims)
 		{
-			linearNode->axis = node->splitAxis;
-			linearNode->primitiveCount = 0;
-			flatten(node->children[0], offset);
-			linearNode->secondChildOffset = flatten(node->children[1], offset);
+			if (primitive < 0 || primitive >= listCount)
+				return false;
 		}
-		return myOffset;
+		std::vector<std::pair<int, int>> stack = { { 0, 1 } }; // node and its depth
+		int visited = 0;
+		while (!stack.empty())
+		{
+			const auto [index, depth] = stack.back();
+			stack.pop_back();
+			if (++visited > nodeCount || depth > TRAVERSAL_STACK_SIZE)
+				return false;
+			const LinearNode& node = m_SearchNodes[index];
+			if (node.primitiveCount > 0)
+			{
+				if (node.primitivesOffset < 0 || int64_t(node.primitivesOffset) + node.primitiveCount > int64_t(m_FinalPrims.size()))
+					return false;
+				continue;
+			}
+			const int first = firstChild(&node, index), second = secondChild(&node);
+			for (const int child : { first, second })
+			{
+				if (child <= index || child >= nodeCount)
+					return false;
+				stack.push_back({ child, depth + 1 });
+			}
+		}
+		return true;
 	}
 
-	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	/// Bottom up build, clusters in Morton order are merged with their nearest neighbour inside a small window until one is left
+	///	Nearest neighbour search and merging of each pass are split between the workers of m_Threads
+	void buildPLOC(const std::vector<MortonPrim>& mortonPrims, Arena& scratch)
 	{
-		if (!isBuilt())
-			return false;
-		
-		vec3 invDir = ray.dir.inverted();
-		int negativeDir[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-		// Offset of next element in stack, offset in nodes list
-		int toVisitOffset = 0, currentNodeIndex = 0;
-		int nodesToVisit[64];
-		bool hit = false;
-		while (true)
+		const int primitiveCount = int(mortonPrims.size());
+		if (primitiveCount == 0)
+			return;
+
+		// Each merge adds one node, so the count is known upfront
+		Node* nodes = scratch.allocate<Node>(2 * primitiveCount - 1);
+		std::vector<int> clusters(primitiveCount), merged(primitiveCount), neighbours(primitiveCount);
+		m_OrderedPrims.resize(primitiveCount);
+		for (int i = 0; i < primitiveCount; i++)
 		{
-			const LinearNode* node = &m_SearchNodes[currentNodeIndex];
-			if (node->bounds.testIntersect(ray))
-			{
-				if (node->primitiveCount > 0) // leaf
+			const int primitiveIdx = mortonPrims[i].primitiveIndex;
+			m_OrderedPrims[i] = primitiveIdx;
+			nodes[i].initLeaf(i, 1, m_Primitives[primitiveIdx].boundingBox);
+			clusters[i] = i;
+		}
+
+		std::atomic<int> nextNode{ primitiveCount };
+		int clusterCount = primitiveCount;
+		while (clusterCount > 1)
+		{
+			parallelFor(m_Threads, clusterCount, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
 				{
-					for (int i = 0; i < node->primitiveCount; i++)
+					const BBox& bounds = nodes[clusters[i]].bounds;
+					const int last = std::min(clusterCount - 1, i + PLOC_SEARCH_RADIUS);
+					float bestArea = FLT_MAX;
+					for (int j = std::max(0, i - PLOC_SEARCH_RADIUS); j <= last; j++)
 					{
-						if (m_FinalPrims[node->primitivesOffset + i]->intersect(ray, tMin, tMax, intersection))
+						if (j == i)
+							continue;
+						BBox both = bounds;
+						both.add(nodes[clusters[j]].bounds);
+						const float area = both.area();
+						if (area < bestArea) // ties go to the lower index, so pairs are always found from both sides
 						{
-							// return true;
-							hit = true; // Need to keep going, since there might be closer intersections, so just update
-							tMax = intersection.t;
+							bestArea = area;
+							neighbours[i] = j;
 						}
 					}
-			
-					if (toVisitOffset == 0) break;
-					currentNodeIndex = nodesToVisit[--toVisitOffset];
 				}
-				else // interior, so visit child
+			});
+
+			// Mutual nearest neighbours are merged in place of the lower index, the higher one is dropped
+			parallelFor(m_Threads, clusterCount, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
 				{
-					if (negativeDir[node->axis]) // if the axis we split on has negative direction, visit the second child. In 2D this is:
+					const int j = neighbours[i];
+					if (neighbours[j] != i)
+					{
+						merged[i] = clusters[i];
+						continue;
+					}
+					if (j < i)
 					{
-						/*
-						Let's say we split on the x axis. Then we want to visit the second child first if the ray is going from right to left, and the first child if the ray is going from left to right.
-						This way we can easily discard the second child, since it would hit the box on the left and it's closer
-
-				   *
-					\
-					 \
-					  \
-					   >
-
-						---------   |
-						|       |   |
-						|       |   |
-						---------   |     ---------
-									|     |       |
-									|     |       |
-									|     ---------
-									| 
-						*/
-						nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-						currentNodeIndex = node->secondChildOffset;
+						merged[i] = -1;
+						continue;
 					}
-					else
+
+					// Split on the axis the children are furthest apart, with the lower one first like the top down build
+					Node* first = &nodes[clusters[i]];
+					Node* second = &nodes[clusters[j]];
+					const vec3 firstCenter = first->bounds.min + first->bounds.max;
+					const vec3 secondCenter = second->bounds.min + second->bounds.max;
+					int axis = 0;
+					for (int c = 1; c < 3; c++)
 					{
-						nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-						currentNodeIndex++;
+						if (std::abs(firstCenter[c] - secondCenter[c]) > std::abs(firstCenter[axis] - secondCenter[axis]))
+							axis = c;
 					}
+					if (firstCenter[axis] > secondCenter[axis])
+						std::swap(first, second);
+
+					const int nodeIdx = nextNode++;
+					nodes[nodeIdx].initInterior(axis, first, second);
+					merged[i] = nodeIdx;
 				}
-			}
-			else
+			});
+
+			int kept = 0;
+			for (int i = 0; i < clusterCount; i++)
 			{
-				if (toVisitOffset == 0)
-					break;
-				currentNodeIndex = nodesToVisit[--toVisitOffset];
+				if (merged[i] >= 0)
+					clusters[kept++] = merged[i];
 			}
+			clusterCount = kept;
 		}
-		return hit;
-	}
 
-};
-
-BVHTree::Node* BVHTree::connectTreelets(std::vector<Node*>& roots, int start, int end, int& totalNodes) const
-{
-	int nodeCount = end - start;
-	if (nodeCount== 1) return roots[start];
-	totalNodes++;
-	Node* node = new Node();
-	BBox bounds;
-	for (int i = start; i < end; i++)
-		bounds.add(roots[i]->bounds);
+		Node* root = &nodes[clusters[0]];
+		limitDepth(root, 1);
+		m_FinalPrims.resize(primitiveCount);
+		int primOffset = 0, totalNodes = 0;
+		collapseLeaves(root, primOffset, totalNodes);
+		m_OrderedPrims.clear();
+		m_Primitives.clear();
+		layoutNodes(root, totalNodes);
+	}
 
-	// Only considering the centroids of objects. With these scenes the objects are pretty much the same size, but with differently sized objects this wouldn't work as well
-	BBox centroidBounds;
-	for (int i = start; i < end; i++)
+	/// Rebuild the subtrees of the PLOC tree that reach too deep for the traversal stack, merging nearest neighbours alone
+	///	chains clusters of very different sizes, like boxes placed at growing distances, into a list one level per primitive
+	/// @param depth - of @node, the root is at 1
+	void limitDepth(Node* node, int depth)
 	{
-		vec3 centroid = (roots[i]->bounds.min + roots[i]->bounds.max) * 0.5f;
-		centroidBounds.add(centroid);
+		if (node->primitiveCount > 0)
+			return;
+		if (depth < MAX_PLOC_DEPTH)
+		{
+			limitDepth(node->children[0], depth + 1);
+			limitDepth(node->children[1], depth + 1);
+			return;
+		}
+		std::vector<Node*> leaves, interiors;
+		std::vector<std::pair<Node*, int>> stack = { { node, depth } };
+		int deepest = depth;
+		while (!stack.empty())
+		{
+			const auto [current, currentDepth] = stack.back();
+			stack.pop_back();
+			deepest = std::max(deepest, currentDepth);
+			if (current->primitiveCount > 0)
+			{
+				leaves.push_back(current);
+				continue;
+			}
+			// @node stays the root of the subtree, so its parent keeps pointing at it, the other interior nodes are reused
+			if (current != node)
+				interiors.push_back(current);
+			stack.push_back({ current->children[0], currentDepth + 1 });
+			stack.push_back({ current->children[1], currentDepth + 1 });
+		}
+		if (deepest > TRAVERSAL_STACK_SIZE)
+			buildBalanced(leaves.data(), int(leaves.size()), node, interiors);
 	}
 
-	int dim = centroidBounds.maxExtent(); // Divide on largest axis, Maybe worth checking all 3?
-	const int bucketCount = 12; // Put everything in buckets and try to cut between the buckets. Choose the one with the best cost
-	struct BucketInfo {
-		int count = 0;
-		BBox bounds;
-	};
-	BucketInfo buckets[16];
-	for (int i = start; i < end; i++) // Put into buckets
+	/// Median split of @leaves on the axis their centers spread most, taking interior nodes from @interiors
+	void buildBalanced(Node** leaves, int count, Node* node, std::vector<Node*>& interiors)
 	{
-		float centroid = (roots[i]->bounds.min[dim] + roots[i]->bounds.max[dim]) * 0.5f;
-		int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
-		if (b >= bucketCount)
-			b = bucketCount - 1;
-		buckets[b].count++;
-		buckets[b].bounds.add(roots[i]->bounds);
-		// printf("%f, %d %d\n", centroid, b);
+		BBox centers;
+		for (int i = 0; i < count; i++)
+			centers.add(leaves[i]->bounds.min + leaves[i]->bounds.max);
+		const int axis = centers.maxExtent();
+		const int mid = count / 2;
+		std::nth_element(leaves, leaves + mid, leaves + count, [axis](const Node* a, const Node* b) {
+			return a->bounds.min[axis] + a->bounds.max[axis] < b->bounds.min[axis] + b->bounds.max[axis];
+		});
+		Node* children[2];
+		for (int c = 0; c < 2; c++)
+		{
+			Node** start = c == 0 ? leaves : leaves + mid;
+			const int childCount = c == 0 ? mid : count - mid;
+			if (childCount == 1)
+			{
+				children[c] = start[0];
+				continue;
+			}
+			children[c] = interiors.back();
+			interiors.pop_back();
+			buildBalanced(start, childCount, children[c], interiors);
+		}
+		node->bounds = BBox();
+		node->initInterior(axis, children[0], children[1]);
 	}
 
-	const float traversalCost = 0.125f; // cost of figuring out which child to visit
-
-	float cost[bucketCount - 1];
-	// printf("Start: %d, end: %d, dim: %d\n", start, end, dim);
-	// printf("Centroid: %f, %f, %f\n", centroidBounds.min.x, centroidBounds.min.y, centroidBounds.min.z);
-	// printf("Centroid: %f, %f, %f\n", centroidBounds.max.x, centroidBounds.max.y, centroidBounds.max.z);
-	for (int i = 0; i < bucketCount - 1; i++)
+	/// Write primitives of the PLOC tree to m_FinalPrims in leaf order, turning subtrees into leaves where SAH says it is cheaper
+	///	or wherever they fit when m_ForceLeaves is set
+	/// @return SAH cost of the subtree
+	float collapseLeaves(Node* node, int& primOffset, int& totalNodes)
 	{
-		// printf("Bucket %d: %d\n", i, buckets[i].count);
-		BBox b0, b1;
-		int count0 = 0, count1 = 0;
-		for (int j = 0; j <= i; j++)
+		totalNodes++;
+		if (node->primitiveCount > 0)
 		{
-			b0.add(buckets[j].bounds);
-			count0 += buckets[j].count;
+			m_FinalPrims[primOffset] = m_OrderedPrims[node->firstPrimOffset];
+			node->firstPrimOffset = primOffset++;
+			return m_IntersectionCost;
 		}
-		for (int j = 0; j <= i; j++)
+
+		const float traversalCost = 0.125f; // same as connectTreelets
+		const int firstPrim = primOffset, nodesBefore = totalNodes;
+		const float cost0 = collapseLeaves(node->children[0], primOffset, totalNodes);
+		const float cost1 = collapseLeaves(node->children[1], primOffset, totalNodes);
+		const int count = primOffset - firstPrim;
+		const float area = std::max(node->bounds.area(), FLT_MIN);
+		const float subtreeCost = traversalCost + (node->children[0]->bounds.area() * cost0 + node->children[1]->bounds.area() * cost1) / area;
+		const float leafCost = m_IntersectionCost * count;
+		if (count <= int(m_MaxPrimsPerNode) && (leafCost <= subtreeCost || m_ForceLeaves))
 		{
-			b1.add(buckets[j].bounds);
-			count1 += buckets[j].count;
+			totalNodes = nodesBefore; // children are no longer part of the tree
+			node->initLeaf(firstPrim, count, node->bounds);
+			return leafCost;
 		}
-		cost[i] = traversalCost + m_IntersectionCost * (count0 * b0.area() + count1 * b1.area()) / bounds.area();
+		return subtreeCost;
 	}
 
-	float minCost = cost[0];
-	int minCostBucketIdx = 0;
-	for (int i = 1; i < bucketCount - 1; i++)
+	/// Store the built tree in m_SearchNodes, in the order m_Parameters.layout asks for
+	void layoutNodes(Node* root, int totalNodes)
 	{
-		if (cost[i] < minCost)
+		m_Layout = m_Parameters.layout == NodeLayout::Default ? DEFAULT_LAYOUT : m_Parameters.layout;
+		m_Arena.hugePages = m_Parameters.hugePages;
+		m_NodeCount = totalNodes;
+		if (m_Layout == NodeLayout::Treelets)
 		{
-			minCost = cost[i];
-			minCostBucketIdx = i;
+			// Root is alone in the first line, with an unused node after it so every sibling pair starts a line
+			m_SearchNodes = m_Arena.allocate<LinearNode>(totalNodes + 1, CACHE_LINE_SIZE);
+			layoutTreelets(root);
+		}
+		else
+		{
+			m_SearchNodes = m_Arena.allocate<LinearNode>(totalNodes, CACHE_LINE_SIZE);
+			int32_t offset = 0;
+			flatten(root, offset); // pbr book
 		}
 	}
 
-	// pbr book guys soo smart
-	Node** pmid = std::partition(&roots[start], &roots[end - 1] + 1, [=](const Node* node)
-		{
-			float centroid = (node->bounds.min[dim] + node->bounds.max[dim]) * 0.5f;
-			int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
-			if (b >= bucketCount)
-				b = bucketCount - 1;
-			return b <= minCostBucketIdx;
-		});
-	int mid = pmid - &roots[0];
-	node->initInterior(dim, connectTreelets(roots, start, mid, totalNodes), connectTreelets(roots, mid, end, totalNodes));
-	return node;
-#if 0
-	const int bucketCount = 12; // Put everything in buckets and try to cut between the buckets. Choose the one with the best cost
-	float cost[3][bucketCount - 1];
-	for (uint32_t dim = 0; dim < 3; dim++)
+	void writeNode(const Node* node, int index)
 	{
-		struct BucketInfo {
-			int count = 0;
-			BBox bounds;
-		};
-		BucketInfo buckets[16];
-		for (int i = start; i < end; i++) // Put into buckets
+		LinearNode* linearNode = &m_SearchNodes[index];
+		linearNode->bounds = node->bounds;
+		linearNode->primitiveCount = node->primitiveCount;
+		if (node->primitiveCount > 0)
+			linearNode->primitivesOffset = node->firstPrimOffset;
+		else
+			linearNode->axis = node->splitAxis;
+	}
+
+	/// Siblings are stored as pairs filling one cache line, so the traversal pulls in both children with one miss
+	///	Pairs of the top TREELET_DEPTH levels of a subtree are stored together breadth first, so a treelet spans at most two pages,
+	///	and treelets hanging below are laid out depth first after it, a van Emde Boas like clustering of the tree
+	///	Treelets are only cache line aligned, padding each to a page boundary would waste most of the pages of the small ones near the leaves
+	void layoutTreelets(Node* root)
+	{
+		writeNode(root, 0);
+		int next = 2;
+		std::vector<std::pair<Node*, int>> treeletRoots = { { root, 0 } }, level, nextLevel;
+		while (!treeletRoots.empty())
 		{
-			float centroid = (roots[i]->bounds.min[dim] + roots[i]->bounds.max[dim]) * 0.5f;
-			int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
-			if (b >= bucketCount)
-				b = bucketCount - 1;
-			if (b < 0)
+			level.assign(1, treeletRoots.back());
+			treeletRoots.pop_back();
+			for (int depth = 0; depth < TREELET_DEPTH && !level.empty(); depth++)
+			{
+				nextLevel.clear();
+				for (const auto& [node, index] : level)
+				{
+					if (node->primitiveCount > 0)
+						continue;
+					m_SearchNodes[index].childrenOffset = next;
+					for (int c = 0; c < 2; c++)
+					{
+						writeNode(node->children[c], next + c);
+						nextLevel.push_back({ node->children[c], next + c });
+					}
+					next += 2;
+				}
+				level.swap(nextLevel);
+			}
+			// Reversed so the first subtree is laid out right after this treelet
+			for (auto it = level.rbegin(); it != level.rend(); ++it)
+			{
+				if (it->first->primitiveCount == 0)
+					treeletRoots.push_back(*it);
+			}
+		}
+	}
+
+	/// @return index of the first child of an interior node, depends on m_Layout
+	int firstChild(const LinearNode* node, int nodeIndex) const
+	{
+		return m_Layout == NodeLayout::Treelets ? node->childrenOffset : nodeIndex + 1;
+	}
+
+	int secondChild(const LinearNode* node) const
+	{
+		return m_Layout == NodeLayout::Treelets ? node->childrenOffset + 1 : node->secondChildOffset;
+	}
+
+	int flatten(Node* node, int& offset)
+	{
+		// Store the tree in dfs parent left right order
+		LinearNode* linearNode = &m_SearchNodes[offset];
+		linearNode->bounds = node->bounds;
+		int myOffset = offset++;
+		if (node->primitiveCount > 0)
+		{
+			linearNode->primitivesOffset = node->firstPrimOffset;
+			linearNode->primitiveCount = node->primitiveCount;
+		}
+		else
+		{
+			linearNode->axis = node->splitAxis;
+			linearNode->primitiveCount = 0;
+			flatten(node->children[0], offset);
+			linearNode->secondChildOffset = flatten(node->children[1], offset);
+		}
+		return myOffset;
+	}
+
+	/// Resumable state of a single ray traversal, allows interleaving many rays on the same thread
+	struct TraversalState
+	{
+		void init(const Ray& ray)
+		{
+			invDir = ray.dir.inverted();
+			negativeDir[0] = invDir.x < 0;
+			negativeDir[1] = invDir.y < 0;
+			negativeDir[2] = invDir.z < 0;
+			toVisitOffset = 0;
+			currentNodeIndex = 0;
+		}
+
+		vec3 invDir;
+		int negativeDir[3];
+		// Offset of next element in stack, offset in nodes list
+		int toVisitOffset, currentNodeIndex;
+		int nodesToVisit[TRAVERSAL_STACK_SIZE];
+	};
+
+	/// Slab test against the ray segment (0, tMax), so nodes behind the closest hit found so far are culled
+	static bool intersectBounds(const BBox& bounds, const Ray& ray, const TraversalState& state, float tMax)
+	{
+		float t0 = 0, t1 = tMax;
+		for (int i = 0; i < 3; i++)
+		{
+			float tNear = ((state.negativeDir[i] ? bounds.max[i] : bounds.min[i]) - ray.origin[i]) * state.invDir[i];
+			float tFar = ((state.negativeDir[i] ? bounds.min[i] : bounds.max[i]) - ray.origin[i]) * state.invDir[i];
+			tFar *= 1 + 2 * bounds.gamma(3);
+			// written so that NaN from a zero direction component leaves the interval unchanged
+			t0 = tNear > t0 ? tNear : t0;
+			t1 = tFar < t1 ? tFar : t1;
+		}
+		return t0 <= t1;
+	}
+
+	/// Process a single node for the ray and prefetch the node it will visit next
+	/// @param leaf [out] - if not null, a leaf reached is stored here instead of intersected, and the ray has to wait for it
+	///	                    before its next step, currentNodeIndex is left -1 when the leaf is the last node to visit
+	/// @return true when there is nothing more to visit
+	bool traverseStep(TraversalState& state, const Ray& ray, float tMin, float& tMax, Intersection& intersection, bool& hit, int* leaf = nullptr)
+	{
+		const LinearNode* node = &m_SearchNodes[state.currentNodeIndex];
+		if (intersectBounds(node->bounds, ray, state, tMax))
+		{
+			if (node->primitiveCount > 0) // leaf
+			{
+				if (leaf)
+				{
+					*leaf = state.currentNodeIndex;
+					if (state.toVisitOffset == 0)
+					{
+						state.currentNodeIndex = -1;
+						return false;
+					}
+					state.currentNodeIndex = state.nodesToVisit[--state.toVisitOffset];
+					prefetch(&m_SearchNodes[state.currentNodeIndex]);
+					return false;
+				}
+				for (int i = 0; i < node->primitiveCount; i++)
+				{
+					if (m_List->intersectPrimitive(m_FinalPrims[node->primitivesOffset + i], ray, tMin, tMax, intersection))
+					{
+						// return true;
+						hit = true; // Need to keep going, since there might be closer intersections, so just update
+						tMax = intersection.t;
+					}
+				}
+
+				if (state.toVisitOffset == 0) return true;
+				state.currentNodeIndex = state.nodesToVisit[--state.toVisitOffset];
+			}
+			else // interior, so visit child
+			{
+				if (state.negativeDir[node->axis]) // if the axis we split on has negative direction, visit the second child. In 2D this is:
+				{
+					/*
+					Let's say we split on the x axis. Then we want to visit the second child first if the ray is going from right to left, and the first child if the ray is going from left to right.
+					This way we can easily discard the second child, since it would hit the box on the left and it's closer
+	
+			   *
+				\
+				 \
+				  \
+				   >
+	
+					---------   |
+					|       |   |
+					|       |   |
+					---------   |     ---------
+								|     |       |
+								|     |       |
+								|     ---------
+								| 
+					*/
+					state.nodesToVisit[state.toVisitOffset++] = firstChild(node, state.currentNodeIndex);
+					state.currentNodeIndex = secondChild(node);
+				}
+				else
+				{
+					state.nodesToVisit[state.toVisitOffset++] = secondChild(node);
+					state.currentNodeIndex = firstChild(node, state.currentNodeIndex);
+				}
+			}
+		}
+		else
+		{
+			if (state.toVisitOffset == 0)
+				return true;
+			state.currentNodeIndex = state.nodesToVisit[--state.toVisitOffset];
+		}
+		prefetch(&m_SearchNodes[state.currentNodeIndex]);
+		return false;
+	}
+
+	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		if (!isBuilt())
+			return false;
+
+		TraversalState state;
+		state.init(ray);
+		bool hit = false;
+		while (!traverseStep(state, ray, tMin, tMax, intersection, hit));
+		return hit;
+	}
+
+	void intersectBatch(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits) override
+	{
+		if (!isBuilt())
+			return;
+		if (m_List->batchesPrimitives())
+		{
+			intersectBatchGathered(rays, count, tMin, tMax, intersections, hits);
+			return;
+		}
+
+		// Each lane does one node then switches to the next, by the time it gets back the prefetched node should be loaded
+		TraversalState states[PIPELINE_WIDTH];
+		int rayIndices[PIPELINE_WIDTH];
+		int active = 0, nextRay = 0;
+		for (; active < PIPELINE_WIDTH && nextRay < count; active++)
+		{
+			rayIndices[active] = nextRay;
+			states[active].init(rays[nextRay++]);
+		}
+		while (active > 0)
+		{
+			for (int lane = 0; lane < active;)
+			{
+				const int r = rayIndices[lane];
+				if (traverseStep(states[lane], rays[r], tMin, tMax[r], intersections[r], hits[r]))
+				{
+					if (nextRay < count)
+					{
+						rayIndices[lane] = nextRay;
+						states[lane].init(rays[nextRay++]);
+					}
+					else // no more rays, move the last lane here
+					{
+						active--;
+						rayIndices[lane] = rayIndices[active];
+						states[lane] = states[active];
+						continue;
+					}
+				}
+				lane++;
+			}
+		}
+	}
+
+	/// Same as intersectBatch, but a lane that reaches a leaf waits there, and once every lane waits or is done the rays
+	///	waiting at the same primitive are passed to the list together, so primitives with their own trees interleave them too
+	void intersectBatchGathered(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits)
+	{
+		TraversalState states[PIPELINE_WIDTH];
+		int rayIndices[PIPELINE_WIDTH];
+		int leaves[PIPELINE_WIDTH]; // leaf node each lane waits at, -1 while it traverses
+		int active = 0, nextRay = 0, waiting = 0;
+		for (; active < PIPELINE_WIDTH && nextRay < count; active++)
+		{
+			rayIndices[active] = nextRay;
+			leaves[active] = -1;
+			states[active].init(rays[nextRay++]);
+		}
+		while (active > 0)
+		{
+			if (waiting == active)
+			{
+				intersectWaiting(leaves, rayIndices, active, rays, tMin, tMax, intersections, hits);
+				waiting = 0;
+			}
+			for (int lane = 0; lane < active;)
+			{
+				if (leaves[lane] != -1)
+				{
+					lane++;
+					continue;
+				}
+				const int r = rayIndices[lane];
+				if (states[lane].currentNodeIndex == -1 || traverseStep(states[lane], rays[r], tMin, tMax[r], intersections[r], hits[r], &leaves[lane]))
+				{
+					if (nextRay < count)
+					{
+						rayIndices[lane] = nextRay;
+						states[lane].init(rays[nextRay++]);
+					}
+					else // no more rays, move the last lane here
+					{
+						active--;
+						rayIndices[lane] = rayIndices[active];
+						leaves[lane] = leaves[active];
+						states[lane] = states[active];
+						continue;
+					}
+				}
+				else if (leaves[lane] != -1)
+				{
+					waiting++;
+				}
+				lane++;
+			}
+		}
+	}
+
+	/// Intersect the leaves the lanes wait at, each with all rays waiting at it passed on together
+	///	Primitives of a leaf are gone through in order, so each ray tests them in the same order as on its own
+	void intersectWaiting(int* leaves, const int* rayIndices, int active, const Ray* rays, float tMin, float* tMax, Intersection* intersections, bool* hits)
+	{
+		for (int lane = 0; lane < active; lane++)
+		{
+			const int leafIndex = leaves[lane];
+			if (leafIndex == -1) // done with a lane before
+				continue;
+			int group[PIPELINE_WIDTH];
+			int groupCount = 0;
+			for (int other = lane; other < active; other++)
+			{
+				if (leaves[other] == leafIndex)
+				{
+					group[groupCount++] = rayIndices[other];
+					leaves[other] = -1;
+				}
+			}
+			const LinearNode& leaf = m_SearchNodes[leafIndex];
+			for (int i = 0; i < leaf.primitiveCount; i++)
+			{
+				const int primitive = m_FinalPrims[leaf.primitivesOffset + i];
+				if (groupCount > 1)
+				{
+					m_List->intersectPrimitiveBatch(primitive, rays, group, groupCount, tMin, tMax, intersections, hits);
+				}
+				else if (m_List->intersectPrimitive(primitive, rays[group[0]], tMin, tMax[group[0]], intersections[group[0]]))
+				{
+					tMax[group[0]] = intersections[group[0]].t;
+					hits[group[0]] = true;
+				}
+			}
+		}
+	}
+
+	void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
+	{
+		if (!isBuilt())
+			return;
+
+		int toVisitOffset = 0, currentNodeIndex = 0;
+		int nodesToVisit[TRAVERSAL_STACK_SIZE];
+		while (true)
+		{
+			const LinearNode* node = &m_SearchNodes[currentNodeIndex];
+			if (frustum.testBox(node->bounds))
+			{
+				if (node->primitiveCount > 0) // leaf
+				{
+					for (int i = 0; i < node->primitiveCount; i++)
+						visible.push_back(m_FinalPrims[node->primitivesOffset + i]);
+				}
+				else // order does not matter here, always go left first
+				{
+					nodesToVisit[toVisitOffset++] = secondChild(node);
+					currentNodeIndex = firstChild(node, currentNodeIndex);
+					continue;
+				}
+			}
+			if (toVisitOffset == 0)
+				break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+
+};
+
+BVHTree::Node* BVHTree::connectTreelets(std::vector<Node*>& roots, int start, int end, int& totalNodes, Arena& arena) const
+{
+	int nodeCount = end - start;
+	if (nodeCount== 1) return roots[start];
+	totalNodes++;
+	Node* node = arena.allocate<Node>();
+	BBox bounds;
+	for (int i = start; i < end; i++)
+		bounds.add(roots[i]->bounds);
+
+	// Only considering the centroids of objects. With these scenes the objects are pretty much the same size, but with differently sized objects this wouldn't work as well
+	BBox centroidBounds;
+	for (int i = start; i < end; i++)
+	{
+		vec3 centroid = (roots[i]->bounds.min + roots[i]->bounds.max) * 0.5f;
+		centroidBounds.add(centroid);
+	}
+
+	int dim = centroidBounds.maxExtent(); // Divide on largest axis, Maybe worth checking all 3?
+	if (centroidBounds.max[dim] == centroidBounds.min[dim]) // all centroids in one spot, buckets can't split them
+	{
+		const int mid = (start + end) / 2;
+		node->initInterior(dim, connectTreelets(roots, start, mid, totalNodes, arena), connectTreelets(roots, mid, end, totalNodes, arena));
+		return node;
+	}
+	const int bucketCount = 12; // Put everything in buckets and try to cut between the buckets. Choose the one with the best cost
+	struct BucketInfo {
+		int count = 0;
+		BBox bounds;
+	};
+	BucketInfo buckets[16];
+	for (int i = start; i < end; i++) // Put into buckets
+	{
+		float centroid = (roots[i]->bounds.min[dim] + roots[i]->bounds.max[dim]) * 0.5f;
+		int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
+		if (b >= bucketCount)
+			b = bucketCount - 1;
+		buckets[b].count++;
+		buckets[b].bounds.add(roots[i]->bounds);
+		// printf("%f, %d %d\n", centroid, b);
+	}
+
+	const float traversalCost = 0.125f; // cost of figuring out which child to visit
+
+	float cost[bucketCount - 1];
+	// printf("Start: %d, end: %d, dim: %d\n", start, end, dim);
+	// printf("Centroid: %f, %f, %f\n", centroidBounds.min.x, centroidBounds.min.y, centroidBounds.min.z);
+	// printf("Centroid: %f, %f, %f\n", centroidBounds.max.x, centroidBounds.max.y, centroidBounds.max.z);
+	for (int i = 0; i < bucketCount - 1; i++)
+	{
+		// printf("Bucket %d: %d\n", i, buckets[i].count);
+		BBox b0, b1;
+		int count0 = 0, count1 = 0;
+		for (int j = 0; j <= i; j++)
+		{
+			b0.add(buckets[j].bounds);
+			count0 += buckets[j].count;
+		}
+		for (int j = i + 1; j < bucketCount; j++)
+		{
+			b1.add(buckets[j].bounds);
+			count1 += buckets[j].count;
+		}
+		cost[i] = traversalCost + m_IntersectionCost * (count0 * b0.area() + count1 * b1.area()) / bounds.area();
+	}
+
+	float minCost = cost[0];
+	int minCostBucketIdx = 0;
+	for (int i = 1; i < bucketCount - 1; i++)
+	{
+		if (cost[i] < minCost)
+		{
+			minCost = cost[i];
+			minCostBucketIdx = i;
+		}
+	}
+
+	// pbr book guys soo smart
+	Node** pmid = std::partition(&roots[start], &roots[end - 1] + 1, [=](const Node* node)
+		{
+			float centroid = (node->bounds.min[dim] + node->bounds.max[dim]) * 0.5f;
+			int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
+			if (b >= bucketCount)
+				b = bucketCount - 1;
+			return b <= minCostBucketIdx;
+		});
+	int mid = pmid - &roots[0];
+	if (mid == start || mid == end)
+		mid = (start + end) / 2;
+	node->initInterior(dim, connectTreelets(roots, start, mid, totalNodes, arena), connectTreelets(roots, mid, end, totalNodes, arena));
+	return node;
+#if 0
+	const int bucketCount = 12; // Put everything in buckets and try to cut between the buckets. Choose the one with the best cost
+	float cost[3][bucketCount - 1];
+	for (uint32_t dim = 0; dim < 3; dim++)
+	{
+		struct BucketInfo {
+			int count = 0;
+			BBox bounds;
+		};
+		BucketInfo buckets[16];
+		for (int i = start; i < end; i++) // Put into buckets
+		{
+			float centroid = (roots[i]->bounds.min[dim] + roots[i]->bounds.max[dim]) * 0.5f;
+			int b = bucketCount * (((centroid - centroidBounds.min[dim]) / (centroidBounds.max[dim] - centroidBounds.min[dim])));
+			if (b >= bucketCount)
+				b = bucketCount - 1;
+			if (b < 0)
 				b = 0;
 			buckets[b].count++;
 			buckets[b].bounds.add(roots[i]->bounds);
 			// printf("%f, %d %d\n", centroid, b);
 		}
 
-		const float traversalCost = 0.125f; // cost of figuring out which child to visit
-		const float intersectionCost = 1.0f; // cost of calculating intersection, since here it also goes through a few virtual calls it should be slower
-		
-	// printf("Start: %d, end: %d, dim: %d\n", start, end, dim);
-	// printf("Centroid: %f, %f, %f\n", centroidBounds.min.x, centroidBounds.min.y, centroidBounds.min.z);
-	// printf("Centroid: %f, %f, %f\n", centroidBounds.max.x, centroidBounds.max.y, centroidBounds.max.z);
-		for (int i = 0; i < bucketCount - 1; i++)
+		const float traversalCost = 0.125f; // cost of figuring out which child to visit
+		const float intersectionCost = 1.0f; // cost of calculating intersection, since here it also goes through a few virtual calls it should be slower
+		
+	// printf("Start: %d, end: %d, dim: %d\n", start, end, dim);
+	// printf("Centroid: %f, %f, %f\n", centroidBounds.min.x, centroidBounds.min.y, centroidBounds.min.z);
+	// printf("Centroid: %f, %f, %f\n", centroidBounds.max.x, centroidBounds.max.y, centroidBounds.max.z);
+		for (int i = 0; i < bucketCount - 1; i++)
+		{
+			// printf("Bucket %d: %d\n", i, buckets[i].count);
+			BBox b0, b1;
+			int count0 = 0, count1 = 0;
+			for (int j = 0; j <= i; j++)
+			{
+				b0.add(buckets[j].bounds);
+				count0 += buckets[j].count;
+			}
+			for (int j = 0; j <= i; j++)
+			{
+				b1.add(buckets[j].bounds);
+				count1 += buckets[j].count;
+			}
+			cost[dim][i] = traversalCost + intersectionCost * (count0 * b0.area() + count1 * b1.area()) / bounds.area();
+		}
+
+	}
+	uint32_t minDim = 0;
+	float minCost = cost[0][0];
+	int minCostBucketIdx = 0;
+	for (uint32_t d = 0; d < 3; d++)
+	{
+		for (int i = 1; i < bucketCount - 1; i++)
+		{
+			if (cost[d][i] < minCost)
+			{
+				minCost = cost[d][i];
+				minDim = d;
+				minCostBucketIdx = i;
+			}
+		}
+	}
+
+	Node** pmid = std::partition(&roots[start], &roots[end - 1] + 1, [=](const BVHBuildNode* node)
+		{
+			float centroid = (node->bounds.min[minDim] + node->bounds.max[minDim]) * 0.5f;
+			int b = bucketCount * (((centroid - centroidBounds.min[minDim]) / (centroidBounds.max[minDim] - centroidBounds.min[minDim])));
+			if (b >= bucketCount)
+				b = bucketCount - 1;
+			if (b < 0)
+				b = 0;
+			return b <= minCostBucketIdx;
+		});
+	int mid = pmid - &roots[0];
+	node->initInterior(minDim, connectTreelets(roots, start, mid, totalNodes, arena), connectTreelets(roots, mid, end, totalNodes, arena));
+	return node;
+#endif
+}
+
+#include "Primitive.h"
+
+const float traversalCost = 1.0f;
+const float emptyBonus = 0.5f;
+
+#define uint int
+
+class KDTree : public IntersectionAccelerator
+{
+	// PBR Book layout
+	struct Node
+	{
+		void initLeaf(uint32_t* prims, int pc, std::vector<uint32_t>& primIds)
+		{
+			flags = 3;
+			primCount |= (pc << 2);
+			if (pc == 0)
+				onePrim = 0;
+			else if (pc == 1)
+				onePrim = prims[0];
+			else
+			{
+				primIdxOffset = primIds.size();
+				// printf("PrimIds: %d, pc=%d, primCount=%d", (int)primIds.size(), pc, primCount);
+				for (uint32_t i = 0; i < pc; i++)
+					primIds.push_back(prims[i]);
+			}
+		}
+
+		float splitPos() const { return split; }
+		bool isLeaf() const { return (flags & 3) == 3; }
+		uint8_t splitAxis() const { return flags & 3; }
+		uint32_t getPrimCount() const { return primCount >> 2; }
+		uint32_t getAboveChild() const { return aboveChild >> 2; }
+
+		void initInterior(uint8_t ax, uint32_t aboveCh, float s)
+		{
+			flags = ax;
+			split = s;
+			aboveChild |= (aboveCh << 2);
+		}
+
+		union {
+			float split;
+			uint32_t onePrim;
+			uint32_t primIdxOffset;
+		};
+	private:
+		union {
+			uint32_t flags;
+			uint32_t primCount;
+			uint32_t aboveChild;
+		};
+	};
+
+	struct KdToDo
+	{
+		const Node* node;
+		float tMin, tMax;
+	};
+
+	struct BoundEdge
+	{
+		float t;
+		int primIdx;
+		bool startingEdge;
+
+		BoundEdge() = default;
+		BoundEdge(float t, int primIdx, bool starting) : startingEdge(starting), t(t), primIdx(primIdx)
+		{
+
+		}
+	};
+
+	~KDTree()
+	{
+		clear();
+	}
+
+	virtual void setPrimitives(PrimitiveList* list) override
+	{
+		m_List = list;
+	}
+
+	virtual void setParameters(const BuildParameters& parameters) override
+	{
+		m_Parameters = parameters;
+	}
+
+	virtual void clear() override
+	{
+		// printf("\nClearing\n");
+		// for (uint32_t i = 0; i < m_NextFreeNode; i++)
+			// printf("%d ", m_Nodes[i].isLeaf());
+
+		m_Arena.release();
+		m_Nodes = nullptr;
+		m_NextFreeNode = m_Allocated = 0;
+		m_PrimIds.clear();
+		m_Bounds = BBox();
+	}
+
+	virtual void build(Purpose purpose) override
+	{
+		if (purpose == Purpose::Instances)
+		{
+			m_MaxPrimsPerNode = 1;
+			m_IntersectionCost = 160.0f;
+		}
+		else
+		{
+			m_MaxPrimsPerNode = 4;
+			m_IntersectionCost = 80.0f;
+		}
+		if (m_Parameters.maxLeafPrimitives > 0)
+			m_MaxPrimsPerNode = m_Parameters.maxLeafPrimitives;
+		if (m_Parameters.intersectionCost > 0.f)
+			m_IntersectionCost = m_Parameters.intersectionCost;
+		Timer timer;
+		const size_t primitiveCount = m_List->primitiveCount();
+		printf("Building %s KDTree with %d primitives\n", purpose == Purpose::Instances ? "instancing" : "mesh", (int)primitiveCount);
+		m_MaxDepth = std::round(8 + 1.3f * std::log2(primitiveCount)); // pbr book
+		if (m_Parameters.maxDepth > 0)
+			m_MaxDepth = m_Parameters.maxDepth;
+
+		std::vector<BBox> primitiveBounds;
+		primitiveBounds.reserve(primitiveCount);
+		for (size_t i = 0; i < primitiveCount; i++)
+		{
+			BBox b;
+			m_List->expandPrimitiveBox(i, b);
+			primitiveBounds.push_back(b);
+			m_Bounds.add(b);
+		}
+		Arena scratch;
+		for (int attempt = 0; ; attempt++)
+		{
+			// Each attempt starts the scratch over, a shallower retry needs less of it for prims1
+			scratch.reset();
+			BoundEdge* edges[3];
+			for (uint32_t i = 0; i < 3; i++)
+				edges[i] = scratch.allocateUninitialized<BoundEdge>(2 * primitiveCount);
+			uint32_t* prims0 = scratch.allocateUninitialized<uint32_t>(primitiveCount);
+			uint32_t* prims1 = scratch.allocateUninitialized<uint32_t>((m_MaxDepth + 1) * primitiveCount);
+			uint32_t* primIds = scratch.allocateUninitialized<uint32_t>(primitiveCount);
+			for (size_t i = 0; i < primitiveCount; i++)
+				primIds[i] = i;
+
+			m_OverBudget = false;
+			build(0, m_Bounds, primitiveBounds, primIds, primitiveCount, m_MaxDepth, edges, prims0, prims1);
+			if (!m_OverBudget || attempt == MAX_BUDGET_RETRIES || m_Parameters.maxBytes == 0)
+				break;
+			// Budget ran out in the first branches built, a shallower tree spreads it over the whole scene
+			const BBox bounds = m_Bounds;
+			clear();
+			m_Bounds = bounds;
+			m_MaxDepth = std::max(1, int(m_MaxDepth) - 4);
+			m_MaxPrimsPerNode *= 2;
+			printf("KDTree over memory budget, retrying with depth %d\n", m_MaxDepth);
+		}
+
+		// Nodes grew by doubling while building, the tree keeps just the ones used
+		Node* nodes = m_Arena.allocateUninitialized<Node>(m_NextFreeNode);
+		std::memcpy(nodes, m_Nodes, m_NextFreeNode * sizeof(Node));
+		m_Nodes = nodes;
+		m_Allocated = m_NextFreeNode;
+		std::vector<Node>().swap(m_BuildNodes);
+		m_PrimIds.shrink_to_fit();
+
+		// printf("Prims %d==%d\n", primCount, primitiveCount);
+		LOG_ACCEL_BUILD(AcceleratorType::KDTree, timer.toMs<float>(timer.elapsedNs() / 1000.0f), m_NextFreeNode, uint32_t(byteCount()));
+		printf("Built KDTree with %d nodes in %f seconds\n", m_NextFreeNode, Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
+	}
+
+	void build(uint32_t nodeIdx, const BBox& curBounds, const std::vector<BBox>& bounds, uint32_t* primIds, size_t primCount, uint32_t depthLeft, BoundEdge* edges[3], uint32_t* prims0, uint32_t* prims1, uint32_t badRefines = 0)
+	{
+		if (m_NextFreeNode == m_Allocated)
+		{
+			uint32_t alloc = std::max(2 * m_Allocated, 512U);
+			// Past the budget only the leaves of pending subtrees are added, no need to double for them
+			if (m_Parameters.maxBytes >= 0)
+				alloc = std::min<int64_t>(alloc, std::max<int64_t>(m_Allocated + 64, m_Parameters.maxBytes / sizeof(Node)));
+			// The old array is freed as the buffer grows, and the buffer is kept across retries
+			m_BuildNodes.resize(alloc);
+			m_Nodes = m_BuildNodes.data();
+			m_Allocated = alloc;
+		}
+		
+		m_NextFreeNode++;
+
+		if (primCount <= m_MaxPrimsPerNode || depthLeft == 0 || overBudget()) // We can create a leaf here
+		{
+			m_Nodes[nodeIdx].initLeaf(primIds, primCount, m_PrimIds);
+			return;
+		}
+
+		int bestAxis = -1;
+		int bestOffset = -1;
+		float bestCost = std::numeric_limits<float>::infinity();
+		float oldCost = m_IntersectionCost * primCount;
+		float invArea = 1.0f / curBounds.area();
+		vec3 diag = curBounds.max - curBounds.min;
+
+		int axis = curBounds.maxExtent();
+		int retries = 0;
+
+	tryAxis: // pbr book's fault
+		for (int i = 0; i < primCount; i++)
+		{
+			uint32_t pn = primIds[i];
+			edges[axis][2 * i] = BoundEdge(bounds[pn].min[axis], pn, true);
+			edges[axis][2 * i + 1] = BoundEdge(bounds[pn].max[axis], pn, false);
+		}
+
+		std::sort(&edges[axis][0], &edges[axis][2 * primCount], [](const BoundEdge& a, const BoundEdge& b) {
+			if (a.t == b.t) // wtf pbr book?
+			{
+				int aa = a.startingEdge ? 0 : 1;
+				int bb = b.startingEdge ? 0 : 1;
+				return aa < bb;
+			}
+			else
+				return a.t < b.t;
+			});
+
+		int belowCount = 0, aboveCount = primCount;
+		for (uint32_t i = 0; i < 2 * primCount; i++)
+		{
+			if (!edges[axis][i].startingEdge) aboveCount--;
+			float t = edges[axis][i].t;
+			if (t > curBounds.min[axis] && t < curBounds.max[axis])
+			{
+				int otherAxis1 = (axis + 1) % 3, otherAxis2 = (axis + 2) % 3;
+				float belowArea = 2 * (diag[otherAxis1] * diag[otherAxis2] + (t - curBounds.min[axis]) * (diag[otherAxis1] + diag[otherAxis2]));
+				float aboveArea = 2 * (diag[otherAxis1] * diag[otherAxis2] + (curBounds.max[axis] - t) * (diag[otherAxis1] + diag[otherAxis2]));
+
+				float belowProb = belowArea * invArea;
+				float aboveProb = aboveArea * invArea;
+
+				float bonus = (aboveCount == 0 || belowCount == 0) ? emptyBonus : 0;
+				float cost = traversalCost + m_IntersectionCost * (1 - bonus) * (belowProb * belowCount + aboveProb * aboveCount);
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestOffset = i;
+				}
+			}
+			if (edges[axis][i].startingEdge) belowCount++;
+		}
+
+		if (bestAxis == -1 && retries < 2)
+		{
+			retries++;
+			axis = (axis + 1) % 3; // check next axis;
+			goto tryAxis;
+		}
+		assert(belowCount == primCount && aboveCount == 0);
+		if (bestCost > oldCost) ++badRefines;
+		if ((bestCost > 4 * oldCost && primCount < 16) || bestAxis == -1 || badRefines == 3)
+		{
+			m_Nodes[nodeIdx].initLeaf(primIds, primCount, m_PrimIds);
+			return;
+		}
+
+		int n0 = 0, n1 = 0;
+		for (uint32_t i = 0; i < bestOffset; i++)
+		{
+			if (edges[bestAxis][i].startingEdge)
+				prims0[n0++] = edges[bestAxis][i].primIdx;
+		}
+
+		for (uint32_t i = bestOffset + 1; i < 2 * primCount; i++)
+		{
+			if (!edges[bestAxis][i].startingEdge)
+				prims1[n1++] = edges[bestAxis][i].primIdx;
+		}
+
+		float tSplit = edges[bestAxis][bestOffset].t;
+		BBox bounds0 = curBounds, bounds1 = curBounds;
+		bounds0.max[bestAxis] = bounds1.min[bestAxis] = tSplit;
+		build(nodeIdx + 1, bounds0, bounds, prims0, n0, depthLeft - 1, edges, prims0, prims1 + primCount, badRefines);
+
+		m_Nodes[nodeIdx].initInterior(bestAxis, m_NextFreeNode, tSplit);
+		build(m_NextFreeNode, bounds1, bounds, prims1, n1, depthLeft - 1, edges, prims0, prims1 + primCount, badRefines);
+	}
+
+	/// Checked before splitting a node, the tree is finished with leaves once the built part takes the whole budget
+	bool overBudget()
+	{
+		if (m_Parameters.maxBytes >= 0 && int64_t(m_NextFreeNode * sizeof(Node) + m_PrimIds.size() * sizeof(uint32_t)) >= m_Parameters.maxBytes)
+			m_OverBudget = true;
+		return m_OverBudget;
+	}
+
+	virtual bool isBuilt() const override
+	{
+		return m_Nodes != nullptr;
+	}
+
+	int64_t byteCount() const override
+	{
+		if (!isBuilt())
+			return 0;
+		return m_Arena.bytesUsed() + sizeof(*this) + sizeof(m_PrimIds[0]) * m_PrimIds.capacity();
+	}
+
+	/// Resumable state of a single ray traversal, allows interleaving many rays on the same thread
+	struct TraversalState
+	{
+		/// @return false if the ray misses the tree
+		bool init(const Ray& ray, float tMin, float tMax, const BBox& treeBounds)
+		{
+			this->tMin = tMin;
+			this->tMax = tMax;
+			if (!treeBounds.intersectP(ray, this->tMin, this->tMax))
+				return false;
+			invDir = ray.dir.inverted();
+			todoIdx = 0;
+			node = nullptr;
+			return true;
+		}
+
+		static const int maxTodos = 64;
+		const Node* node;
+		float tMin, tMax; // Part of the ray inside the current node
+		vec3 invDir;
+		int todoIdx;
+		KdToDo todos[maxTodos];
+	};
+
+	/// Process a single node for the ray and prefetch the node it will visit next
+	/// @param tMin, tMax - range for primitive intersections, tMax is updated with each hit
+	/// @return true when there is nothing more to visit
+	bool traverseStep(TraversalState& state, const Ray& ray, float tMin, float& tMax, Intersection& intersection, bool& hit)
+	{
+		if (tMax < state.tMin)
+			return true;
+
+		const Node* node = state.node;
+		if (!node->isLeaf())
+		{
+			uint8_t axis = node->splitAxis();
+			float plane = (node->splitPos() - ray.origin[axis]) * state.invDir[axis];
+
+			const Node* firstChild, *secondChild;
+			uint32_t below = (ray.origin[axis] < node->splitPos()) || (ray.origin[axis] == node->splitPos() && ray.dir[axis] <= 0);
+			if (below)
+			{
+				firstChild = node + 1;
+				secondChild = &m_Nodes[node->getAboveChild()];
+			}
+			else
+			{
+				firstChild = &m_Nodes[node->getAboveChild()];
+				secondChild = node + 1;
+			}
+
+			if (plane > state.tMax || plane <= 0)
+				state.node = firstChild;
+			else if (plane < state.tMin)
+				state.node = secondChild;
+			else
+			{
+				state.todos[state.todoIdx].node = secondChild;
+				state.todos[state.todoIdx].tMin = plane;
+				state.todos[state.todoIdx].tMax = state.tMax;
+				state.todoIdx++;
+				state.node = firstChild;
+				state.tMax = plane;
+			}
+		}
+		else
+		{
+			uint32_t primCount = node->getPrimCount();
+			if (primCount == 1)
+			{
+				if (m_List->intersectPrimitive(node->onePrim, ray, tMin, tMax, intersection))
+				{
+					hit = true;
+					tMax = intersection.t;
+				}
+			}
+			else
+			{
+				for (uint32_t i = 0; i < primCount; i++)
+				{
+					uint32_t idx = m_PrimIds[node->primIdxOffset + i];
+					if (m_List->intersectPrimitive(idx, ray, tMin, tMax, intersection))
+					{
+						hit = true;
+						tMax = intersection.t;
+					}
+				}
+			}
+
+			if (state.todoIdx > 0)
+			{
+				state.todoIdx--;
+				state.node = state.todos[state.todoIdx].node;
+				state.tMin = state.todos[state.todoIdx].tMin;
+				state.tMax = state.todos[state.todoIdx].tMax;
+			}
+			else
+				return true;
+		}
+		prefetch(state.node);
+		return false;
+	}
+
+	virtual bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		TraversalState state;
+		if (!state.init(ray, tMin, tMax, m_Bounds))
+			return false;
+		state.node = &m_Nodes[0];
+
+		bool hit = false;
+		while (!traverseStep(state, ray, tMin, tMax, intersection, hit));
+		return hit;
+	}
+
+	virtual void intersectBatch(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits) override
+	{
+		// Each lane does one node then switches to the next, by the time it gets back the prefetched node should be loaded
+		TraversalState states[PIPELINE_WIDTH];
+		int rayIndices[PIPELINE_WIDTH];
+		int active = 0, nextRay = 0;
+		auto startRay = [&](int lane) -> bool {
+			while (nextRay < count)
+			{
+				const int r = nextRay++;
+				if (states[lane].init(rays[r], tMin, tMax[r], m_Bounds))
+				{
+					states[lane].node = &m_Nodes[0];
+					rayIndices[lane] = r;
+					return true;
+				}
+			}
+			return false;
+		};
+
+		while (active < PIPELINE_WIDTH && startRay(active))
+			active++;
+		while (active > 0)
+		{
+			for (int lane = 0; lane < active;)
+			{
+				const int r = rayIndices[lane];
+				if (traverseStep(states[lane], rays[r], tMin, tMax[r], intersections[r], hits[r]) && !startRay(lane))
+				{
+					// no more rays, move the last lane here
+					active--;
+					rayIndices[lane] = rayIndices[active];
+					states[lane] = states[active];
+					continue;
+				}
+				lane++;
+			}
+		}
+	}
+
+	virtual void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
+	{
+		if (!isBuilt())
+			return;
+
+		struct CullToDo
+		{
+			const Node* node;
+			BBox bounds;
+		};
+		const int maxTodos = 64;
+		CullToDo todos[maxTodos];
+		int todoIdx = 0;
+		todos[todoIdx++] = { &m_Nodes[0], m_Bounds };
+		while (todoIdx > 0)
+		{
+			todoIdx--;
+			const Node* node = todos[todoIdx].node;
+			const BBox bounds = todos[todoIdx].bounds;
+			if (!frustum.testBox(bounds))
+				continue;
+
+			if (!node->isLeaf())
+			{
+				uint8_t axis = node->splitAxis();
+				BBox below = bounds, above = bounds;
+				below.max[axis] = above.min[axis] = node->splitPos();
+				todos[todoIdx++] = { node + 1, below };
+				todos[todoIdx++] = { &m_Nodes[node->getAboveChild()], above };
+			}
+			else
+			{
+				uint32_t primCount = node->getPrimCount();
+				if (primCount == 1)
+					visible.push_back(node->onePrim);
+				else
+				{
+					for (uint32_t i = 0; i < primCount; i++)
+						visible.push_back(m_PrimIds[node->primIdxOffset + i]);
+				}
+			}
+		}
+	}
+
+	Node* m_Nodes = nullptr; // in m_Arena once built, in m_BuildNodes while building
+	Arena m_Arena{ 0 }; // holds only m_Nodes, so blocks are sized to it exactly
+	std::vector<Node> m_BuildNodes; // nodes while building, empty once built
+	std::vector<uint32_t> m_PrimIds;
+	BBox m_Bounds;
+	uint32_t m_MaxDepth;
+	uint32_t m_NextFreeNode = 0, m_Allocated = 0;
+	PrimitiveList* m_List = nullptr;
+	uint32_t m_MaxPrimsPerNode = 2;
+	float m_IntersectionCost = 80.0f;
+	BuildParameters m_Parameters;
+	bool m_OverBudget = false; ///< Some node was left a leaf to stay under BuildParameters::maxBytes
+};
+
+/// BVH with one primitive per leaf which can be updated in place after it is built
+///	Primitives are inserted next to the sibling that increases the total surface area the least
+///	After many updates the tree is rebuilt top down with SAH on a background thread and swapped in on the next update
+struct DynamicBVH : IntersectionAccelerator {
+	struct Node
+	{
+		BBox bounds;
+		int parent;
+		int children[2];
+		int primitive; // -1 for interior nodes
+
+		bool isLeaf() const { return primitive >= 0; }
+	};
+
+	static const int STACK_SIZE = 256;
+	static const int MAX_DEPTH = STACK_SIZE - 32; // deeper trees are rebalanced by a background rebuild
+	static const int HARD_MAX_DEPTH = STACK_SIZE - 4; // reached before the rebuild is swapped in, the tree is rebuilt right away to keep traversal stack bounded
+	static const int SAH_BINS = 16;
+	static const size_t MAX_REPLAYED_UPDATES = 256; // more updates during a background rebuild and it is restarted instead of swapped in
+
+	PrimitiveList* m_List = nullptr;
+	std::vector<Node> m_Nodes;
+	std::vector<int> m_FreeNodes;
+	std::vector<int> m_LeafOf; // leaf node of each primitive, -1 if not in the tree
+	int m_Root = -1;
+	bool m_Built = false;
+	int m_UpdatesSinceBuild = 0;
+	bool m_RebalanceWanted = false; // an insert went over MAX_DEPTH, rebuild without waiting for more updates
+
+	// Background rebuild, updates made while it runs are replayed on the new tree
+	std::thread m_RebuildThread;
+	std::atomic<bool> m_RebuildReady{ false };
+	std::vector<Node> m_RebuiltNodes;
+	int m_RebuiltRoot = -1;
+	std::vector<int> m_ChangedDuringRebuild;
+
+	~DynamicBVH()
+	{
+		clear();
+	}
+
+	void setPrimitives(PrimitiveList* list) override
+	{
+		m_List = list;
+	}
+
+	void clear() override
+	{
+		if (m_RebuildThread.joinable())
+			m_RebuildThread.join();
+		m_RebuildReady = false;
+		m_RebuiltNodes.clear();
+		m_ChangedDuringRebuild.clear();
+		m_Nodes.clear();
+		m_FreeNodes.clear();
+		m_LeafOf.clear();
+		m_Root = -1;
+		m_Built = false;
+		m_UpdatesSinceBuild = 0;
+		m_RebalanceWanted = false;
+	}
+
+	bool isBuilt() const override { return m_Built; }
+
+	int64_t byteCount() const override
+	{
+		if (!m_Built)
+			return 0;
+		return int64_t(m_Nodes.size() * sizeof(Node) + m_LeafOf.size() * sizeof(int) + sizeof(*this));
+	}
+
+	struct BuildPrim
+	{
+		BBox bounds;
+		vec3 centroid;
+		int index;
+	};
+
+	/// @brief Build subtree over @prims[start, end) with binned SAH, appending nodes to @nodes
+	/// @return index of the subtree root
+	static int buildRecursive(std::vector<Node>& nodes, std::vector<BuildPrim>& prims, int start, int end, int parent)
+	{
+		const int nodeIndex = int(nodes.size());
+		nodes.push_back({});
+		nodes[nodeIndex].parent = parent;
+		if (end - start == 1)
+		{
+			nodes[nodeIndex].bounds = prims[start].bounds;
+			nodes[nodeIndex].primitive = prims[start].index;
+			return nodeIndex;
+		}
+		nodes[nodeIndex].primitive = -1;
+
+		BBox centroids;
+		for (int i = start; i < end; i++)
+			centroids.add(prims[i].centroid);
+		const int axis = centroids.maxExtent();
+		const float axisMin = centroids.min[axis], axisExtent = centroids.max[axis] - centroids.min[axis];
+
+		int mid = (start + end) / 2;
+		if (axisExtent > 0.f)
 		{
-			// printf("Bucket %d: %d\n", i, buckets[i].count);
-			BBox b0, b1;
-			int count0 = 0, count1 = 0;
-			for (int j = 0; j <= i; j++)
+			BBox binBounds[SAH_BINS];
+			int binCounts[SAH_BINS] = {};
+			auto binOf = [&](const BuildPrim& p) {
+				return std::min(SAH_BINS - 1, int(SAH_BINS * (p.centroid[axis] - axisMin) / axisExtent));
+			};
+			for (int i = start; i < end; i++)
 			{
-				b0.add(buckets[j].bounds);
-				count0 += buckets[j].count;
+				const int b = binOf(prims[i]);
+				binCounts[b]++;
+				binBounds[b].add(prims[i].bounds);
 			}
-			for (int j = 0; j <= i; j++)
+
+			// Sweep from the right to get the cost of each right side, then from the left to find the best split
+			float rightArea[SAH_BINS];
+			int rightCount[SAH_BINS];
+			BBox right;
+			int count = 0;
+			for (int b = SAH_BINS - 1; b > 0; b--)
 			{
-				b1.add(buckets[j].bounds);
-				count1 += buckets[j].count;
+				right.add(binBounds[b]);
+				count += binCounts[b];
+				rightArea[b] = right.area();
+				rightCount[b] = count;
+			}
+			BBox left;
+			count = 0;
+			int bestSplit = -1;
+			float bestCost = FLT_MAX;
+			for (int b = 0; b < SAH_BINS - 1; b++)
+			{
+				left.add(binBounds[b]);
+				count += binCounts[b];
+				if (count == 0 || rightCount[b + 1] == 0)
+					continue;
+				const float cost = left.area() * count + rightArea[b + 1] * rightCount[b + 1];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestSplit = b;
+				}
+			}
+			if (bestSplit >= 0)
+			{
+				mid = int(std::partition(prims.begin() + start, prims.begin() + end, [&](const BuildPrim& p) {
+					return binOf(p) <= bestSplit;
+				}) - prims.begin());
 			}
-			cost[dim][i] = traversalCost + intersectionCost * (count0 * b0.area() + count1 * b1.area()) / bounds.area();
 		}
+		if (mid == start || mid == end) // all centroids in one spot
+			mid = (start + end) / 2;
+
+		const int left = buildRecursive(nodes, prims, start, mid, nodeIndex);
+		const int right = buildRecursive(nodes, prims, mid, end, nodeIndex);
+		Node& node = nodes[nodeIndex];
+		node.children[0] = left;
+		node.children[1] = right;
+		node.bounds = nodes[left].bounds;
+		node.bounds.add(nodes[right].bounds);
+		return nodeIndex;
+	}
 
+	static int buildNodes(std::vector<Node>& nodes, std::vector<BuildPrim>& prims)
+	{
+		nodes.clear();
+		if (prims.empty())
+			return -1;
+		nodes.reserve(prims.size() * 2 - 1);
+		return buildRecursive(nodes, prims, 0, int(prims.size()), -1);
 	}
-	uint32_t minDim = 0;
-	float minCost = cost[0][0];
-	int minCostBucketIdx = 0;
-	for (uint32_t d = 0; d < 3; d++)
+
+	std::vector<BuildPrim> gatherPrimitives() const
 	{
-		for (int i = 1; i < bucketCount - 1; i++)
+		const int count = m_List->primitiveCount();
+		std::vector<BuildPrim> prims(count);
+		for (int i = 0; i < count; i++)
 		{
-			if (cost[d][i] < minCost)
+			m_List->expandPrimitiveBox(i, prims[i].bounds);
+			prims[i].centroid = .5f * prims[i].bounds.min + .5f * prims[i].bounds.max;
+			prims[i].index = i;
+		}
+		return prims;
+	}
+
+	/// @brief Use @nodes as the current tree, filling the leaf lookup from it
+	void adoptNodes(std::vector<Node>&& nodes, int root)
+	{
+		m_Nodes = std::move(nodes);
+		m_Root = root;
+		m_FreeNodes.clear();
+		m_LeafOf.assign(m_List->primitiveCount(), -1);
+		for (int c = 0; c < int(m_Nodes.size()); c++)
+		{
+			const int primitive = m_Nodes[c].primitive;
+			if (primitive < 0)
+				continue;
+			if (primitive >= int(m_LeafOf.size()))
+				m_LeafOf.resize(primitive + 1, -1);
+			m_LeafOf[primitive] = c;
+		}
+		m_UpdatesSinceBuild = 0;
+		m_RebalanceWanted = false;
+	}
+
+	void build(Purpose purpose) override
+	{
+		if (m_RebuildThread.joinable())
+			m_RebuildThread.join();
+		m_RebuildReady = false;
+		m_ChangedDuringRebuild.clear();
+
+		Timer timer;
+		printf("Building %s dynamic BVH with %d primitives\n", purpose == Purpose::Instances ? "instancing" : "mesh", m_List->primitiveCount());
+		std::vector<BuildPrim> prims = gatherPrimitives();
+		std::vector<Node> nodes;
+		const int root = buildNodes(nodes, prims);
+		adoptNodes(std::move(nodes), root);
+		m_Built = true;
+
+		LOG_ACCEL_BUILD(AcceleratorType::DynamicBVH, timer.toMs<float>(timer.elapsedNs() / 1000.0f), uint32_t(m_Nodes.size()), uint32_t(byteCount()));
+		printf("Built dynamic BVH with %d nodes in %f seconds\n", int(m_Nodes.size()), Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
+	}
+
+	int allocateNode()
+	{
+		if (!m_FreeNodes.empty())
+		{
+			const int index = m_FreeNodes.back();
+			m_FreeNodes.pop_back();
+			return index;
+		}
+		m_Nodes.push_back({});
+		return int(m_Nodes.size()) - 1;
+	}
+
+	/// @brief Recompute the bounds of @nodeIndex and all its parents
+	/// @return depth of @nodeIndex
+	int refit(int nodeIndex)
+	{
+		int depth = 0;
+		while (nodeIndex >= 0)
+		{
+			Node& node = m_Nodes[nodeIndex];
+			node.bounds = m_Nodes[node.children[0]].bounds;
+			node.bounds.add(m_Nodes[node.children[1]].bounds);
+			nodeIndex = node.parent;
+			depth++;
+		}
+		return depth;
+	}
+
+	/// @brief Find the node that would increase the surface area of the tree the least if @bounds is made its sibling
+	///	       Branch and bound search, subtrees are skipped when even a perfect fit can't beat the best so far
+	int findBestSibling(const BBox& bounds) const
+	{
+		struct Candidate { int node; float inheritedCost; };
+		Candidate stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = { m_Root, 0.f };
+
+		const float leafArea = bounds.area();
+		int best = m_Root;
+		float bestCost = FLT_MAX;
+		while (stackSize > 0)
+		{
+			const Candidate candidate = stack[--stackSize];
+			const Node& node = m_Nodes[candidate.node];
+			BBox merged = node.bounds;
+			merged.add(bounds);
+			const float mergedArea = merged.area();
+			const float cost = mergedArea + candidate.inheritedCost;
+			if (cost < bestCost)
 			{
-				minCost = cost[d][i];
-				minDim = d;
-				minCostBucketIdx = i;
+				bestCost = cost;
+				best = candidate.node;
+			}
+
+			// Going lower makes this node grow by the same amount as if the primitive was its sibling
+			const float inheritedCost = candidate.inheritedCost + mergedArea - node.bounds.area();
+			if (!node.isLeaf() && leafArea + inheritedCost < bestCost && stackSize + 2 <= STACK_SIZE)
+			{
+				stack[stackSize++] = { node.children[0], inheritedCost };
+				stack[stackSize++] = { node.children[1], inheritedCost };
 			}
 		}
+		return best;
 	}
 
-	Node** pmid = std::partition(&roots[start], &roots[end - 1] + 1, [=](const BVHBuildNode* node)
+	void insertLeaf(int index)
+	{
+		const int leaf = allocateNode();
+		m_Nodes[leaf].bounds = BBox();
+		m_List->expandPrimitiveBox(index, m_Nodes[leaf].bounds);
+		m_Nodes[leaf].primitive = index;
+		m_Nodes[leaf].parent = -1;
+		if (index >= int(m_LeafOf.size()))
+			m_LeafOf.resize(index + 1, -1);
+		m_LeafOf[index] = leaf;
+
+		if (m_Root < 0)
 		{
-			float centroid = (node->bounds.min[minDim] + node->bounds.max[minDim]) * 0.5f;
-			int b = bucketCount * (((centroid - centroidBounds.min[minDim]) / (centroidBounds.max[minDim] - centroidBounds.min[minDim])));
-			if (b >= bucketCount)
-				b = bucketCount - 1;
-			if (b < 0)
-				b = 0;
-			return b <= minCostBucketIdx;
+			m_Root = leaf;
+			return;
+		}
+
+		const int sibling = findBestSibling(m_Nodes[leaf].bounds);
+		const int oldParent = m_Nodes[sibling].parent;
+		const int parent = allocateNode();
+		m_Nodes[parent].parent = oldParent;
+		m_Nodes[parent].primitive = -1;
+		m_Nodes[parent].children[0] = sibling;
+		m_Nodes[parent].children[1] = leaf;
+		m_Nodes[sibling].parent = parent;
+		m_Nodes[leaf].parent = parent;
+		if (oldParent < 0)
+			m_Root = parent;
+		else
+			m_Nodes[oldParent].children[m_Nodes[oldParent].children[0] == sibling ? 0 : 1] = parent;
+
+		const int depth = refit(parent);
+		if (depth > HARD_MAX_DEPTH)
+			build(Purpose::Instances);
+		else if (depth > MAX_DEPTH)
+			m_RebalanceWanted = true;
+	}
+
+	void removeLeaf(int index)
+	{
+		const int leaf = m_LeafOf[index];
+		m_LeafOf[index] = -1;
+		m_FreeNodes.push_back(leaf);
+		const int parent = m_Nodes[leaf].parent;
+		if (parent < 0)
+		{
+			m_Root = -1;
+			return;
+		}
+
+		// The sibling takes the place of the parent
+		const int sibling = m_Nodes[parent].children[m_Nodes[parent].children[0] == leaf ? 1 : 0];
+		const int grandParent = m_Nodes[parent].parent;
+		m_Nodes[sibling].parent = grandParent;
+		m_FreeNodes.push_back(parent);
+		if (grandParent < 0)
+		{
+			m_Root = sibling;
+			return;
+		}
+		m_Nodes[grandParent].children[m_Nodes[grandParent].children[0] == parent ? 0 : 1] = sibling;
+		refit(grandParent);
+	}
+
+	/// @brief Swap in the tree from the background rebuild if it is done, or start one if the tree had enough updates
+	void updateRebuild()
+	{
+		if (m_RebuildReady && m_ChangedDuringRebuild.size() > MAX_REPLAYED_UPDATES)
+		{
+			// Too much changed while building, replaying it would stall this update, start over from the current state
+			m_RebuildThread.join();
+			m_RebuildReady = false;
+			m_ChangedDuringRebuild.clear();
+		}
+		if (m_RebuildReady)
+		{
+			m_RebuildThread.join();
+			m_RebuildReady = false;
+			adoptNodes(std::move(m_RebuiltNodes), m_RebuiltRoot);
+
+			// Replay the updates made since the snapshot, using the current state of the list
+			std::vector<int> changed = std::move(m_ChangedDuringRebuild);
+			m_ChangedDuringRebuild.clear();
+			std::sort(changed.begin(), changed.end());
+			changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+			for (int index : changed)
+			{
+				if (index < int(m_LeafOf.size()) && m_LeafOf[index] >= 0)
+					removeLeaf(index);
+				if (index < m_List->primitiveCount())
+					insertLeaf(index);
+			}
+			m_UpdatesSinceBuild = int(changed.size());
+			printf("Swapped in rebuilt dynamic BVH, replayed %d updates\n", m_UpdatesSinceBuild);
+		}
+		else if (m_UpdatesSinceBuild > std::max(64, m_List->primitiveCount() / 4))
+		{
+			startRebuild();
+		}
+	}
+
+	/// @brief Start the background rebuild from the current state of the list, unless one is running
+	void startRebuild()
+	{
+		if (m_RebuildThread.joinable())
+			return;
+		m_RebalanceWanted = false;
+		// Snapshot the bounds here, the list can change while the thread is running
+		m_RebuildThread = std::thread([this, prims = gatherPrimitives()]() mutable {
+			m_RebuiltRoot = buildNodes(m_RebuiltNodes, prims);
+			m_RebuildReady = true;
 		});
-	int mid = pmid - &roots[0];
-	node->initInterior(minDim, connectTreelets(roots, start, mid, totalNodes), connectTreelets(roots, mid, end, totalNodes));
-	return node;
-#endif
-}
+	}
 
-#include "Primitive.h"
+	/// @brief Add primitive @index from the list to the tree, the list must already contain it
+	bool insert(int index) override
+	{
+		if (!isBuilt())
+			return false;
+		updateRebuild();
+		insertLeaf(index);
+		m_UpdatesSinceBuild++;
+		if (m_RebuildThread.joinable())
+			m_ChangedDuringRebuild.push_back(index);
+		if (m_RebalanceWanted)
+			startRebuild();
+		return true;
+	}
 
-const float traversalCost = 1.0f;
-const float emptyBonus = 0.5f;
+	/// @brief Remove primitive @index from the tree, the list may already have changed it
+	bool remove(int index) override
+	{
+		if (!isBuilt())
+			return false;
+		updateRebuild();
+		if (index < int(m_LeafOf.size()) && m_LeafOf[index] >= 0)
+			removeLeaf(index);
+		m_UpdatesSinceBuild++;
+		if (m_RebuildThread.joinable())
+			m_ChangedDuringRebuild.push_back(index);
+		return true;
+	}
 
-#define uint int
+	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		if (m_Root < 0)
+			return false;
 
-class KDTree : public IntersectionAccelerator
-{
-	// PBR Book layout
-	struct Node
+		int stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = m_Root;
+		bool hit = false;
+		while (stackSize > 0)
+		{
+			const Node& node = m_Nodes[stack[--stackSize]];
+			float t0, t1 = tMax;
+			if (!node.bounds.intersectP(ray, t0, t1))
+				continue;
+			if (node.isLeaf())
+			{
+				if (m_List->intersectPrimitive(node.primitive, ray, tMin, tMax, intersection))
+				{
+					hit = true;
+					tMax = intersection.t;
+				}
+				continue;
+			}
+
+			// Visit the nearer child first so it can shorten the ray for the other one
+			const int axis = node.bounds.maxExtent();
+			const BBox& first = m_Nodes[node.children[0]].bounds;
+			const BBox& second = m_Nodes[node.children[1]].bounds;
+			const bool firstIsLower = first.min[axis] + first.max[axis] <= second.min[axis] + second.max[axis];
+			const int nearChild = firstIsLower == (ray.dir[axis] >= 0.f) ? 0 : 1;
+			stack[stackSize++] = node.children[1 - nearChild];
+			stack[stackSize++] = node.children[nearChild];
+		}
+		return hit;
+	}
+
+	void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
 	{
-		void initLeaf(uint32_t* prims, int pc, std::vector<uint32_t>& primIds)
+		if (m_Root < 0)
+			return;
+
+		int stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = m_Root;
+		while (stackSize > 0)
 		{
-			flags = 3;
-			primCount |= (pc << 2);
-			if (pc == 0)
-				onePrim = 0;
-			else if (pc == 1)
-				onePrim = prims[0];
-			else
+			const Node& node = m_Nodes[stack[--stackSize]];
+			if (!frustum.testBox(node.bounds))
+				continue;
+			if (node.isLeaf())
 			{
-				primIdxOffset = primIds.size();
-				// printf("PrimIds: %d, pc=%d, primCount=%d", (int)primIds.size(), pc, primCount);
-				for (uint32_t i = 0; i < pc; i++)
-					primIds.push_back(prims[i]);
+				visible.push_back(node.primitive);
+				continue;
 			}
+			stack[stackSize++] = node.children[0];
+			stack[stackSize++] = node.children[1];
 		}
+	}
+};
 
-		float splitPos() const { return split; }
-		bool isLeaf() const { return (flags & 3) == 3; }
-		uint8_t splitAxis() const { return flags & 3; }
-		uint32_t getPrimCount() const { return primCount >> 2; }
-		uint32_t getAboveChild() const { return aboveChild >> 2; }
+/// Wraps two accelerators over the same primitives: a coarse one that builds fast and is used right away,
+///	and a refined one that builds on a background thread and replaces the coarse one for all following rays
+///	Rays on the coarse tree are counted, it is cleared once the last of them is done after the swap
+struct ProgressiveAccelerator : IntersectionAccelerator {
+	AcceleratorPtr m_Coarse;
+	AcceleratorPtr m_Refined;
+	std::atomic<IntersectionAccelerator*> m_Active{ nullptr };
+	std::atomic<int> m_CoarseReaders{ 0 };
+	std::thread m_RefineThread;
+
+	ProgressiveAccelerator(AcceleratorPtr coarse, AcceleratorPtr refined)
+		: m_Coarse(std::move(coarse))
+		, m_Refined(std::move(refined))
+	{
+	}
 
-		void initInterior(uint8_t ax, uint32_t aboveCh, float s)
+	~ProgressiveAccelerator()
+	{
+		clear();
+	}
+
+	void setPrimitives(PrimitiveList* list) override
+	{
+		m_Coarse->setPrimitives(list);
+		m_Refined->setPrimitives(list);
+	}
+
+	void setParameters(const BuildParameters& parameters) override
+	{
+		m_Refined->setParameters(parameters);
+	}
+
+	void clear() override
+	{
+		if (m_RefineThread.joinable())
+			m_RefineThread.join();
+		m_Active = nullptr;
+		m_Coarse->clear();
+		m_Refined->clear();
+	}
+
+	void build(Purpose purpose) override
+	{
+		clear();
+		m_Coarse->build(purpose);
+		m_Active = m_Coarse.get();
+		m_RefineThread = std::thread([this, purpose]() {
+			{
+				// Every progressive build refines on the same spare workers, which run one task at a time
+				std::lock_guard<std::mutex> lock(refineMutex());
+				m_Refined->build(purpose);
+			}
+			m_Active = m_Refined.get();
+			// Rays that started on the coarse tree finish on it, no new ones can reach it after the swap
+			while (m_CoarseReaders > 0)
+				std::this_thread::yield();
+			m_Coarse->clear();
+		});
+	}
+
+	static std::mutex& refineMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	bool isBuilt() const override { return m_Active != nullptr; }
+
+	int64_t byteCount() const override { return m_Coarse->byteCount() + m_Refined->byteCount(); }
+
+	/// @brief Call @use with the active tree, counted as a reader while it is the coarse one
+	template <typename Use>
+	void withActive(Use&& use)
+	{
+		IntersectionAccelerator* active = m_Active;
+		if (active == m_Refined.get())
 		{
-			flags = ax;
-			split = s;
-			aboveChild |= (aboveCh << 2);
+			use(active);
+			return;
 		}
+		// Counted before the tree is read again, so the refine thread can't clear it in between
+		m_CoarseReaders++;
+		active = m_Active;
+		if (active)
+			use(active);
+		m_CoarseReaders--;
+	}
 
-		union {
-			float split;
-			uint32_t onePrim;
-			uint32_t primIdxOffset;
-		};
-	private:
-		union {
-			uint32_t flags;
-			uint32_t primCount;
-			uint32_t aboveChild;
-		};
-	};
+	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		bool hit = false;
+		withActive([&](IntersectionAccelerator* active) {
+			hit = active->intersect(ray, tMin, tMax, intersection);
+		});
+		return hit;
+	}
+
+	void intersectBatch(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits) override
+	{
+		// Whole batch goes through one tree, even if the swap happens in the middle of it
+		withActive([&](IntersectionAccelerator* active) {
+			active->intersectBatch(rays, count, tMin, tMax, intersections, hits);
+		});
+	}
+
+	void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
+	{
+		withActive([&](IntersectionAccelerator* active) {
+			active->frustumCull(frustum, visible);
+		});
+	}
 
-	struct KdToDo
+	/// Only the refined tree is saved, so a loaded one needs no coarse tree or refine thread
+	bool save(std::vector<char>& data) const override
 	{
-		const Node* node;
-		float tMin, tMax;
+		return m_Active == m_Refined.get() && m_Refined->save(data);
+	}
+
+	bool load(const char* data, size_t size) override
+	{
+		clear();
+		if (!m_Refined->load(data, size))
+			return false;
+		m_Active = m_Refined.get();
+		return true;
+	}
+};
+
+/// Picks the accelerator type and build parameters for a primitive list by measuring them
+///	Each candidate is built and a sample of rays through the bounds is traced, the total cost is the build time
+///	plus the time per ray over the whole ray budget, intersecting the list without accelerator is also a candidate
+///	Decisions are cached for the process by list size, bounds, ray budget and memory limit, so re-rendering the same scene only builds the winner
+struct TunedAccelerator : IntersectionAccelerator {
+	static constexpr int64_t DEFAULT_RAY_BUDGET = 1280 * 720 * 4;
+	static constexpr int SAMPLE_RAYS = 2048;
+	static constexpr int MIN_MEASURED_PRIMITIVES = 4; // smaller lists are never worth an accelerator
+	static constexpr int MAX_OCTTREE_MESH_PRIMITIVES = 10000; // octree mesh builds are too slow to even try on bigger lists
+
+	struct Candidate
+	{
+		bool accelerated;
+		AcceleratorType type;
+		BuildParameters parameters;
 	};
 
-	struct BoundEdge
+	struct CacheKey
 	{
-		float t;
-		int primIdx;
-		bool startingEdge;
+		int primitiveCount;
+		Purpose purpose;
+		int budgetLog2;
+		int maxBytesLog2; ///< -1 without memory limit, trees that fit one limit may not fit a smaller one
+		float bounds[6];
 
-		BoundEdge() = default;
-		BoundEdge(float t, int primIdx, bool starting) : startingEdge(starting), t(t), primIdx(primIdx)
+		bool operator<(const CacheKey& other) const
 		{
-
+			if (primitiveCount != other.primitiveCount)
+				return primitiveCount < other.primitiveCount;
+			if (purpose != other.purpose)
+				return purpose < other.purpose;
+			if (budgetLog2 != other.budgetLog2)
+				return budgetLog2 < other.budgetLog2;
+			if (maxBytesLog2 != other.maxBytesLog2)
+				return maxBytesLog2 < other.maxBytesLog2;
+			return std::lexicographical_compare(bounds, bounds + 6, other.bounds, other.bounds + 6);
 		}
 	};
 
-	~KDTree()
+	PrimitiveList* m_List = nullptr;
+	ThreadManager* m_Threads = nullptr;
+	int64_t m_RayBudget;
+	BuildParameters m_Parameters;
+	AcceleratorPtr m_Chosen; // null when intersecting the list directly is cheapest
+	bool m_Built = false;
+
+	explicit TunedAccelerator(int64_t rayBudget) : m_RayBudget(rayBudget > 0 ? rayBudget : DEFAULT_RAY_BUDGET) {}
+
+	void setPrimitives(PrimitiveList* list) override
 	{
-		clear();
+		m_List = list;
 	}
 
-	virtual void addPrimitive(Intersectable* prim) override
+	void setThreadManager(ThreadManager* threads) override
 	{
-		m_Primitives.push_back(prim);
+		m_Threads = threads;
 	}
 
-	virtual void clear() override
+	/// @brief Only the memory limit and layout are used, the rest of the parameters are what is being tuned
+	void setParameters(const BuildParameters& parameters) override
 	{
-		// printf("\nClearing\n");
-		// for (uint32_t i = 0; i < m_NextFreeNode; i++)
-			// printf("%d ", m_Nodes[i].isLeaf());
+		m_Parameters = parameters;
+	}
 
-		delete[] m_Nodes;
-		m_Nodes = nullptr;
-		m_Primitives.clear();
+	BuildParameters withBudget(BuildParameters parameters) const
+	{
+		parameters.maxBytes = m_Parameters.maxBytes;
+		parameters.layout = m_Parameters.layout;
+		parameters.hugePages = m_Parameters.hugePages;
+		return parameters;
 	}
 
-	virtual void build(Purpose purpose) override
+	void clear() override
 	{
-		if (purpose == Purpose::Instances)
+		m_Chosen.reset();
+		m_Built = false;
+	}
+
+	bool isBuilt() const override { return m_Built; }
+
+	int64_t byteCount() const override { return m_Chosen ? m_Chosen->byteCount() : 0; }
+
+	static std::vector<Candidate> candidates(Purpose purpose, int primitiveCount)
+	{
+		std::vector<Candidate> result;
+		auto add = [&result](AcceleratorType type, int maxDepth, int maxLeafPrimitives, float intersectionCost) {
+			BuildParameters parameters;
+			parameters.maxDepth = maxDepth;
+			parameters.maxLeafPrimitives = maxLeafPrimitives;
+			parameters.intersectionCost = intersectionCost;
+			result.push_back({ true, type, parameters });
+		};
+		// Fastest builds first, so the cheaper ones set the bar for the rest
+		add(AcceleratorType::BVH, 0, 1, 2.f);
+		add(AcceleratorType::BVH, 0, 4, 1.f);
+		add(AcceleratorType::PLOCBVH, 0, 0, 0.f);
+		add(AcceleratorType::DynamicBVH, 0, 0, 0.f);
+		if (purpose == Purpose::Instances || primitiveCount <= MAX_OCTTREE_MESH_PRIMITIVES)
 		{
-			m_MaxPrimsPerNode = 1;
-			m_IntersectionCost = 160.0f;
+			add(AcceleratorType::Octtree, 5, 4, 0.f);
+			add(AcceleratorType::Octtree, 35, 20, 0.f);
 		}
-		else
+		add(AcceleratorType::KDTree, 0, 4, 80.f);
+		add(AcceleratorType::KDTree, 0, 1, 160.f);
+		return result;
+	}
+
+	static std::string describe(const Candidate& candidate)
+	{
+		if (!candidate.accelerated)
+			return "no accelerator";
+		const char* names[] = { "Octtree", "BVH", "KDTree", "Dynamic BVH", "PLOC BVH" };
+		char description[128];
+		snprintf(description, sizeof(description), "%s depth %d leaf %d cost %g", names[int(candidate.type)],
+			candidate.parameters.maxDepth, candidate.parameters.maxLeafPrimitives, candidate.parameters.intersectionCost);
+		return description;
+	}
+
+	/// @brief Rays from around the bounds to random points inside them, the same for every candidate
+	std::vector<Ray> sampleRays(const BBox& bounds) const
+	{
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> uniform(0.f, 1.f);
+		const vec3 center = .5f * bounds.min + .5f * bounds.max;
+		const float radius = std::max((bounds.max - bounds.min).length(), 1e-3f);
+		std::vector<Ray> rays;
+		rays.reserve(SAMPLE_RAYS);
+		for (int c = 0; c < SAMPLE_RAYS; c++)
 		{
-			m_MaxPrimsPerNode = 4;
-			m_IntersectionCost = 80.0f;
+			const float z = 2.f * uniform(rng) - 1.f, phi = 2.f * PI * uniform(rng);
+			const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+			const vec3 origin = center + radius * vec3(r * std::cos(phi), r * std::sin(phi), z);
+			const vec3 target = bounds.min + vec3(uniform(rng), uniform(rng), uniform(rng)) * (bounds.max - bounds.min);
+			rays.push_back(Ray(origin, (target - origin).normalized()));
 		}
-		Timer timer;
-		printf("Building %s KDTree with %d primitives\n", purpose == Purpose::Instances ? "instancing" : "mesh", (int)m_Primitives.size());
-		m_MaxDepth = std::round(8 + 1.3f * std::log2(m_Primitives.size())); // pbr book
+		return rays;
+	}
 
-		std::vector<BBox> primitiveBounds;
-		primitiveBounds.reserve(m_Primitives.size());
-		for (auto* prim : m_Primitives)
+	/// @brief Average time in ms to find the closest hit for @rays
+	template <typename Intersect>
+	static double measureRays(const std::vector<Ray>& rays, int count, Intersect&& intersect)
+	{
+		Timer timer;
+		for (int c = 0; c < count; c++)
 		{
-			BBox b;
-			prim->expandBox(b);
-			primitiveBounds.push_back(b);
-			m_Bounds.add(b);
+			Intersection intersection;
+			intersect(rays[c], intersection);
 		}
-		BoundEdge* edges[3];
-		for (uint32_t i = 0; i < 3; i++)
-			edges[i] = new BoundEdge[2 * m_Primitives.size()];
-		uint32_t* prims0 = new uint32_t[m_Primitives.size()];
-		uint32_t* prims1 = new uint32_t[(m_MaxDepth + 1) * m_Primitives.size()];
-		uint32_t* primIds = new uint32_t[m_Primitives.size()];
-		for (size_t i = 0; i < (size_t)m_Primitives.size(); i++)
-			primIds[i] = i;
-
-		build(0, m_Bounds, primitiveBounds, primIds, m_Primitives.size(), m_MaxDepth, edges, prims0, prims1);
-
-		// printf("Prims %d==%d\n", primCount, m_Primitives.size());
-		LOG_ACCEL_BUILD(AcceleratorType::KDTree, timer.toMs<float>(timer.elapsedNs() / 1000.0f), m_NextFreeNode, m_NextFreeNode * sizeof(Node) + sizeof(*this) + sizeof(m_Primitives[0]) * m_Primitives.size());
-		printf("Built KDTree with %d nodes in %f seconds\n", m_NextFreeNode, Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
-
-		delete[] prims0;
-		delete[] prims1;
-		delete[] primIds;
-		delete[] edges[0];
-		delete[] edges[1];
-		delete[] edges[2];
+		return Timer::toMs<double>(timer.elapsedNs()) / count;
 	}
 
-	void build(uint32_t nodeIdx, const BBox& curBounds, const std::vector<BBox>& bounds, uint32_t* primIds, size_t primCount, uint32_t depthLeft, BoundEdge* edges[3], uint32_t* prims0, uint32_t* prims1, uint32_t badRefines = 0)
+	bool intersectList(const Ray& ray, float tMin, float tMax, Intersection& intersection)
 	{
-		if (m_NextFreeNode == m_Allocated)
+		bool hit = false;
+		const int count = m_List->primitiveCount();
+		for (int c = 0; c < count; c++)
 		{
-			uint32_t alloc = std::max(2 * m_Allocated, 512U);
-			Node* n = new Node[alloc];
-			if (m_Allocated > 0)
+			if (m_List->intersectPrimitive(c, ray, tMin, tMax, intersection))
 			{
-				std::memcpy(n, m_Nodes, m_Allocated * sizeof(Node));
-				delete[] m_Nodes;
+				tMax = intersection.t;
+				hit = true;
 			}
-			m_Nodes = n;
-			m_Allocated = alloc;
 		}
-		
-		m_NextFreeNode++;
+		return hit;
+	}
 
-		if (primCount <= m_MaxPrimsPerNode || depthLeft == 0) // We can create a leaf here
-		{
-			m_Nodes[nodeIdx].initLeaf(primIds, primCount, m_PrimIds);
+	/// @brief Build the candidate as the chosen accelerator
+	void buildChosen(const Candidate& candidate, Purpose purpose)
+	{
+		m_Chosen.reset();
+		if (!candidate.accelerated)
 			return;
-		}
+		m_Chosen = makeAccelerator(candidate.type);
+		m_Chosen->setPrimitives(m_List);
+		m_Chosen->setParameters(withBudget(candidate.parameters));
+		m_Chosen->setThreadManager(m_Threads);
+		m_Chosen->build(purpose);
+	}
 
-		int bestAxis = -1;
-		int bestOffset = -1;
-		float bestCost = std::numeric_limits<float>::infinity();
-		float oldCost = m_IntersectionCost * primCount;
-		float invArea = 1.0f / curBounds.area();
-		vec3 diag = curBounds.max - curBounds.min;
+	static std::mutex& cacheMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
 
-		int axis = curBounds.maxExtent();
-		int retries = 0;
+	static std::map<CacheKey, Candidate>& cache()
+	{
+		static std::map<CacheKey, Candidate> decisions;
+		return decisions;
+	}
 
-	tryAxis: // pbr book's fault
-		for (int i = 0; i < primCount; i++)
-		{
-			uint32_t pn = primIds[i];
-			edges[axis][2 * i] = BoundEdge(bounds[pn].min[axis], pn, true);
-			edges[axis][2 * i + 1] = BoundEdge(bounds[pn].max[axis], pn, false);
-		}
+	void build(Purpose purpose) override
+	{
+		clear();
+		const int primitiveCount = m_List->primitiveCount();
+		BBox bounds;
+		for (int c = 0; c < primitiveCount; c++)
+			m_List->expandPrimitiveBox(c, bounds);
 
-		std::sort(&edges[axis][0], &edges[axis][2 * primCount], [](const BoundEdge& a, const BoundEdge& b) {
-			if (a.t == b.t) // wtf pbr book?
+		const int maxBytesLog2 = m_Parameters.maxBytes >= 0 ? int(std::log2(double(m_Parameters.maxBytes) + 1.0)) : -1;
+		const CacheKey key{ primitiveCount, purpose, int(std::log2(double(m_RayBudget))), maxBytesLog2,
+			{ bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z } };
+		const char* purposeName = purpose == Purpose::Instances ? "instances" : "mesh";
+		{
+			std::unique_lock<std::mutex> lock(cacheMutex());
+			auto cached = cache().find(key);
+			if (cached != cache().end())
 			{
-				int aa = a.startingEdge ? 0 : 1;
-				int bb = b.startingEdge ? 0 : 1;
-				return aa < bb;
+				const Candidate candidate = cached->second;
+				lock.unlock();
+				buildChosen(candidate, purpose);
+				m_Built = true;
+				char decision[256];
+				snprintf(decision, sizeof(decision), "%s %d: %s (cached)", purposeName, primitiveCount, describe(candidate).c_str());
+				LOG_ACCEL_TUNE(decision);
+				return;
 			}
-			else
-				return a.t < b.t;
-			});
+		}
 
-		int belowCount = 0, aboveCount = primCount;
-		for (uint32_t i = 0; i < 2 * primCount; i++)
+		Timer timer;
+		Candidate best{ false, AcceleratorType::Auto, BuildParameters() };
+		RenderLog::AccelBuild bestBuild{ AcceleratorType::Auto, 0.f, 0, 0, false };
+		double bestCost = DBL_MAX;
+		std::string report;
+		if (primitiveCount > 0)
 		{
-			if (!edges[axis][i].startingEdge) aboveCount--;
-			float t = edges[axis][i].t;
-			if (t > curBounds.min[axis] && t < curBounds.max[axis])
+			const std::vector<Ray> rays = sampleRays(bounds);
+			auto addCost = [&](const Candidate& candidate, double buildMs, double rayMs) {
+				const double cost = buildMs + rayMs * double(m_RayBudget);
+				char line[256];
+				snprintf(line, sizeof(line), "  %s: build %.1fms, %.3fus/ray, total %.0fms\n", describe(candidate).c_str(), buildMs, rayMs * 1000.0, cost);
+				report += line;
+				return cost;
+			};
+
+			// Without accelerator, on few rays for big lists as the cost grows with the list
+			const int listRays = std::max(8, std::min(SAMPLE_RAYS, 200000 / primitiveCount));
+			bestCost = addCost(best, 0.0, measureRays(rays, listRays, [this](const Ray& ray, Intersection& intersection) {
+				return intersectList(ray, 0.f, FLT_MAX, intersection);
+			}));
+
+			if (primitiveCount >= MIN_MEASURED_PRIMITIVES)
 			{
-				int otherAxis1 = (axis + 1) % 3, otherAxis2 = (axis + 2) % 3;
-				float belowArea = 2 * (diag[otherAxis1] * diag[otherAxis2] + (t - curBounds.min[axis]) * (diag[otherAxis1] + diag[otherAxis2]));
-				float aboveArea = 2 * (diag[otherAxis1] * diag[otherAxis2] + (curBounds.max[axis] - t) * (diag[otherAxis1] + diag[otherAxis2]));
-
-				float belowProb = belowArea * invArea;
-				float aboveProb = aboveArea * invArea;
-
-				float bonus = (aboveCount == 0 || belowCount == 0) ? emptyBonus : 0;
-				float cost = traversalCost + m_IntersectionCost * (1 - bonus) * (belowProb * belowCount + aboveProb * aboveCount);
-
-				if (cost < bestCost)
+				double lastBuildMs[int(AcceleratorType::Auto)] = {};
+				for (const Candidate& candidate : candidates(purpose, primitiveCount))
 				{
-					bestCost = cost;
-					bestAxis = axis;
-					bestOffset = i;
+					// Building only gets slower with other parameters of the same type, skip if that alone costs more
+					if (lastBuildMs[int(candidate.type)] > bestCost)
+						continue;
+
+					const bool wasMuted = RenderLog::Get().MuteAccelInfo(true);
+					AcceleratorPtr accelerator = makeAccelerator(candidate.type);
+					accelerator->setPrimitives(m_List);
+					accelerator->setParameters(withBudget(candidate.parameters));
+					accelerator->setThreadManager(m_Threads);
+					Timer buildTimer;
+					accelerator->build(purpose);
+					const double buildMs = Timer::toMs<double>(buildTimer.elapsedNs());
+					RenderLog::Get().MuteAccelInfo(wasMuted);
+					const RenderLog::AccelBuild build = RenderLog::Get().LastMutedAccelInfo();
+					lastBuildMs[int(candidate.type)] = buildMs;
+					// Trees that could not get under the budget even with coarser settings are not an option
+					if (m_Parameters.maxBytes >= 0 && accelerator->byteCount() > m_Parameters.maxBytes)
+					{
+						report += "  " + describe(candidate) + ": over memory budget\n";
+						continue;
+					}
+
+					const double cost = addCost(candidate, buildMs, measureRays(rays, SAMPLE_RAYS, [&accelerator](const Ray& ray, Intersection& intersection) {
+						return accelerator->intersect(ray, 0.f, FLT_MAX, intersection);
+					}));
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						best = candidate;
+						bestBuild = build;
+						m_Chosen = std::move(accelerator);
+					}
 				}
 			}
-			if (edges[axis][i].startingEdge) belowCount++;
 		}
+		if (!best.accelerated)
+			m_Chosen.reset();
+		m_Built = true;
+
+		// The build of the winner is logged once, other builds are the cost of tuning and are only added to the time
+		const float tuneSeconds = Timer::toMs<float>(timer.elapsedNs()) / 1000.0f;
+		if (m_Chosen)
+			LOG_ACCEL_BUILD(best.type, tuneSeconds, bestBuild.nodeCount, bestBuild.byteCount);
+		else
+			LOG_ACCEL_BUILD(AcceleratorType::Auto, tuneSeconds, 0, 0);
 
-		if (bestAxis == -1 && retries < 2)
-		{
-			retries++;
-			axis = (axis + 1) % 3; // check next axis;
-			goto tryAxis;
-		}
-		assert(belowCount == primCount && aboveCount == 0);
-		if (bestCost > oldCost) ++badRefines;
-		if ((bestCost > 4 * oldCost && primCount < 16) || bestAxis == -1 || badRefines == 3)
+		char decision[256];
+		snprintf(decision, sizeof(decision), "%s %d: %s", purposeName, primitiveCount, describe(best).c_str());
+		LOG_ACCEL_TUNE(decision);
+		printf("Tuned %s accelerator for %d primitives and %lld rays in %f seconds\n%s  picked %s\n",
+			purposeName, primitiveCount, (long long)m_RayBudget, tuneSeconds, report.c_str(), describe(best).c_str());
+
+		std::lock_guard<std::mutex> lock(cacheMutex());
+		cache()[key] = best;
+	}
+
+	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		if (m_Chosen)
+			return m_Chosen->intersect(ray, tMin, tMax, intersection);
+		return intersectList(ray, tMin, tMax, intersection);
+	}
+
+	void intersectBatch(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits) override
+	{
+		if (m_Chosen)
+			m_Chosen->intersectBatch(rays, count, tMin, tMax, intersections, hits);
+		else
+			IntersectionAccelerator::intersectBatch(rays, count, tMin, tMax, intersections, hits);
+	}
+
+	void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
+	{
+		if (m_Chosen)
 		{
-			m_Nodes[nodeIdx].initLeaf(primIds, primCount, m_PrimIds);
+			m_Chosen->frustumCull(frustum, visible);
 			return;
 		}
+		const int count = m_List->primitiveCount();
+		for (int c = 0; c < count; c++)
+			visible.push_back(c);
+	}
 
-		int n0 = 0, n1 = 0;
-		for (uint32_t i = 0; i < bestOffset; i++)
-		{
-			if (edges[bestAxis][i].startingEdge)
-				prims0[n0++] = edges[bestAxis][i].primIdx;
-		}
+	bool insert(int index) override
+	{
+		return m_Chosen ? m_Chosen->insert(index) : true;
+	}
 
-		for (uint32_t i = bestOffset + 1; i < 2 * primCount; i++)
-		{
-			if (!edges[bestAxis][i].startingEdge)
-				prims1[n1++] = edges[bestAxis][i].primIdx;
-		}
+	bool remove(int index) override
+	{
+		return m_Chosen ? m_Chosen->remove(index) : true;
+	}
+};
 
-		float tSplit = edges[bestAxis][bestOffset].t;
-		BBox bounds0 = curBounds, bounds1 = curBounds;
-		bounds0.max[bestAxis] = bounds1.min[bestAxis] = tSplit;
-		build(nodeIdx + 1, bounds0, bounds, prims0, n0, depthLeft - 1, edges, prims0, prims1 + primCount, badRefines);
+/// Charges the memory of the accelerator it wraps to a budget shared with the other accelerators of the render
+///	Each build may take its share of what the others left, see MemoryBudget::share, the wrapped builder degrades
+///	to a coarser tree to stay under it
+struct BudgetedAccelerator : IntersectionAccelerator {
+	AcceleratorPtr m_Accelerator;
+	MemoryBudget* m_Budget;
+	PrimitiveList* m_List = nullptr;
+	BuildParameters m_Parameters;
+	int64_t m_Charged = 0;
+	bool m_Expected = true; // the primitives are still in the expected ones of the budget until the first build
+
+	/// @param expected - false when another accelerator over the same primitives takes them out of the expected ones
+	BudgetedAccelerator(AcceleratorPtr accelerator, MemoryBudget* budget, bool expected = true)
+		: m_Accelerator(std::move(accelerator))
+		, m_Budget(budget)
+		, m_Expected(expected)
+	{
+	}
 
-		m_Nodes[nodeIdx].initInterior(bestAxis, m_NextFreeNode, tSplit);
-		build(m_NextFreeNode, bounds1, bounds, prims1, n1, depthLeft - 1, edges, prims0, prims1 + primCount, badRefines);
+	~BudgetedAccelerator()
+	{
+		release();
 	}
 
-	virtual bool isBuilt() const override
+	void release()
 	{
-		return m_Nodes != nullptr;
+		m_Budget->used -= m_Charged;
+		m_Charged = 0;
 	}
 
-	virtual bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	void setPrimitives(PrimitiveList* list) override
 	{
-		float min = tMin;
-		float max = tMax;
+		m_List = list;
+		m_Accelerator->setPrimitives(list);
+	}
 
-		 if (!m_Bounds.intersectP(ray, tMin, tMax))
-			 return false;
+	void setParameters(const BuildParameters& parameters) override { m_Parameters = parameters; }
+	void setThreadManager(ThreadManager* threads) override { m_Accelerator->setThreadManager(threads); }
 
-		vec3 invDir = ray.dir.inverted();
-		const int maxTodos = 64;
-		KdToDo todos[maxTodos];
-		int todoIdx = 0;
+	void clear() override
+	{
+		m_Accelerator->clear();
+		release();
+	}
 
-		bool hit = false;
-		const Node* node = &m_Nodes[0];
-		
-		while (node != nullptr)
+	void build(Purpose purpose) override
+	{
+		release();
+		const int64_t primitives = m_List ? m_List->primitiveCount() : 0;
+		BuildParameters parameters = m_Parameters;
+		const int64_t share = m_Budget->share(primitives);
+		parameters.maxBytes = parameters.maxBytes >= 0 ? std::min(parameters.maxBytes, share) : share;
+		m_Accelerator->setParameters(parameters);
+
+		// The build is logged again below, once its size is known
+		const bool wasMuted = RenderLog::Get().MuteAccelInfo(true);
+		m_Accelerator->build(purpose);
+		RenderLog::Get().MuteAccelInfo(wasMuted);
+		const RenderLog::AccelBuild build = RenderLog::Get().LastMutedAccelInfo();
+		m_Charged = m_Accelerator->byteCount();
+		m_Budget->used += m_Charged;
+		if (m_Expected)
 		{
-		 	if (max < tMin)
-				break;
-			if (!node->isLeaf())
-			{
-				uint8_t axis = node->splitAxis();
-				float plane = (node->splitPos() - ray.origin[axis]) * invDir[axis];
+			m_Budget->built(primitives);
+			m_Expected = false;
+		}
+		if (m_Charged > parameters.maxBytes)
+			printf("Accelerator takes %lld bytes, over the %lld of the memory budget it was given\n", (long long)m_Charged, (long long)parameters.maxBytes);
+		if (build.logged)
+			LOG_ACCEL_BUILD(build.accel, build.time, build.nodeCount, uint32_t(m_Charged));
+	}
 
-				const Node* firstChild, *secondChild;
-				uint32_t below = (ray.origin[axis] < node->splitPos()) || (ray.origin[axis] == node->splitPos() && ray.dir[axis] <= 0);
-				if (below)
-				{
-					firstChild = node + 1;
-					secondChild = &m_Nodes[node->getAboveChild()];
-				}
-				else
-				{
-					firstChild = &m_Nodes[node->getAboveChild()];
-					secondChild = node + 1;
-				}
+	bool isBuilt() const override { return m_Accelerator->isBuilt(); }
 
-				if (plane > tMax || plane <= 0)
-					node = firstChild;
-				else if (plane < tMin)
-					node = secondChild;
-				else
-				{
-					todos[todoIdx].node = secondChild;
-					todos[todoIdx].tMin = plane;
-					todos[todoIdx].tMax = tMax;
-					todoIdx++;
-					node = firstChild;
-					tMax = plane;
-				}
-			}
-			else
-			{
-				uint32_t primCount = node->getPrimCount();
-				if (primCount == 1)
-				{
-					Intersectable* i = m_Primitives[node->onePrim];
-					if (i->intersect(ray, min, max, intersection))
-					{
-						hit = true;
-						max = intersection.t;
-					}
-				}
-				else
-				{
-					for (uint32_t i = 0; i < primCount; i++)
-					{
-						uint32_t idx = m_PrimIds[node->primIdxOffset + i];
-						if (m_Primitives[idx]->intersect(ray, min, max, intersection))
-						{
-							hit = true;
-							max = intersection.t;
-						}
-					}
-				}
+	int64_t byteCount() const override { return m_Accelerator->byteCount(); }
 
-				if (todoIdx > 0)
-				{
-					todoIdx--;
-					node = todos[todoIdx].node;
-					tMin = todos[todoIdx].tMin;
-					tMax = todos[todoIdx].tMax;
-				}
-				else
-					break;
-			}
-		}
+	bool intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) override
+	{
+		return m_Accelerator->intersect(ray, tMin, tMax, intersection);
+	}
 
-		return hit;
+	void intersectBatch(const Ray* rays, int count, float tMin, float* tMax, Intersection* intersections, bool* hits) override
+	{
+		m_Accelerator->intersectBatch(rays, count, tMin, tMax, intersections, hits);
 	}
 
-	Node* m_Nodes;
-	std::vector<uint32_t> m_PrimIds;
-	BBox m_Bounds;
-	uint32_t m_MaxDepth;
-	uint32_t m_NextFreeNode = 0, m_Allocated = 0;
-	std::vector<Intersectable*> m_Primitives;
-	uint32_t m_MaxPrimsPerNode = 2;
-	float m_IntersectionCost = 80.0f;
+	void frustumCull(const Frustum& frustum, std::vector<int>& visible) override
+	{
+		m_Accelerator->frustumCull(frustum, visible);
+	}
+
+	bool insert(int index) override { return m_Accelerator->insert(index); }
+	bool remove(int index) override { return m_Accelerator->remove(index); }
+
+	/// Loaded structures are not charged, they stay in the mapped file and the page cache shares them
+	bool save(std::vector<char>& data) const override { return m_Accelerator->save(data); }
+	bool load(const char* data, size_t size) override { return m_Accelerator->load(data, size); }
 };
 
 AcceleratorPtr makeAccelerator(AcceleratorType acceleratorType) {
@@ -1018,9 +3031,41 @@ AcceleratorPtr makeAccelerator(AcceleratorType acceleratorType) {
 	case AcceleratorType::Octtree: return AcceleratorPtr(new OctTree());
 
 	// ~3x faster in debug, ~5x in release
-	case AcceleratorType::BVH: return AcceleratorPtr(new BVHTree());
+	case AcceleratorType::BVH: return AcceleratorPtr(new BVHTree(BVHTree::Builder::HLBVH));
+	case AcceleratorType::PLOCBVH: return AcceleratorPtr(new BVHTree(BVHTree::Builder::PLOC));
 	case AcceleratorType::KDTree: return AcceleratorPtr(new KDTree());
+	case AcceleratorType::DynamicBVH: return AcceleratorPtr(new DynamicBVH());
+	case AcceleratorType::Auto: return AcceleratorPtr(new TunedAccelerator(TunedAccelerator::DEFAULT_RAY_BUDGET));
 	default: return AcceleratorPtr(new OctTree());
 	}
 }
 
+AcceleratorPtr makeAccelerator(const AcceleratorSettings& settings) {
+	auto budgeted = [&settings](AcceleratorPtr accelerator, bool expected = true) {
+		if (!settings.memory)
+			return accelerator;
+		return AcceleratorPtr(new BudgetedAccelerator(std::move(accelerator), settings.memory, expected));
+	};
+	IntersectionAccelerator::BuildParameters parameters;
+	parameters.layout = settings.nodeLayout;
+	parameters.hugePages = settings.hugePages;
+
+	if (settings.buildMode == BuildMode::Progressive)
+	{
+		// Only the coarse HLBVH is built before rendering, on the idle render workers
+		// Both trees are charged, the primitives leave the expected ones of the budget once, when the refined tree is built
+		AcceleratorPtr coarse = budgeted(makeAccelerator(AcceleratorType::BVH), false);
+		coarse->setParameters(parameters);
+		coarse->setThreadManager(settings.threads);
+		// The refined tree is the best the SAH builders make whatever the requested type, built on the workers the render leaves
+		AcceleratorPtr refined = budgeted(makeAccelerator(AcceleratorType::PLOCBVH));
+		refined->setParameters(parameters);
+		refined->setThreadManager(settings.spareThreads);
+		return AcceleratorPtr(new ProgressiveAccelerator(std::move(coarse), std::move(refined)));
+	}
+	AcceleratorPtr accelerator = budgeted(settings.type == AcceleratorType::Auto ? AcceleratorPtr(new TunedAccelerator(settings.rayBudget)) : makeAccelerator(settings.type));
+	accelerator->setParameters(parameters);
+	if (settings.buildMode == BuildMode::Eager)
+		accelerator->setThreadManager(settings.threads);
+	return accelerator;
+}
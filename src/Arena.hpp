@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#if __linux__ != 0
+#include <sys/mman.h>
+#endif
+
+/// Bump allocator handing out memory from big blocks, everything in it is released at once
+///	Nothing is destructed, so only trivially destructible types can live in it. Not thread safe.
+struct Arena {
+	static constexpr size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+	static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	explicit Arena(size_t blockSize = DEFAULT_BLOCK_SIZE) : blockSize(blockSize) {}
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	/// Back blocks of at least HUGE_PAGE_SIZE with huge pages where the system supports it, to save TLB misses
+	bool hugePages = false;
+
+	~Arena() {
+		release();
+	}
+
+	/// @brief Get uninitialized memory, requests bigger than the block size get a block of their own
+	void *allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+		if (current < blocks.size()) {
+			if (void *memory = bump(blocks[current], bytes, alignment)) {
+				used += bytes;
+				return memory;
+			}
+		}
+		// Blocks left over from before reset() are reused when big enough
+		for (current++; current < blocks.size(); current++) {
+			if (void *memory = bump(blocks[current], bytes, alignment)) {
+				used += bytes;
+				return memory;
+			}
+		}
+		size_t size = std::max(blockSize, bytes + alignment);
+		char *data = allocateBlock(size);
+		if (!data) {
+			throw std::bad_alloc();
+		}
+		blocks.push_back({data, size, 0});
+		reserved += size;
+		current = blocks.size() - 1;
+		used += bytes;
+		return bump(blocks[current], bytes, alignment);
+	}
+
+	/// @brief Size blocks allocated from now on, for arenas that know roughly how much they will hold
+	void setBlockSize(size_t size) {
+		blockSize = size;
+	}
+
+	/// @brief Allocate and value initialize @count objects of type T
+	template <typename T>
+	T *allocate(size_t count = 1, size_t alignment = alignof(T)) {
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destructed");
+		T *result = static_cast<T *>(allocate(count * sizeof(T), alignment));
+		for (size_t c = 0; c < count; c++) {
+			new (&result[c]) T();
+		}
+		return result;
+	}
+
+	/// @brief Allocate @count objects of type T left uninitialized, for buffers that are written before read
+	template <typename T>
+	T *allocateUninitialized(size_t count) {
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destructed");
+		return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	/// @brief Forget all allocations but keep the blocks to be reused
+	void reset() {
+		for (Block &block : blocks) {
+			block.offset = 0;
+		}
+		current = 0;
+		used = 0;
+	}
+
+	/// @brief Free all blocks
+	void release() {
+		for (Block &block : blocks) {
+			std::free(block.data);
+		}
+		blocks.clear();
+		current = 0;
+		used = reserved = 0;
+	}
+
+	/// @return bytes handed out since the last reset
+	size_t bytesUsed() const {
+		return used;
+	}
+
+	/// @return bytes held from the system, what the arena actually costs
+	size_t bytesReserved() const {
+		return reserved;
+	}
+
+private:
+	struct Block {
+		char *data;
+		size_t size;
+		size_t offset;
+	};
+
+	/// @param size [in/out] - bytes needed, rounded up to what was actually taken
+	char *allocateBlock(size_t &size) const {
+#if __linux__ != 0
+		if (hugePages && size >= HUGE_PAGE_SIZE) {
+			// Transparent huge pages only back whole aligned pages
+			size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			void *memory = std::aligned_alloc(HUGE_PAGE_SIZE, size);
+			if (memory) {
+				madvise(memory, size, MADV_HUGEPAGE);
+			}
+			return static_cast<char *>(memory);
+		}
+#endif
+		return static_cast<char *>(std::malloc(size));
+	}
+
+	static void *bump(Block &block, size_t bytes, size_t alignment) {
+		const uintptr_t start = reinterpret_cast<uintptr_t>(block.data) + block.offset;
+		const size_t padding = (alignment - start % alignment) % alignment;
+		if (block.offset + padding + bytes > block.size) {
+			return nullptr;
+		}
+		block.offset += padding + bytes;
+		return block.data + block.offset - bytes;
+	}
+
+	std::vector<Block> blocks;
+	size_t current = 0;
+	size_t blockSize;
+	size_t used = 0;
+	size_t reserved = 0;
+};
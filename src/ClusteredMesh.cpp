@@ -0,0 +1,366 @@
+#include "ClusteredMesh.h"
+#include "RenderLog.h"
+#include "Threading.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+namespace {
+
+/// Start of cluster files, followed by the table of clusters and the clusters
+///	Clusters are the vertices, faces and saved BVH of the cluster, each at a multiple of CLUSTER_ALIGNMENT
+struct ClusterFileHeader {
+	char magic[4];
+	uint32_t version;
+	int64_t sourceSize; ///< Size of the converted file, -1 if there is none
+	int64_t sourceTime; ///< Modification time of the converted file
+	BBox bounds;
+	int32_t vertexCount; ///< Of the whole mesh, vertices shared by clusters are stored in each of them
+	int32_t faceCount;
+	int32_t clusterCount;
+	uint32_t pad;
+	uint64_t tableOffset;
+};
+
+const char CLUSTER_FILE_MAGIC[4] = { 'C', 'L', 'S', 'T' };
+const uint32_t CLUSTER_FILE_VERSION = 1;
+const uint64_t CLUSTER_ALIGNMENT = 64; ///< Cache line, so BVH nodes copied with the cluster can be used in place
+const AcceleratorType CLUSTER_ACCELERATOR = AcceleratorType::PLOCBVH; ///< Built once when converting, quality matters more than build time
+const int CLUSTERS_PER_THREAD = 4; ///< Clusters converted at once by each thread, bounds the memory converting takes
+
+uint64_t alignCluster(uint64_t offset) {
+	return (offset + CLUSTER_ALIGNMENT - 1) / CLUSTER_ALIGNMENT * CLUSTER_ALIGNMENT;
+}
+
+/// @brief Make accelerator for the faces of one cluster, printing nothing as there are many of them
+AcceleratorPtr makeClusterAccelerator(PrimitiveList *geometry) {
+	AcceleratorPtr accelerator = makeAccelerator(CLUSTER_ACCELERATOR);
+	IntersectionAccelerator::BuildParameters parameters;
+	parameters.quiet = true;
+	accelerator->setParameters(parameters);
+	accelerator->setPrimitives(geometry);
+	return accelerator;
+}
+
+}
+
+const char *const ClusteredGeometry::CLUSTER_EXTENSION = ".clusters";
+
+ClusteredGeometry::~ClusteredGeometry() {
+	for (int c = 0; c < int(clusters.size()); c++) {
+		delete slots[c].cluster.load();
+	}
+}
+
+bool ClusteredGeometry::open(const std::string &path, int64_t residentBytes, ThreadManager *threads) {
+	capacity = residentBytes;
+	const size_t extensionLength = strlen(CLUSTER_EXTENSION);
+	if (path.size() >= extensionLength && path.compare(path.size() - extensionLength, extensionLength, CLUSTER_EXTENSION) == 0) {
+		if (!openClusters(path, nullptr)) {
+			printf("Error loading file \"%s\"\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	const std::string clusterPath = path + CLUSTER_EXTENSION;
+	if (openClusters(clusterPath, &path)) {
+		return true;
+	}
+	MeshGeometry geometry;
+	if (!geometry.load(path, threads) || !write(geometry, clusterPath, &path, threads)) {
+		return false;
+	}
+	return openClusters(clusterPath, &path);
+}
+
+bool ClusteredGeometry::write(const MeshGeometry &geometry, const std::string &path, const std::string *source, ThreadManager *threads) {
+	if (geometry.isCompressed()) {
+		return false;
+	}
+	Timer timer;
+	ClusterFileHeader header = {};
+	memcpy(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic));
+	header.version = CLUSTER_FILE_VERSION;
+	header.sourceSize = -1;
+	if (source && !fileStamp(*source, header.sourceSize, header.sourceTime)) {
+		return false;
+	}
+	header.bounds = geometry.box;
+	header.vertexCount = geometry.vertexCount();
+	header.faceCount = geometry.faceCount();
+	header.clusterCount = (header.faceCount + CLUSTER_FACES - 1) / CLUSTER_FACES;
+	header.tableOffset = alignCluster(sizeof(header));
+	std::vector<ClusterInfo> table(header.clusterCount);
+
+	// Written next to the target and moved over it, like binary meshes
+	const std::string temporaryPath = path + ".tmp";
+	FILE *file = fopen(temporaryPath.c_str(), "wb");
+	if (!file) {
+		printf("Can't write cluster file \"%s\"\n", path.c_str());
+		return false;
+	}
+	uint64_t position = 0;
+	auto writeAt = [file, &position](uint64_t offset, const void *data, size_t bytes) {
+		static const char padding[CLUSTER_ALIGNMENT] = {};
+		while (position < offset) {
+			const size_t paddingBytes = size_t(std::min<uint64_t>(offset - position, CLUSTER_ALIGNMENT));
+			if (fwrite(padding, 1, paddingBytes, file) != paddingBytes) {
+				return false;
+			}
+			position += paddingBytes;
+		}
+		position = offset + bytes;
+		return fwrite(data, 1, bytes, file) == bytes;
+	};
+
+	// Clusters are converted a batch at a time, and written in order once the whole batch is done
+	const int batchSize = (threads ? std::max(threads->getThreadCount(), 1) : 1) * CLUSTERS_PER_THREAD;
+	uint64_t offset = alignCluster(header.tableOffset + table.size() * sizeof(ClusterInfo));
+	bool written = true;
+	for (int batchStart = 0; batchStart < header.clusterCount && written; batchStart += batchSize) {
+		const int batchCount = std::min(batchSize, header.clusterCount - batchStart);
+		std::vector<std::vector<char>> blobs(batchCount);
+		parallelFor(threads, batchCount, [&](int begin, int end) {
+			const bool wasMuted = RenderLog::Get().MuteAccelInfo(true);
+			for (int b = begin; b < end; b++) {
+				const int cluster = batchStart + b;
+				const int firstFace = cluster * CLUSTER_FACES;
+				const int faceCount = std::min(CLUSTER_FACES, header.faceCount - firstFace);
+
+				// Vertices of the cluster in the order of the mesh, faces point to them by their place among these
+				std::vector<int> used;
+				used.reserve(faceCount * 3);
+				for (int c = firstFace; c < firstFace + faceCount; c++) {
+					used.insert(used.end(), std::begin(geometry.faces[c].indices), std::end(geometry.faces[c].indices));
+				}
+				std::sort(used.begin(), used.end());
+				used.erase(std::unique(used.begin(), used.end()), used.end());
+				std::vector<vec3> vertices(used.size());
+				BBox bounds;
+				for (int c = 0; c < int(used.size()); c++) {
+					vertices[c] = geometry.vertices[used[c]];
+					bounds.add(vertices[c]);
+				}
+				std::vector<MeshGeometry::Triangle> faces(faceCount);
+				for (int c = 0; c < faceCount; c++) {
+					for (int r = 0; r < 3; r++) {
+						faces[c].indices[r] = int(std::lower_bound(used.begin(), used.end(), geometry.faces[firstFace + c].indices[r]) - used.begin());
+					}
+				}
+
+				MeshGeometry local;
+				local.view(vertices.data(), int(vertices.size()), faces.data(), faceCount, bounds);
+				AcceleratorPtr accelerator = makeClusterAccelerator(&local);
+				accelerator->build(IntersectionAccelerator::Purpose::Mesh);
+				std::vector<char> tree;
+				accelerator->save(tree);
+
+				ClusterInfo &info = table[cluster];
+				info.bounds = bounds;
+				info.vertexCount = int32_t(vertices.size());
+				info.faceCount = faceCount;
+				info.faceOffset = alignCluster(vertices.size() * sizeof(vec3));
+				info.treeOffset = alignCluster(info.faceOffset + faces.size() * sizeof(MeshGeometry::Triangle));
+				info.treeSize = tree.size();
+				info.size = info.treeOffset + tree.size();
+				std::vector<char> &blob = blobs[b];
+				blob.assign(size_t(info.size), 0);
+				memcpy(blob.data(), vertices.data(), vertices.size() * sizeof(vec3));
+				memcpy(blob.data() + info.faceOffset, faces.data(), faces.size() * sizeof(MeshGeometry::Triangle));
+				memcpy(blob.data() + info.treeOffset, tree.data(), tree.size());
+			}
+			RenderLog::Get().MuteAccelInfo(wasMuted);
+		});
+		for (int b = 0; b < batchCount && written; b++) {
+			ClusterInfo &info = table[batchStart + b];
+			info.offset = offset;
+			written = writeAt(offset, blobs[b].data(), blobs[b].size());
+			offset = alignCluster(offset + info.size);
+		}
+	}
+
+	// Header and table are known only after the clusters, the space for them is left as padding
+	written = written && fseek(file, 0, SEEK_SET) == 0;
+	written = written && fwrite(&header, 1, sizeof(header), file) == sizeof(header);
+	written = written && fseek(file, long(header.tableOffset), SEEK_SET) == 0;
+	written = written && fwrite(table.data(), sizeof(ClusterInfo), table.size(), file) == table.size();
+	written = fclose(file) == 0 && written;
+
+	std::error_code error;
+	if (written) {
+		std::filesystem::rename(temporaryPath, path, error);
+	}
+	if (!written || error) {
+		printf("Can't write cluster file \"%s\"\n", path.c_str());
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	printf("Wrote %d clusters of \"%s\" in %lldms\n", header.clusterCount, path.c_str(), (long long)timer.toMs(timer.elapsedNs()));
+	return true;
+}
+
+bool ClusteredGeometry::openClusters(const std::string &path, const std::string *source) {
+	int64_t sourceSize = -1, sourceTime = 0;
+	if (source && !fileStamp(*source, sourceSize, sourceTime)) {
+		return false;
+	}
+	MappedFile mapped;
+	if (!mapped.open(path) || mapped.size() < sizeof(ClusterFileHeader)) {
+		return false;
+	}
+	ClusterFileHeader header;
+	memcpy(&header, mapped.data(), sizeof(header));
+	if (memcmp(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != CLUSTER_FILE_VERSION) {
+		printf("\"%s\" is not a cluster file of version %d\n", path.c_str(), int(CLUSTER_FILE_VERSION));
+		return false;
+	}
+	if (source && (header.sourceSize != sourceSize || header.sourceTime != sourceTime)) {
+		return false; // converted from an older version of the source
+	}
+	auto fits = [&mapped](uint64_t offset, uint64_t bytes) {
+		return offset % CLUSTER_ALIGNMENT == 0 && offset <= mapped.size() && bytes <= mapped.size() - offset;
+	};
+	bool valid = header.clusterCount >= 0 && fits(header.tableOffset, uint64_t(header.clusterCount) * sizeof(ClusterInfo));
+	std::vector<ClusterInfo> table(valid ? header.clusterCount : 0);
+	if (valid) {
+		memcpy(table.data(), mapped.data() + header.tableOffset, table.size() * sizeof(ClusterInfo));
+	}
+	for (const ClusterInfo &info : table) {
+		valid = valid && info.vertexCount >= 0 && info.faceCount >= 0 && fits(info.offset, info.size)
+			&& info.faceOffset % CLUSTER_ALIGNMENT == 0 && info.treeOffset % CLUSTER_ALIGNMENT == 0
+			&& uint64_t(info.vertexCount) * sizeof(vec3) <= info.faceOffset
+			&& info.faceOffset + uint64_t(info.faceCount) * sizeof(MeshGeometry::Triangle) <= info.treeOffset
+			&& info.treeOffset + info.treeSize <= info.size;
+	}
+	if (!valid) {
+		printf("Cluster file \"%s\" is truncated\n", path.c_str());
+		return false;
+	}
+
+	file = std::move(mapped);
+	clusters = std::move(table);
+	clusterPath = path;
+	box = header.bounds;
+	vertexTotal = header.vertexCount;
+	faceTotal = header.faceCount;
+	slots.reset(new Slot[clusters.size()]);
+	printf("Mapped \"%s\" with %d clusters of %d faces, keeping up to %lldMB in memory\n", path.c_str(), int(clusters.size()), faceTotal, (long long)(capacity >> 20));
+	return true;
+}
+
+void ClusteredGeometry::buildTree(const AcceleratorSettings &settings) {
+	std::call_once(treeBuilt, [this, &settings]() {
+		// Tuning would page in most clusters to measure rays, the tree over them is small enough for any type
+		AcceleratorSettings treeSettings = settings;
+		treeSettings.type = settings.type == AcceleratorType::Auto ? AcceleratorType::BVH : settings.type;
+		treeSettings.buildMode = BuildMode::Eager;
+		treeSettings.memory = nullptr;
+		tree = makeAccelerator(treeSettings);
+		tree->setPrimitives(this);
+		tree->build(IntersectionAccelerator::Purpose::Instances);
+	});
+}
+
+bool ClusteredGeometry::intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	return tree && tree->intersect(ray, tMin, tMax, intersection);
+}
+
+void ClusteredGeometry::page(int index) {
+	if (slots[index].cluster) {
+		return;
+	}
+
+	// Copied without the lock, other threads keep using resident clusters meanwhile
+	const ClusterInfo &info = clusters[index];
+	std::unique_ptr<Cluster> cluster(new Cluster());
+	cluster->data.resize(size_t(alignCluster(info.size) / CLUSTER_ALIGNMENT));
+	memcpy(cluster->data.data(), file.data() + info.offset, size_t(info.size));
+	const char *bytes = cluster->data.data()->bytes;
+	const MeshGeometry::Triangle *faces = reinterpret_cast<const MeshGeometry::Triangle *>(bytes + info.faceOffset);
+	// Checked here rather than on open, which would read the whole file
+	const bool valid = std::all_of(faces, faces + info.faceCount, [&info](const MeshGeometry::Triangle &face) {
+		return std::all_of(std::begin(face.indices), std::end(face.indices), [&info](int vertex) {
+			return vertex >= 0 && vertex < info.vertexCount;
+		});
+	});
+	if (valid) {
+		cluster->geometry.view(reinterpret_cast<const vec3 *>(bytes), info.vertexCount, faces, info.faceCount, info.bounds);
+		cluster->accelerator = makeClusterAccelerator(&cluster->geometry);
+		const bool wasMuted = RenderLog::Get().MuteAccelInfo(true);
+		if (!cluster->accelerator->load(bytes + info.treeOffset, size_t(info.treeSize))) {
+			cluster->accelerator->build(IntersectionAccelerator::Purpose::Mesh); // saved with other build settings, or corrupt
+		}
+		RenderLog::Get().MuteAccelInfo(wasMuted);
+	} else {
+		printf("Cluster %d of \"%s\" has faces out of range, skipping it, delete the file to convert the mesh again\n", index, clusterPath.c_str());
+		cluster->data.clear();
+	}
+	cluster->byteCount = int64_t(cluster->data.size() * CLUSTER_ALIGNMENT) + (cluster->accelerator ? cluster->accelerator->byteCount() : 0);
+	pageIns++;
+
+	std::lock_guard<std::mutex> lock(residentMutex);
+	Slot &slot = slots[index];
+	if (slot.cluster) {
+		return; // paged in by another thread at the same time
+	}
+	residentBytes += cluster->byteCount;
+	residentCount++;
+	slot.used = true;
+	slot.cluster = cluster.release();
+	// Clusters reached since the last round get another one, bounded to two rounds as rays keep marking them
+	for (int step = 0; residentBytes > capacity && residentCount > 1 && step < 2 * int(clusters.size()); step++) {
+		Slot &candidate = slots[clockHand];
+		clockHand = (clockHand + 1) % int(clusters.size());
+		if (&candidate != &slot && candidate.cluster && !candidate.used.exchange(false)) {
+			evict(candidate);
+		}
+	}
+}
+
+void ClusteredGeometry::evict(Slot &slot) {
+	Cluster *cluster = slot.cluster.exchange(nullptr);
+	// Rays that count themselves from now on see no cluster, the ones before finish with it
+	while (slot.users > 0) {
+		std::this_thread::yield();
+	}
+	residentBytes -= cluster->byteCount;
+	residentCount--;
+	delete cluster;
+}
+
+int ClusteredGeometry::primitiveCount() const {
+	return int(clusters.size());
+}
+
+bool ClusteredGeometry::intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	if (!clusters[index].bounds.testIntersect(ray)) {
+		return false; // leaves of the tree can hold clusters the ray misses
+	}
+	Slot &slot = slots[index];
+	while (true) {
+		// Counted before reading the cluster, so eviction can't free it in between
+		slot.users++;
+		if (const Cluster *cluster = slot.cluster) {
+			if (!slot.used.load(std::memory_order_relaxed)) {
+				slot.used = true; // written only when it changes, the flag is shared by all rays through the cluster
+			}
+			const bool hit = cluster->accelerator && cluster->accelerator->intersect(ray, tMin, tMax, intersection);
+			slot.users--;
+			return hit;
+		}
+		slot.users--;
+		page(index);
+	}
+}
+
+bool ClusteredGeometry::primitiveBoxIntersect(int index, const BBox &other) {
+	return !other.boxIntersection(clusters[index].bounds).isEmpty();
+}
+
+void ClusteredGeometry::expandPrimitiveBox(int index, BBox &other) {
+	other.add(clusters[index].bounds);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Mesh.h"
+#include "MappedFile.hpp"
+#include "Primitive.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Mesh kept in a file of spatially coherent clusters, paged in while rays reach them
+///	Only the bounds of the clusters and a tree over them stay in memory, clusters are copied out of the mapped file
+///	with their BVH when a ray enters their bounds, and ones not used recently are dropped to stay in a fixed
+///	number of bytes. Used for meshes bigger than the memory of the machine rendering them.
+///	Rays reach resident clusters without locks, only paging in takes one.
+struct ClusteredGeometry : PrimitiveList {
+	/// Faces per cluster, runs of faces in the Morton order of MeshGeometry::reorder are close in space
+	static constexpr int CLUSTER_FACES = 4096;
+
+	/// Extension of cluster files, converted meshes add it to the name of their source
+	static const char *const CLUSTER_EXTENSION;
+
+	ClusteredGeometry() = default;
+	~ClusteredGeometry();
+
+	ClusteredGeometry(const ClusteredGeometry &) = delete;
+	ClusteredGeometry &operator=(const ClusteredGeometry &) = delete;
+
+	/// @brief Open cluster file at @path, or the one next to the mesh file at @path, converting the mesh when it is missing or stale
+	///	       Converting loads the whole mesh once, rendering from the cluster file later does not
+	/// @param residentBytes - memory the paged in clusters may take together
+	/// @param threads - workers to convert the mesh on, null to convert on the calling thread
+	bool open(const std::string &path, int64_t residentBytes, ThreadManager *threads = nullptr);
+
+	/// @brief Write @geometry split in clusters, each with a saved BVH, to @path
+	/// @param source - file @geometry is loaded from, the cluster file is rejected once it changes, null to skip the check
+	static bool write(const MeshGeometry &geometry, const std::string &path, const std::string *source, ThreadManager *threads = nullptr);
+
+	/// @brief Build the tree over the cluster bounds if it is not yet built, the settings of the first call are used
+	void buildTree(const AcceleratorSettings &settings);
+
+	/// @brief Intersect the mesh, paging in the clusters the ray reaches, safe to call from many threads
+	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection);
+
+	BBox box;
+
+	int vertexCount() const {
+		return vertexTotal;
+	}
+
+	int faceCount() const {
+		return faceTotal;
+	}
+
+	/// @return clusters paged in so far, including the ones paged in again after eviction
+	int64_t pageInCount() const {
+		return pageIns;
+	}
+
+	// Clusters are the primitives of the tree
+	int primitiveCount() const override;
+	bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+	bool primitiveBoxIntersect(int index, const BBox &box) override;
+	void expandPrimitiveBox(int index, BBox &box) override;
+private:
+	/// Where a cluster is in the file, offsets are from the start of the cluster
+	struct ClusterInfo {
+		BBox bounds;
+		uint64_t offset;
+		uint64_t size;
+		int32_t vertexCount;
+		int32_t faceCount;
+		uint64_t faceOffset;
+		uint64_t treeOffset;
+		uint64_t treeSize;
+	};
+
+	/// Cluster in memory, the geometry and the BVH nodes point into the copied bytes
+	struct Cluster {
+		struct alignas(64) CacheLine {
+			char bytes[64];
+		};
+		std::vector<CacheLine> data;
+		MeshGeometry geometry;
+		AcceleratorPtr accelerator; ///< Null for clusters with faces out of range, they are skipped
+		int64_t byteCount = 0;
+	};
+
+	/// Place of a cluster in memory, read by rays without locks
+	///	A ray counts itself as a user before reading the cluster, eviction takes the cluster out and frees it once the users are gone
+	struct Slot {
+		std::atomic<Cluster *> cluster{nullptr}; ///< Null when not in memory
+		std::atomic<int> users{0}; ///< Rays intersecting the cluster right now
+		std::atomic<bool> used{false}; ///< Reached since the eviction clock last passed, gives it another round in memory
+	};
+
+	/// @brief Map cluster file at @path
+	/// @param source - the mesh the file was converted from, the file is rejected if it changed since, null to skip the check
+	bool openClusters(const std::string &path, const std::string *source);
+
+	/// @brief Copy cluster at @index out of the file if it is not in memory, evicting others to stay under capacity
+	///	       It can be evicted again by other threads before the caller gets to it
+	void page(int index);
+
+	/// @brief Take the cluster of @slot out of memory, waiting for the rays still intersecting it
+	void evict(Slot &slot);
+
+	MappedFile file;
+	std::vector<ClusterInfo> clusters;
+	int vertexTotal = 0;
+	int faceTotal = 0;
+
+	AcceleratorPtr tree;
+	std::once_flag treeBuilt;
+
+	std::string clusterPath;
+	std::unique_ptr<Slot[]> slots; ///< One per cluster
+	std::mutex residentMutex; ///< Held while paging in and evicting, guards everything below
+	int residentCount = 0;
+	int clockHand = 0; ///< Next slot the eviction looks at, it goes around the clusters like a clock
+	int64_t residentBytes = 0;
+	int64_t capacity = 0;
+	std::atomic<int64_t> pageIns{0};
+};
@@ -174,6 +174,16 @@ static bool Property(const char* label, uint32_t& value, uint32_t minValue = 0,
 	return modified;
 }
 
+static bool Property(const char* label, bool& value)
+{
+	Pre(label);
+	std::string lbl = "##" + std::string(label);
+	bool modified = ImGui::Checkbox(lbl.c_str(), &value);
+	Post();
+
+	return modified;
+}
+
 static bool PropertyFilepath(const char* label, std::string& value)
 {
 	ShiftCursor(10.0f, 9.0f);
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+
+#if __linux__ != 0
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif _WIN64 != 0
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#endif
+
+/// Read only view of a whole file mapped in memory, pages are read by the system on first access
+///	Mappings of the same file share the page cache, even across processes
+struct MappedFile {
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	MappedFile(MappedFile &&other) noexcept {
+		*this = std::move(other);
+	}
+
+	MappedFile &operator=(MappedFile &&other) noexcept {
+		if (this != &other) {
+			close();
+			mapped = other.mapped;
+			length = other.length;
+			opened = other.opened;
+			other.mapped = nullptr;
+			other.length = 0;
+			other.opened = false;
+		}
+		return *this;
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	/// @brief Map the whole file at @path, closing the currently mapped one
+	/// @return false if the file can't be opened or mapped
+	bool open(const std::string &path) {
+		close();
+#if __linux__ != 0
+		const int file = ::open(path.c_str(), O_RDONLY);
+		if (file == -1) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(file, &info) != 0) {
+			::close(file);
+			return false;
+		}
+		length = size_t(info.st_size);
+		if (length) {
+			void *memory = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+			if (memory == MAP_FAILED) {
+				::close(file);
+				length = 0;
+				return false;
+			}
+			madvise(memory, length, MADV_WILLNEED); // start reading ahead, pages are touched right after loading
+			mapped = static_cast<const char *>(memory);
+		}
+		::close(file); // the mapping keeps its own reference
+#elif _WIN64 != 0
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize)) {
+			CloseHandle(file);
+			return false;
+		}
+		length = size_t(fileSize.QuadPart);
+		if (length) {
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			void *memory = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (mapping) {
+				CloseHandle(mapping); // the view keeps its own reference
+			}
+			if (!memory) {
+				CloseHandle(file);
+				length = 0;
+				return false;
+			}
+			mapped = static_cast<const char *>(memory);
+		}
+		CloseHandle(file);
+#else
+		return false;
+#endif
+		opened = true;
+		return true;
+	}
+
+	void close() {
+		if (mapped) {
+#if __linux__ != 0
+			munmap(const_cast<char *>(mapped), length);
+#elif _WIN64 != 0
+			UnmapViewOfFile(mapped);
+#endif
+		}
+		mapped = nullptr;
+		length = 0;
+		opened = false;
+	}
+
+	bool isOpen() const {
+		return opened;
+	}
+
+	/// @return contents of the file, null for empty files
+	const char *data() const {
+		return mapped;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+private:
+	const char *mapped = nullptr;
+	size_t length = 0;
+	bool opened = false;
+};
+
+/// @brief Get size and modification time of a file, to detect when a converted file changes
+inline bool fileStamp(const std::string &path, int64_t &size, int64_t &time) {
+	std::error_code error;
+	const std::uintmax_t fileSize = std::filesystem::file_size(path, error);
+	if (error) {
+		return false;
+	}
+	const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path, error);
+	if (error) {
+		return false;
+	}
+	size = int64_t(fileSize);
+	time = int64_t(writeTime.time_since_epoch().count());
+	return true;
+}
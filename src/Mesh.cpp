@@ -1,7 +1,18 @@
-#define TINYOBJLOADER_IMPLEMENTATION
-
 #include "Mesh.h"
-#include "third_party/tiny_obj_loader.h"
+#include "ClusteredMesh.h"
+#include "MappedFile.hpp"
+#include "RenderLog.h"
+#include "Threading.hpp"
+
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <queue>
 
 /// source https://github.com/anrieff/quaddamage/blob/master/src/mesh.cpp
 bool intersectTriangleFast(const Ray& ray, const vec3& A, const vec3& B, const vec3& C, float& dist)
@@ -51,11 +62,14 @@ bool intersectTriangleFast(const Ray& ray, const vec3& A, const vec3& B, const v
 }
 
 
+int MeshGeometry::primitiveCount() const {
+	return faceTotal;
+}
+
 /// source: https://github.com/anrieff/quaddamage/blob/master/src/bbox.h
-bool TriangleMesh::Triangle::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
-	const vec3 &A = owner->vertices[indices[0]];
-	const vec3 &B = owner->vertices[indices[1]];
-	const vec3 &C = owner->vertices[indices[2]];
+bool MeshGeometry::intersectPrimitive(int index, const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+	vec3 A, B, C;
+	corners(index, A, B, C);
 
 	const vec3 AB = B - A;
 	const vec3 AC = C - A;
@@ -101,7 +115,6 @@ bool TriangleMesh::Triangle::intersect(const Ray& ray, float tMin, float tMax, I
 	intersection.t = gamma;
 	intersection.p = ray.origin + ray.dir * gamma;
 	intersection.normal = normal;
-	intersection.material = owner->material.get();
 
 	return true;
 }
@@ -110,10 +123,9 @@ int signOf(float f) {
 	return (f > 0) - (f < 0);
 }
 
-bool TriangleMesh::Triangle::boxIntersect(const BBox& box) {
-	const vec3 &A = owner->vertices[indices[0]];
-	const vec3 &B = owner->vertices[indices[1]];
-	const vec3 &C = owner->vertices[indices[2]];
+bool MeshGeometry::primitiveBoxIntersect(int index, const BBox& box) {
+	vec3 A, B, C;
+	corners(index, A, B, C);
 	if (box.inside(A) || box.inside(B) || box.inside(C)) {
 		return true;
 	}
@@ -161,89 +173,1668 @@ bool TriangleMesh::Triangle::boxIntersect(const BBox& box) {
 	return false;
 }
 
-void TriangleMesh::Triangle::expandBox(BBox& box) {
-	for (int c = 0; c < 3; c++) {
-		box.add(owner->vertices[indices[c]]);
+void MeshGeometry::expandPrimitiveBox(int index, BBox& box) {
+	vec3 A, B, C;
+	corners(index, A, B, C);
+	box.add(A);
+	box.add(B);
+	box.add(C);
+}
+
+MeshAsset MeshAsset::load(const std::string &path, const MeshLoadSettings &settings) {
+	MeshAsset asset;
+	if (settings.residentBytes > 0) {
+		asset.clustered = std::make_shared<ClusteredGeometry>();
+		if (asset.clustered->open(path, settings.residentBytes, settings.threads)) {
+			return asset;
+		}
+		printf("Can't page \"%s\" in clusters, loading it whole\n", path.c_str());
+		asset.clustered.reset();
 	}
+	asset.geometry = MeshCache::get().acquire(path, settings);
+	return asset;
 }
 
-void TriangleMesh::onBeforeRender(AcceleratorType acceleratorType) {
-	if (faces.size() < 50) {
+void MeshAsset::prebuild(const AcceleratorSettings &settings) {
+	if (clustered) {
+		// The tree over the clusters is small, and it keeps its workers after the loader is gone
+		AcceleratorSettings treeSettings = settings;
+		treeSettings.threads = nullptr;
+		clustered->buildTree(treeSettings);
 		return;
 	}
+	std::vector<MeshGeometryPtr> built = { geometry };
+	if (settings.lod.pixelAngle > 0.f && settings.lod.instanced) {
+		geometry->buildLevels();
+		for (const MeshGeometry::Level &level : geometry->levels()) {
+			built.push_back(level.geometry);
+		}
+	}
+	for (const MeshGeometryPtr &version : built) {
+		if (!TriangleMesh::usesAccelerator(settings, version->faceCount())) {
+			continue;
+		}
+		MeshGeometry::SharedAcceleratorPtr shared = version->acceleratorFor(settings);
+		version->buildAccelerator(*shared);
+		version->saveAccelerator(*shared);
+		shared->accelerator->setThreadManager(nullptr); // kept by the geometry past the workers it was built on
+	}
+}
 
-	if (!accelerator) {
-		accelerator = makeAccelerator(acceleratorType);
+MeshLoader::MeshLoader(int threadCount)
+	: threadCount(threadCount > 0 ? threadCount : std::max<int>(std::thread::hardware_concurrency(), 1)) {
+}
+
+MeshLoader::~MeshLoader() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
 	}
+	wake.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
 
-	if (!accelerator->isBuilt()) {
-		for (int c = 0; c < faces.size(); c++) {
-			accelerator->addPrimitive(&faces[c]);
+MeshLoader::Future MeshLoader::request(const std::string &path, const MeshLoadSettings &settings, const AcceleratorSettings *prebuild) {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const Request &request : requests) {
+		if (request.path == path && request.compressed == settings.compressed && request.residentBytes == settings.residentBytes) {
+			return request.future;
 		}
-		accelerator->build(IntersectionAccelerator::Purpose::Mesh);
 	}
+	if (!pool) {
+		pool = settings.threads;
+	}
+
+	Job job;
+	job.path = path;
+	job.settings = settings; // jobs pick the borrowed pool up when it is free
+	job.prebuild = prebuild != nullptr;
+	if (prebuild) {
+		job.build = *prebuild;
+	}
+	job.loaded = std::make_shared<std::promise<MeshAsset>>();
+	const Future future = job.loaded->get_future().share();
+	requests.push_back({ path, settings.compressed, settings.residentBytes, future });
+	jobs.push_back(std::move(job));
+	if (int(workers.size()) < threadCount && int(jobs.size()) + busy > int(workers.size())) {
+		workers.emplace_back(&MeshLoader::work, this);
+	} else {
+		wake.notify_one();
+	}
+	return future;
 }
 
-bool TriangleMesh::loadFromObj(const std::string& objPath) {
-	tinyobj::attrib_t inattrib;
-	std::vector<tinyobj::shape_t> inshapes;
-	std::string error;
-	std::vector<tinyobj::material_t> materials;
-	const bool loadRes = tinyobj::LoadObj(&inattrib, &inshapes, &materials, &error, objPath.c_str(), nullptr);
-	if (!loadRes) {
-		printf("Error loading file \"%s\", \"%s\"", objPath.c_str(), error.c_str());
+void MeshLoader::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this]() {
+		return jobs.empty() && busy == 0;
+	});
+}
+
+int64_t MeshLoader::faceCount() {
+	std::vector<Future> loading;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const Request &request : requests) {
+			loading.push_back(request.future);
+		}
+	}
+	int64_t faces = 0;
+	for (const Future &future : loading) {
+		const MeshAsset &asset = future.get();
+		if (asset.geometry) {
+			faces += asset.geometry->faceCount();
+		} else if (asset.clustered) {
+			faces += asset.clustered->faceCount();
+		}
 	}
+	return faces;
+}
+
+void MeshLoader::work() {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() {
+				return stopping || !jobs.empty();
+			});
+			if (jobs.empty()) {
+				return;
+			}
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			++busy;
+		}
+		run(job);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--busy;
+		}
+		idle.notify_all();
+	}
+}
+
+void MeshLoader::run(Job &job) {
+	// Each step takes the pool if no other request is on it, otherwise runs on this thread alone
+	MeshAsset asset;
+	{
+		std::unique_lock<std::mutex> lock(poolMutex, std::try_to_lock);
+		MeshLoadSettings settings = job.settings;
+		settings.threads = lock.owns_lock() ? pool : nullptr;
+		asset = MeshAsset::load(job.path, settings);
+	}
+	job.loaded->set_value(asset);
+
+	if (job.prebuild) {
+		std::unique_lock<std::mutex> lock(poolMutex, std::try_to_lock);
+		AcceleratorSettings settings = job.build;
+		settings.threads = lock.owns_lock() ? pool : nullptr;
+		asset.prebuild(settings);
+	}
+}
+
+TriangleMesh::TriangleMesh(const std::string &path, std::unique_ptr<Material> material, const MeshLoadSettings &settings)
+	: TriangleMesh(MeshAsset::load(path, settings), std::move(material)) {
+}
 
-	static_assert(sizeof(vec3) == sizeof(tinyobj::real_t) * 3, "next line avoids copy with type alias");
-	vertices.swap(reinterpret_cast<std::vector<vec3>&>(inattrib.vertices));
+TriangleMesh::TriangleMesh(const MeshAsset &asset, std::unique_ptr<Material> material)
+	: geometry(asset.geometry), clustered(asset.clustered), material(std::move(material)) {
+	box = clustered ? clustered->box : geometry->box;
+}
+
+bool TriangleMesh::usesAccelerator(const AcceleratorSettings &settings, int faceCount) {
+	return settings.type == AcceleratorType::Auto || faceCount >= MIN_ACCELERATED_PRIMITIVES;
+}
+
+int TriangleMesh::vertexCount() const {
+	return clustered ? clustered->vertexCount() : geometry->vertexCount();
+}
+
+int TriangleMesh::faceCount() const {
+	return clustered ? clustered->faceCount() : geometry->faceCount();
+}
 
-	for (int c = 0; c < vertices.size(); c++) {
-		box.add(vertices[c]);
+void TriangleMesh::onBeforeRender(const AcceleratorSettings &settings) {
+	if (clustered) {
+		clustered->buildTree(settings);
+		return;
+	}
+	if (!usesAccelerator(settings, faceCount())) {
+		packed.clear();
+		for (int c = 0; c < faceCount(); c++) {
+			vec3 A, B, C;
+			geometry->corners(c, A, B, C);
+			packed.add(A, B, C);
+		}
+		accelerator.reset();
+		return;
 	}
 
-	for (int c = 0; c < inshapes.size(); c++) {
-		int index = 0;
-		bool skipMesh = false;
-		const tinyobj::mesh_t &mesh = inshapes[c].mesh;
+	accelerator = geometry->acceleratorFor(settings);
+	if (settings.buildMode != BuildMode::Lazy) {
+		geometry->buildAccelerator(*accelerator);
+	}
+	// Lazy builds are saved here by the next render
+	geometry->saveAccelerator(*accelerator);
 
-		const std::vector<unsigned char> &numFaceVertices = inshapes[c].mesh.num_face_vertices;
-		for (int r = 0; r < numFaceVertices.size(); r++) {
-			if (numFaceVertices[r] != 3) {
-				skipMesh = true;
+	if (settings.lod.pixelAngle <= 0.f) {
+		levelAccelerators.clear();
+	} else if (settings.lod.instanced) {
+		levelAccelerators.clear();
+		geometry->buildLevels();
+		for (const MeshGeometry::Level &level : geometry->levels()) {
+			// Levels only get coarser, the first one too small for an accelerator ends the ones used, as in MeshAsset::prebuild
+			if (!usesAccelerator(settings, level.geometry->faceCount())) {
 				break;
 			}
+			levelAccelerators.push_back(level.geometry->acceleratorFor(settings));
+			if (settings.buildMode != BuildMode::Lazy) {
+				level.geometry->buildAccelerator(*levelAccelerators.back());
+			}
 		}
-		if (skipMesh) {
+	}
+	// Otherwise the mesh is only placed as it is by this caller, levels made for instancers moving it are kept
+}
+
+int TriangleMesh::levelFor(float footprint, float dither) const {
+	if (levelAccelerators.empty()) {
+		return 0;
+	}
+	const std::vector<MeshGeometry::Level> &levels = geometry->levels();
+	const int levelCount = int(levelAccelerators.size());
+	int level = 0;
+	float error = 0.f;
+	while (level < levelCount && levels[level].error <= footprint) {
+		error = levels[level].error;
+		level++;
+	}
+	if (level < levelCount && footprint - error > dither * (levels[level].error - error)) {
+		level++;
+	}
+	return level;
+}
+
+bool TriangleMesh::intersectLevel(int level, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	if (level == 0) {
+		return intersect(ray, tMin, tMax, intersection);
+	}
+	if (!box.testIntersect(ray)) {
+		return false;
+	}
+	const MeshGeometry::Level &simplified = geometry->levels()[level - 1];
+	MeshGeometry::SharedAccelerator &shared = *levelAccelerators[level - 1];
+	simplified.geometry->buildAccelerator(shared);
+	if (!shared.accelerator->intersect(ray, tMin, tMax, intersection)) {
+		return false;
+	}
+	intersection.material = material.get();
+	return true;
+}
+
+MeshGeometry::SharedAcceleratorPtr MeshGeometry::acceleratorFor(const AcceleratorSettings &settings) {
+	// Budgets and refine threads belong to one render, such accelerators are not kept
+	const bool keep = !settings.memory && settings.buildMode != BuildMode::Progressive;
+	std::lock_guard<std::mutex> lock(acceleratorMutex);
+	if (keep) {
+		for (const SharedAcceleratorPtr &kept : accelerators) {
+			if (kept->type == settings.type && kept->nodeLayout == settings.nodeLayout && kept->hugePages == settings.hugePages
+				&& (settings.type != AcceleratorType::Auto || kept->rayBudget == settings.rayBudget)) {
+				// Built for an earlier render, log it once in this one too so its memory and nodes show up
+				const size_t render = RenderLog::Get().RenderCount();
+				if (kept->ready && kept->loggedRender.exchange(render) != render) {
+					LOG_ACCEL_BUILD(kept->builtType, 0.f, kept->nodeCount, uint32_t(kept->byteCount));
+					printf("Reused accelerator of \"%s\" from an earlier render\n", binaryPath.c_str());
+				}
+				return kept;
+			}
+		}
+	}
+	SharedAcceleratorPtr shared = std::make_shared<SharedAccelerator>();
+	shared->type = settings.type;
+	shared->nodeLayout = settings.nodeLayout;
+	shared->hugePages = settings.hugePages;
+	shared->rayBudget = settings.rayBudget;
+	shared->accelerator = makeAccelerator(settings);
+	shared->accelerator->setPrimitives(this);
+	if (keep) {
+		accelerators.push_back(shared);
+	}
+	return shared;
+}
+
+void MeshGeometry::buildAccelerator(SharedAccelerator &shared) {
+	// Lazy builds come here on every ray, once built the flag answers without going through call_once
+	if (shared.ready.load(std::memory_order_acquire)) {
+		return;
+	}
+	std::call_once(shared.built, [this, &shared]() {
+		// Built muted to learn its size for the cache, then logged as usual
+		const bool wasMuted = RenderLog::Get().MuteAccelInfo(true);
+		const bool loaded = savedAccelerator && savedAcceleratorType == int(shared.type) && shared.accelerator->load(savedAccelerator, savedAcceleratorSize);
+		if (!loaded) {
+			shared.accelerator->build(IntersectionAccelerator::Purpose::Mesh);
+		}
+		RenderLog::Get().MuteAccelInfo(wasMuted);
+		const RenderLog::AccelBuild build = RenderLog::Get().LastMutedAccelInfo();
+		if (build.logged) {
+			LOG_ACCEL_BUILD(build.accel, build.time, build.nodeCount, build.byteCount);
+		}
+		shared.byteCount = shared.accelerator->byteCount();
+		shared.builtType = build.logged ? build.accel : shared.type;
+		shared.nodeCount = build.nodeCount;
+		shared.loggedRender = RenderLog::Get().RenderCount();
+
+		if (loaded) {
+			printf("Loaded accelerator of \"%s\"\n", binaryPath.c_str());
+		}
+		shared.unsaved = !loaded && !binaryPath.empty();
+		shared.ready.store(true, std::memory_order_release);
+	});
+}
+
+void MeshGeometry::saveAccelerator(SharedAccelerator &shared) {
+	if (!shared.unsaved.exchange(false)) {
+		return;
+	}
+	// Meshes are rewritten only when there is an accelerator to add
+	std::vector<char> acceleratorData;
+	if (shared.accelerator->save(acceleratorData)) {
+		writeBinary(&acceleratorData, shared.type);
+	}
+}
+
+int64_t MeshGeometry::byteCount() const {
+	int64_t bytes = int64_t(binary.size());
+	if (!binary.isOpen()) {
+		bytes += int64_t(vertices.size() * sizeof(vec3) + faces.size() * sizeof(Triangle));
+	}
+	bytes += int64_t(quantizedVertices.size() * sizeof(QuantizedVertex) + shortFaces.size() * sizeof(ShortTriangle) + deltaFaces.size() * sizeof(DeltaTriangle));
+	for (const Level &level : levels()) {
+		bytes += level.geometry->byteCount();
+	}
+	std::lock_guard<std::mutex> lock(acceleratorMutex);
+	for (const SharedAcceleratorPtr &kept : accelerators) {
+		bytes += kept->byteCount;
+	}
+	return bytes;
+}
+
+void MeshGeometry::compress() {
+	if (compressed) {
+		return;
+	}
+	const int64_t fullBytes = int64_t(vertices.size() * sizeof(vec3) + faces.size() * sizeof(Triangle));
+	const float steps = float(std::numeric_limits<uint16_t>::max());
+	quantizedOrigin = box.min;
+	for (int c = 0; c < 3; c++) {
+		quantizedStep[c] = box.max[c] > box.min[c] ? (box.max[c] - box.min[c]) / steps : 0.f;
+	}
+	quantizedVertices.resize(vertices.size());
+	for (size_t c = 0; c < vertices.size(); c++) {
+		uint16_t quantized[3];
+		for (int r = 0; r < 3; r++) {
+			const float position = quantizedStep[r] > 0.f ? (vertices[c][r] - quantizedOrigin[r]) / quantizedStep[r] : 0.f;
+			quantized[r] = uint16_t(std::min(std::max(position + 0.5f, 0.f), steps));
+		}
+		quantizedVertices[c] = { quantized[0], quantized[1], quantized[2] };
+	}
+
+	auto fitsDelta = [](const Triangle &face) {
+		for (int r = 1; r < 3; r++) {
+			const int delta = face.indices[r] - face.indices[0];
+			if (delta < std::numeric_limits<int16_t>::min() || delta > std::numeric_limits<int16_t>::max()) {
+				return false;
+			}
+		}
+		return true;
+	};
+	if (vertices.size() <= size_t(std::numeric_limits<uint16_t>::max()) + 1) {
+		faceEncoding = FaceEncoding::Short;
+		shortFaces.resize(faces.size());
+		for (size_t c = 0; c < faces.size(); c++) {
+			const Triangle &face = faces[c];
+			shortFaces[c] = { { uint16_t(face.indices[0]), uint16_t(face.indices[1]), uint16_t(face.indices[2]) } };
+		}
+	} else if (std::all_of(faces.begin(), faces.end(), fitsDelta)) {
+		faceEncoding = FaceEncoding::Delta;
+		deltaFaces.resize(faces.size());
+		for (size_t c = 0; c < faces.size(); c++) {
+			const Triangle &face = faces[c];
+			deltaFaces[c] = { face.indices[0], { int16_t(face.indices[1] - face.indices[0]), int16_t(face.indices[2] - face.indices[0]) } };
+		}
+	} else {
+		faceEncoding = FaceEncoding::Full;
+	}
+
+	// Full faces are copied out of the binary before it is unmapped
+	std::vector<Triangle> fullFaces;
+	if (faceEncoding == FaceEncoding::Full) {
+		fullFaces.assign(faces.begin(), faces.end());
+	}
+	faces.assign(std::move(fullFaces));
+	vertices.assign(std::vector<vec3>());
+	binary.close();
+	binaryPath.clear();
+	sourcePath.clear();
+	savedAccelerator = nullptr;
+	savedAcceleratorSize = 0;
+	savedAcceleratorType = -1;
+	compressed = true;
+
+	// Decoded corners round to the box only up to float precision
+	box = BBox();
+	for (const QuantizedVertex &vertex : quantizedVertices) {
+		box.add(decode(vertex));
+	}
+	const char *encodings[] = { "full", "16 bit", "delta" };
+	const int64_t compressedBytes = int64_t(quantizedVertices.size() * sizeof(QuantizedVertex) + faces.size() * sizeof(Triangle)
+		+ shortFaces.size() * sizeof(ShortTriangle) + deltaFaces.size() * sizeof(DeltaTriangle));
+	printf("Compressed mesh from %lld to %lld bytes, %s indices\n", (long long)fullBytes, (long long)compressedBytes, encodings[int(faceEncoding)]);
+}
+
+namespace {
+
+/// Vertices and faces parsed from one chunk of an OBJ file, indices are not yet offset by the vertices of previous chunks
+struct ObjChunk {
+	const char *begin;
+	const char *end;
+	std::vector<vec3> vertices;
+	std::vector<MeshGeometry::Triangle> faces;
+	std::vector<int> relativeCorners; ///< face * 3 + corner of indices relative to the first vertex of the chunk
+	BBox bounds;
+};
+
+const size_t MIN_OBJ_CHUNK_SIZE = 256 * 1024; ///< Smaller chunks are not worth a task
+const int OBJ_CHUNKS_PER_THREAD = 4; ///< Lines differ in cost, more chunks than threads balance the work
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t';
+}
+
+const char *skipSpaces(const char *p, const char *end) {
+	while (p < end && isSpace(*p)) {
+		p++;
+	}
+	return p;
+}
+
+/// @brief Parse the number at @p, from_chars is locale independent and much faster than strtod
+/// @return position after the number, @p if there is no number
+const char *parseFloat(const char *p, const char *end, float &value) {
+	if (p < end && *p == '+') {
+		p++;
+	}
+	const std::from_chars_result result = std::from_chars(p, end, value);
+	return result.ec == std::errc() ? result.ptr : p;
+}
+
+/// @brief Parse one line, same records as tinyobj::LoadObj with triangulation: polygons are split in fans, other records are skipped
+void parseObjLine(const char *p, const char *end, ObjChunk &chunk, std::vector<int> &polygon, std::vector<bool> &polygonRelative) {
+	p = skipSpaces(p, end);
+	if (end - p < 2 || !isSpace(p[1])) {
+		return;
+	}
+	if (p[0] == 'v') {
+		vec3 vertex(0.f);
+		p += 2;
+		for (int c = 0; c < 3; c++) {
+			p = parseFloat(skipSpaces(p, end), end, vertex[c]);
+		}
+		chunk.vertices.push_back(vertex);
+		chunk.bounds.add(vertex);
+	} else if (p[0] == 'f') {
+		polygon.clear();
+		polygonRelative.clear();
+		p += 2;
+		while ((p = skipSpaces(p, end)) < end) {
+			int index = 0;
+			const std::from_chars_result result = std::from_chars(p, end, index);
+			if (result.ec != std::errc()) {
+				break;
+			}
+			// texture and normal indices after the slashes are not used
+			for (p = result.ptr; p < end && !isSpace(*p); p++) {}
+			// same as tinyobj: positive indices count from 1, negative ones back from the last vertex
+			polygon.push_back(index > 0 ? index - 1 : (index == 0 ? 0 : int(chunk.vertices.size()) + index));
+			polygonRelative.push_back(index < 0);
+		}
+		for (int c = 2; c < int(polygon.size()); c++) {
+			const int corners[3] = { 0, c - 1, c };
+			for (int r = 0; r < 3; r++) {
+				if (polygonRelative[corners[r]]) {
+					chunk.relativeCorners.push_back(int(chunk.faces.size()) * 3 + r);
+				}
+			}
+			chunk.faces.push_back({ polygon[corners[0]], polygon[corners[1]], polygon[corners[2]] });
+		}
+	}
+}
+
+void parseObjChunk(ObjChunk &chunk) {
+	std::vector<int> polygon;
+	std::vector<bool> polygonRelative;
+	for (const char *line = chunk.begin; line < chunk.end;) {
+		const char *lineEnd = static_cast<const char *>(memchr(line, '\n', chunk.end - line));
+		lineEnd = lineEnd ? lineEnd : chunk.end;
+		const char *contentEnd = lineEnd;
+		while (contentEnd > line && (contentEnd[-1] == '\r' || isSpace(contentEnd[-1]))) {
+			contentEnd--;
+		}
+		parseObjLine(line, contentEnd, chunk, polygon, polygonRelative);
+		line = lineEnd + 1;
+	}
+}
+
+}
+
+bool MeshGeometry::loadFromObj(const std::string &objPath, ThreadManager *threads) {
+	if (loadFromBinary(objPath + BINARY_MESH_EXTENSION, &objPath)) {
+		return true;
+	}
+	Timer timer;
+	MappedFile file;
+	if (!file.open(objPath)) {
+		printf("Error loading file \"%s\"\n", objPath.c_str());
+		return false;
+	}
+
+	// Split in chunks of whole lines, each parsed on its own
+	const char *data = file.data();
+	const char *dataEnd = data + file.size();
+	const int threadCount = threads ? std::max(threads->getThreadCount(), 1) : 1;
+	const int chunkCount = int(std::max<size_t>(std::min<size_t>(threadCount * OBJ_CHUNKS_PER_THREAD, file.size() / MIN_OBJ_CHUNK_SIZE), 1));
+	std::vector<ObjChunk> chunks(chunkCount);
+	const char *chunkBegin = data;
+	for (int c = 0; c < chunkCount; c++) {
+		const char *chunkEnd = dataEnd;
+		if (c + 1 < chunkCount) {
+			chunkEnd = std::max(data + file.size() * (c + 1) / chunkCount, chunkBegin);
+			const char *newLine = static_cast<const char *>(memchr(chunkEnd, '\n', dataEnd - chunkEnd));
+			chunkEnd = newLine ? newLine + 1 : dataEnd;
+		}
+		chunks[c].begin = chunkBegin;
+		chunks[c].end = chunkEnd;
+		chunkBegin = chunkEnd;
+	}
+	parallelFor(threads, chunkCount, [&chunks](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			parseObjChunk(chunks[c]);
+		}
+	});
+
+	// Indices relative to the chunk become absolute once the vertices of all previous chunks are known
+	std::vector<int> vertexOffsets(chunkCount + 1, 0), faceOffsets(chunkCount + 1, 0);
+	for (int c = 0; c < chunkCount; c++) {
+		vertexOffsets[c + 1] = vertexOffsets[c] + int(chunks[c].vertices.size());
+		faceOffsets[c + 1] = faceOffsets[c] + int(chunks[c].faces.size());
+		box.add(chunks[c].bounds);
+	}
+	std::vector<vec3> loadedVertices(vertexOffsets[chunkCount]);
+	std::vector<Triangle> loadedFaces(faceOffsets[chunkCount]);
+	std::atomic<int> invalidFaces{0};
+	parallelFor(threads, chunkCount, [&](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			ObjChunk &chunk = chunks[c];
+			for (const int corner : chunk.relativeCorners) {
+				chunk.faces[corner / 3].indices[corner % 3] += vertexOffsets[c];
+			}
+			for (const Triangle &face : chunk.faces) {
+				for (const int index : face.indices) {
+					if (index < 0 || index >= int(loadedVertices.size())) {
+						invalidFaces++;
+						break;
+					}
+				}
+			}
+			std::copy(chunk.vertices.begin(), chunk.vertices.end(), loadedVertices.begin() + vertexOffsets[c]);
+			std::copy(chunk.faces.begin(), chunk.faces.end(), loadedFaces.begin() + faceOffsets[c]);
+			chunk = ObjChunk{};
+		}
+	});
+	if (invalidFaces) {
+		printf("Skipping %d faces with invalid indices in \"%s\"\n", int(invalidFaces), objPath.c_str());
+		const int vertexCount = int(loadedVertices.size());
+		loadedFaces.erase(std::remove_if(loadedFaces.begin(), loadedFaces.end(), [vertexCount](const Triangle &face) {
+			return std::any_of(std::begin(face.indices), std::end(face.indices), [vertexCount](int index) {
+				return index < 0 || index >= vertexCount;
+			});
+		}), loadedFaces.end());
+	}
+	setConverted(objPath, std::move(loadedVertices), std::move(loadedFaces), threads);
+	printf("Loaded \"%s\" with %d vertices and %d faces in %lldms\n", objPath.c_str(), vertexTotal, faceTotal, (long long)timer.toMs(timer.elapsedNs()));
+	return true;
+}
+
+void MeshGeometry::setConverted(const std::string &source, std::vector<vec3> &&parsedVertices, std::vector<Triangle> &&parsedFaces, ThreadManager *threads) {
+	vertices.assign(std::move(parsedVertices));
+	faces.assign(std::move(parsedFaces));
+	vertexTotal = int(vertices.size());
+	faceTotal = int(faces.size());
+	reorder(threads);
+	binaryPath = source + BINARY_MESH_EXTENSION;
+	sourcePath = source;
+	saveBinary();
+}
+
+namespace {
+
+/// Scalar types of PLY properties
+enum class PlyType {
+	Int8, Uint8, Int16, Uint16, Int32, Uint32, Float32, Float64, Invalid
+};
+
+/// One property of a PLY element, lists have a count of @countType followed by that many items of @type
+struct PlyProperty {
+	std::string name;
+	PlyType type = PlyType::Invalid;
+	bool isList = false;
+	PlyType countType = PlyType::Invalid;
+};
+
+struct PlyElement {
+	std::string name;
+	int64_t count = 0;
+	std::vector<PlyProperty> properties;
+};
+
+const int MIN_PLY_FACES_PER_TASK = 64 * 1024; ///< Fewer faces are not worth a task
+
+PlyType plyType(const std::string &name) {
+	static const char *const names[][2] = {
+		{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+	};
+	for (int c = 0; c < int(PlyType::Invalid); c++) {
+		if (name == names[c][0] || name == names[c][1]) {
+			return PlyType(c);
+		}
+	}
+	return PlyType::Invalid;
+}
+
+int plySize(PlyType type) {
+	static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+	return sizes[int(type)];
+}
+
+/// @brief Read little endian scalar of @type at @data, the machines rendering are little endian too
+double readPly(PlyType type, const char *data) {
+	switch (type) {
+	case PlyType::Int8: { int8_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Uint8: { uint8_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Int16: { int16_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Uint16: { uint16_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Int32: { int32_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Uint32: { uint32_t v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Float32: { float v; memcpy(&v, data, sizeof(v)); return v; }
+	case PlyType::Float64: { double v; memcpy(&v, data, sizeof(v)); return v; }
+	default: return 0.0;
+	}
+}
+
+/// @brief Parse the header at the start of @data
+/// @param headerSize [out] - bytes of the header, binary data follows
+/// @return false with the reason in @error if the file is not a binary little endian PLY
+bool parsePlyHeader(const char *data, size_t size, std::vector<PlyElement> &elements, size_t &headerSize, std::string &error) {
+	const char *const endMarker = "end_header";
+	const char *end = data + size;
+	const char *line = data;
+	bool format = false;
+	for (int lineIndex = 0; line < end; lineIndex++) {
+		const char *lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+		if (!lineEnd) {
+			error = "header has no end";
+			return false;
+		}
+		std::string text(line, lineEnd);
+		if (!text.empty() && text.back() == '\r') {
+			text.pop_back();
+		}
+		line = lineEnd + 1;
+
+		std::vector<std::string> words;
+		for (size_t start = 0; start < text.size();) {
+			const size_t space = std::min(text.find(' ', start), text.size());
+			if (space > start) {
+				words.push_back(text.substr(start, space - start));
+			}
+			start = space + 1;
+		}
+		if (lineIndex == 0) {
+			if (words.size() != 1 || words[0] != "ply") {
+				error = "not a PLY file";
+				return false;
+			}
+		} else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
 			continue;
+		} else if (words[0] == "format") {
+			if (words.size() < 2 || words[1] != "binary_little_endian") {
+				error = "only binary little endian PLY files are supported";
+				return false;
+			}
+			format = true;
+		} else if (words[0] == "element" && words.size() == 3) {
+			PlyElement element;
+			element.name = words[1];
+			element.count = std::strtoll(words[2].c_str(), nullptr, 10);
+			elements.push_back(element);
+		} else if (words[0] == "property" && !elements.empty()) {
+			PlyProperty property;
+			if (words.size() == 5 && words[1] == "list") {
+				property.isList = true;
+				property.countType = plyType(words[2]);
+				property.type = plyType(words[3]);
+				property.name = words[4];
+			} else if (words.size() == 3) {
+				property.type = plyType(words[1]);
+				property.name = words[2];
+			}
+			if (property.type == PlyType::Invalid || (property.isList && property.countType == PlyType::Invalid)) {
+				error = "unknown property \"" + text + "\"";
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		} else if (words[0] == endMarker) {
+			if (!format) {
+				error = "no format";
+				return false;
+			}
+			headerSize = size_t(line - data);
+			return true;
 		}
+	}
+	error = "header has no end";
+	return false;
+}
 
-		faces.reserve(faces.size() + numFaceVertices.size());
-		for (int r = 0; r < numFaceVertices.size(); r++) {
-			const Triangle face{
-				mesh.indices[index++].vertex_index,
-				mesh.indices[index++].vertex_index,
-				mesh.indices[index++].vertex_index,
-				this
-			};
-			faces.push_back(face);
+/// @brief Get bytes of one record of an element with only scalar properties, 0 if it has lists
+size_t plyStride(const PlyElement &element) {
+	size_t stride = 0;
+	for (const PlyProperty &property : element.properties) {
+		if (property.isList) {
+			return 0;
+		}
+		stride += plySize(property.type);
+	}
+	return stride;
+}
+
+/// @brief Get bytes of the record of @element at @data, walking its lists
+/// @return 0 if the record does not fit before @end
+size_t plyRecordSize(const PlyElement &element, const char *data, const char *end) {
+	size_t bytes = 0;
+	for (const PlyProperty &property : element.properties) {
+		if (!property.isList) {
+			bytes += plySize(property.type);
+			continue;
+		}
+		if (end - data < ptrdiff_t(bytes + plySize(property.countType))) {
+			return 0;
+		}
+		const int64_t count = int64_t(readPly(property.countType, data + bytes));
+		bytes += plySize(property.countType) + size_t(std::max<int64_t>(count, 0)) * plySize(property.type);
+	}
+	return end - data < ptrdiff_t(bytes) ? 0 : bytes;
+}
+
+}
+
+bool MeshGeometry::loadFromPly(const std::string &plyPath, ThreadManager *threads) {
+	if (loadFromBinary(plyPath + BINARY_MESH_EXTENSION, &plyPath)) {
+		return true;
+	}
+	Timer timer;
+	MappedFile file;
+	if (!file.open(plyPath)) {
+		printf("Error loading file \"%s\"\n", plyPath.c_str());
+		return false;
+	}
+	std::vector<PlyElement> elements;
+	size_t headerSize = 0;
+	std::string error;
+	if (!parsePlyHeader(file.data(), file.size(), elements, headerSize, error)) {
+		printf("Error loading file \"%s\": %s\n", plyPath.c_str(), error.c_str());
+		return false;
+	}
+	auto fail = [&plyPath](const char *reason) {
+		printf("Error loading file \"%s\": %s\n", plyPath.c_str(), reason);
+		return false;
+	};
+
+	// Elements before the faces are skipped by their size, ones after them are not read at all
+	const char *data = file.data() + headerSize;
+	const char *dataEnd = file.data() + file.size();
+	const PlyElement *vertexElement = nullptr;
+	const PlyElement *faceElement = nullptr;
+	const char *vertexData = nullptr;
+	const char *faceData = nullptr;
+	for (const PlyElement &element : elements) {
+		if (element.count < 0) {
+			return fail("negative element count");
+		}
+		if (element.name == "vertex") {
+			vertexElement = &element;
+			vertexData = data;
+		} else if (element.name == "face") {
+			faceElement = &element;
+			faceData = data;
+			break;
+		}
+		const size_t stride = plyStride(element);
+		if (!stride) {
+			return fail("lists before the faces");
+		}
+		if (uint64_t(dataEnd - data) / stride < uint64_t(element.count)) {
+			return fail("file is truncated");
+		}
+		data += stride * element.count;
+	}
+	if (!vertexElement || !faceElement) {
+		return fail("no vertex or face element");
+	}
+	if (vertexElement->count > std::numeric_limits<int>::max() || faceElement->count > std::numeric_limits<int>::max()) {
+		return fail("too many vertices or faces");
+	}
+
+	// Vertices
+	const size_t vertexStride = plyStride(*vertexElement);
+	int axisOffsets[3] = { -1, -1, -1 };
+	PlyType axisTypes[3] = { PlyType::Invalid, PlyType::Invalid, PlyType::Invalid };
+	int propertyOffset = 0;
+	for (const PlyProperty &property : vertexElement->properties) {
+		const int axis = property.name == "x" ? 0 : (property.name == "y" ? 1 : (property.name == "z" ? 2 : -1));
+		if (axis >= 0) {
+			axisOffsets[axis] = propertyOffset;
+			axisTypes[axis] = property.type;
+		}
+		propertyOffset += plySize(property.type);
+	}
+	if (axisOffsets[0] < 0 || axisOffsets[1] < 0 || axisOffsets[2] < 0) {
+		return fail("vertices have no x, y and z");
+	}
+	const int vertexCount = int(vertexElement->count);
+	std::vector<vec3> loadedVertices(vertexCount);
+	const bool packedPositions = vertexStride == sizeof(vec3) && axisOffsets[0] == 0 && axisOffsets[1] == 4 && axisOffsets[2] == 8
+		&& axisTypes[0] == PlyType::Float32 && axisTypes[1] == PlyType::Float32 && axisTypes[2] == PlyType::Float32;
+	if (packedPositions) {
+		memcpy(loadedVertices.data(), vertexData, loadedVertices.size() * sizeof(vec3));
+	} else {
+		parallelFor(threads, vertexCount, [&](int begin, int end) {
+			for (int c = begin; c < end; c++) {
+				const char *record = vertexData + size_t(c) * vertexStride;
+				for (int axis = 0; axis < 3; axis++) {
+					loadedVertices[c][axis] = float(readPly(axisTypes[axis], record + axisOffsets[axis]));
+				}
+			}
+		});
+	}
+	for (const vec3 &vertex : loadedVertices) {
+		box.add(vertex);
+	}
+
+	// Faces, each record is a list of indices split in a fan, other properties of the faces are skipped
+	int indexProperty = -1;
+	for (int c = 0; c < int(faceElement->properties.size()); c++) {
+		const PlyProperty &property = faceElement->properties[c];
+		if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+			indexProperty = c;
+		}
+	}
+	if (indexProperty < 0) {
+		return fail("faces have no vertex_indices");
+	}
+	const PlyProperty &indices = faceElement->properties[indexProperty];
+	const int countSize = plySize(indices.countType);
+	const int indexSize = plySize(indices.type);
+	size_t indexOffset = 0;
+	for (int c = 0; c < indexProperty; c++) {
+		if (faceElement->properties[c].isList) {
+			return fail("lists before vertex_indices");
+		}
+		indexOffset += plySize(faceElement->properties[c].type);
+	}
+
+	// Most scanned meshes have only triangles, then every record has the same size and can be decoded in place
+	const int64_t recordCount = faceElement->count;
+	bool onlyTriangles = true;
+	size_t triangleRecord = 0;
+	for (int c = 0; c < int(faceElement->properties.size()); c++) {
+		const PlyProperty &property = faceElement->properties[c];
+		if (property.isList && c != indexProperty) {
+			onlyTriangles = false;
+		}
+		triangleRecord += c == indexProperty ? countSize + 3 * indexSize : plySize(property.type);
+	}
+	onlyTriangles = onlyTriangles && uint64_t(dataEnd - faceData) / triangleRecord >= uint64_t(recordCount);
+	const int taskCount = int(std::min<int64_t>(std::max<int64_t>(recordCount / MIN_PLY_FACES_PER_TASK, 1), threads ? threads->getThreadCount() * OBJ_CHUNKS_PER_THREAD : 1));
+	if (onlyTriangles) {
+		std::atomic<bool> allTriangles{true};
+		parallelFor(threads, taskCount, [&](int begin, int end) {
+			for (int64_t c = recordCount * begin / taskCount; c < recordCount * end / taskCount && allTriangles; c++) {
+				if (readPly(indices.countType, faceData + c * triangleRecord + indexOffset) != 3.0) {
+					allTriangles = false;
+				}
+			}
+		});
+		onlyTriangles = allTriangles;
+	}
+
+	// Otherwise the start of each record is found walking them once, then the fans are decoded in parallel
+	std::vector<uint64_t> recordOffsets;
+	std::vector<int> firstTriangles;
+	int triangleCount = int(recordCount);
+	if (!onlyTriangles) {
+		recordOffsets.resize(size_t(recordCount));
+		firstTriangles.resize(size_t(recordCount) + 1);
+		uint64_t offset = 0;
+		int64_t triangles = 0;
+		for (int64_t c = 0; c < recordCount; c++) {
+			const size_t bytes = plyRecordSize(*faceElement, faceData + offset, dataEnd);
+			if (!bytes) {
+				return fail("file is truncated");
+			}
+			recordOffsets[c] = offset;
+			firstTriangles[c] = int(triangles);
+			triangles += std::max<int64_t>(int64_t(readPly(indices.countType, faceData + offset + indexOffset)) - 2, 0);
+			offset += bytes;
+		}
+		if (triangles > std::numeric_limits<int>::max()) {
+			return fail("too many faces");
+		}
+		firstTriangles[recordCount] = int(triangles);
+		triangleCount = int(triangles);
+	}
+
+	std::vector<Triangle> loadedFaces(triangleCount);
+	std::atomic<int> invalidFaces{0};
+	parallelFor(threads, taskCount, [&](int begin, int end) {
+		std::vector<int> polygon;
+		for (int64_t c = recordCount * begin / taskCount; c < recordCount * end / taskCount; c++) {
+			const char *record = faceData + (onlyTriangles ? c * triangleRecord : recordOffsets[c]) + indexOffset;
+			const int count = int(readPly(indices.countType, record));
+			polygon.resize(std::max(count, 0));
+			for (int r = 0; r < count; r++) {
+				polygon[r] = int(readPly(indices.type, record + countSize + r * indexSize));
+			}
+			// Records with fewer than 3 indices add no faces, their offset can be the end of the array
+			Triangle *fan = loadedFaces.data() + (onlyTriangles ? c : firstTriangles[c]);
+			for (int r = 2; r < count; r++) {
+				*fan++ = { polygon[0], polygon[r - 1], polygon[r] };
+				for (const int index : { polygon[0], polygon[r - 1], polygon[r] }) {
+					if (index < 0 || index >= vertexCount) {
+						invalidFaces++;
+						break;
+					}
+				}
+			}
 		}
+	});
+	if (invalidFaces) {
+		printf("Skipping %d faces with invalid indices in \"%s\"\n", int(invalidFaces), plyPath.c_str());
+		loadedFaces.erase(std::remove_if(loadedFaces.begin(), loadedFaces.end(), [vertexCount](const Triangle &face) {
+			return std::any_of(std::begin(face.indices), std::end(face.indices), [vertexCount](int index) {
+				return index < 0 || index >= vertexCount;
+			});
+		}), loadedFaces.end());
 	}
+
+	setConverted(plyPath, std::move(loadedVertices), std::move(loadedFaces), threads);
+	printf("Loaded \"%s\" with %d vertices and %d faces in %lldms\n", plyPath.c_str(), vertexTotal, faceTotal, (long long)timer.toMs(timer.elapsedNs()));
 	return true;
 }
 
+namespace {
+
+const int MORTON_BITS = 21; ///< Per axis, all three fit in 64 bits
+
+/// Spread the low MORTON_BITS bits of @x to every third bit
+uint64_t spreadBits(uint64_t x) {
+	x = (x | (x << 32)) & 0x001f00000000ffff;
+	x = (x | (x << 16)) & 0x001f0000ff0000ff;
+	x = (x | (x << 8)) & 0x100f00f00f00f00f;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+	x = (x | (x << 2)) & 0x1249249249249249;
+	return x;
+}
+
+}
+
+void MeshGeometry::reorder(ThreadManager *threads) {
+	const int faceCount = int(faces.size());
+	const int vertexCount = int(vertices.size());
+	vec3 scale(0.f);
+	for (int c = 0; c < 3; c++) {
+		const float extent = box.max[c] - box.min[c];
+		scale[c] = extent > 0.f ? float((1 << MORTON_BITS) - 1) / extent : 0.f;
+	}
+
+	// Ties keep file order, so the order is the same on every load
+	std::vector<std::pair<uint64_t, int>> order(faceCount);
+	parallelFor(threads, faceCount, [&](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			const Triangle &face = faces[c];
+			const vec3 centroid = (vertices[face.indices[0]] + vertices[face.indices[1]] + vertices[face.indices[2]]) / 3.f;
+			uint64_t code = 0;
+			for (int r = 0; r < 3; r++) {
+				const float position = std::min(std::max((centroid[r] - box.min[r]) * scale[r], 0.f), float((1 << MORTON_BITS) - 1));
+				code |= spreadBits(uint64_t(position)) << r;
+			}
+			order[c] = { code, c };
+		}
+	});
+	std::sort(order.begin(), order.end());
+
+	std::vector<int> remap(vertexCount, -1);
+	std::vector<vec3> orderedVertices;
+	orderedVertices.reserve(vertexCount);
+	std::vector<Triangle> orderedFaces(faceCount);
+	for (int c = 0; c < faceCount; c++) {
+		const Triangle &face = faces[order[c].second];
+		for (int r = 0; r < 3; r++) {
+			int &index = remap[face.indices[r]];
+			if (index == -1) {
+				index = int(orderedVertices.size());
+				orderedVertices.push_back(vertices[face.indices[r]]);
+			}
+			orderedFaces[c].indices[r] = index;
+		}
+	}
+	// Vertices no face uses are kept at the end
+	for (int c = 0; c < vertexCount; c++) {
+		if (remap[c] == -1) {
+			orderedVertices.push_back(vertices[c]);
+		}
+	}
+	vertices.assign(std::move(orderedVertices));
+	faces.assign(std::move(orderedFaces));
+}
+
+namespace {
+
+/// Sum of squared distances to a set of planes, as the symmetric 4x4 matrix of Garland and Heckbert
+///	Elements are aa, ab, ac, ad, bb, bc, bd, cc, cd, dd of the planes ax + by + cz + d = 0
+struct Quadric {
+	double q[10] = {};
+
+	/// @brief Add plane through @point with unit @normal
+	void addPlane(const vec3 &normal, const vec3 &point, double weight = 1.0) {
+		const double a = normal.x, b = normal.y, c = normal.z;
+		const double d = -(a * point.x + b * point.y + c * point.z);
+		const double plane[10] = { a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d };
+		for (int r = 0; r < 10; r++) {
+			q[r] += plane[r] * weight;
+		}
+	}
+
+	Quadric &operator+=(const Quadric &other) {
+		for (int r = 0; r < 10; r++) {
+			q[r] += other.q[r];
+		}
+		return *this;
+	}
+
+	double error(const vec3 &p) const {
+		const double x = p.x, y = p.y, z = p.z;
+		return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+			+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+			+ q[7] * z * z + 2 * q[8] * z + q[9];
+	}
+
+	/// @brief Find the point with the least error
+	/// @return false if there is no single such point, on flat or straight parts
+	bool minimum(vec3 &p) const {
+		const double det = q[0] * (q[4] * q[7] - q[5] * q[5]) - q[1] * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * q[5] - q[4] * q[2]);
+		if (fabs(det) < 1e-9) {
+			return false;
+		}
+		// Cramer's rule for A p = -b
+		const double bx = -q[3], by = -q[6], bz = -q[8];
+		p.x = float((bx * (q[4] * q[7] - q[5] * q[5]) - q[1] * (by * q[7] - q[5] * bz) + q[2] * (by * q[5] - q[4] * bz)) / det);
+		p.y = float((q[0] * (by * q[7] - bz * q[5]) - bx * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * bz - by * q[2])) / det);
+		p.z = float((q[0] * (q[4] * bz - q[5] * by) - q[1] * (q[1] * bz - by * q[2]) + bx * (q[1] * q[5] - q[4] * q[2])) / det);
+		return true;
+	}
+};
+
+/// Edge that may be collapsed, valid while neither end changed since it was evaluated
+struct Collapse {
+	double cost;
+	int kept, removed;
+	uint32_t keptStamp, removedStamp;
+	vec3 target;
+
+	bool operator<(const Collapse &other) const {
+		return cost > other.cost; // cheapest on top of std::priority_queue
+	}
+};
+
+const double BORDER_WEIGHT = 10.0; ///< Planes across open borders, so they are not pulled in
+const int MAX_LEVELS = 8;
+const float MIN_FACE_ALIGNMENT = 0.2f; ///< Collapses turning a face further than this cosine are rejected as flips
+
+}
+
+void MeshGeometry::buildLevels() {
+	std::call_once(levelsOnce, [this]() {
+		if (faceTotal < LOD_MIN_FACES) {
+			levelsBuilt = true;
+			return;
+		}
+		Timer timer;
+		const int vertexCount = vertexTotal;
+		const int faceCount = faceTotal;
+		std::vector<vec3> positions(vertexCount);
+		for (int c = 0; c < vertexCount; c++) {
+			positions[c] = vertex(c);
+		}
+		std::vector<Triangle> triangles(faceCount);
+		for (int c = 0; c < faceCount; c++) {
+			cornerIndices(c, triangles[c].indices[0], triangles[c].indices[1], triangles[c].indices[2]);
+		}
+
+		// Each vertex starts with the planes of its faces, edges are found by sorting the ones of every face
+		std::vector<Quadric> quadrics(vertexCount);
+		std::vector<std::vector<int>> vertexFaces(vertexCount);
+		std::vector<std::pair<uint64_t, int>> edges;
+		edges.reserve(faceCount * 3);
+		for (int c = 0; c < faceCount; c++) {
+			const int *index = triangles[c].indices;
+			const vec3 normal = cross(positions[index[1]] - positions[index[0]], positions[index[2]] - positions[index[0]]);
+			const float area = normal.length();
+			for (int r = 0; r < 3; r++) {
+				if (area > 0.f) {
+					quadrics[index[r]].addPlane(normal / area, positions[index[0]]);
+				}
+				vertexFaces[index[r]].push_back(c);
+				const uint32_t from = uint32_t(std::min(index[r], index[(r + 1) % 3]));
+				const uint32_t to = uint32_t(std::max(index[r], index[(r + 1) % 3]));
+				edges.push_back({ (uint64_t(from) << 32) | to, c });
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+
+		std::vector<uint32_t> stamps(vertexCount, 0);
+		std::vector<char> removedVertex(vertexCount, 0);
+		std::vector<char> removedFace(faceCount, 0);
+		auto evaluate = [&](int kept, int removed) {
+			Quadric quadric = quadrics[kept];
+			quadric += quadrics[removed];
+			const vec3 &A = positions[kept];
+			const vec3 &B = positions[removed];
+			vec3 target;
+			// Ill conditioned minimums land far off the edge, then the best of its ends and middle is used
+			const bool solved = quadric.minimum(target) && (target - (A + B) * 0.5f).lengthSquare() <= (B - A).lengthSquare() && box.inside(target);
+			if (!solved) {
+				const vec3 candidates[3] = { A, B, (A + B) * 0.5f };
+				double best = std::numeric_limits<double>::max();
+				for (const vec3 &candidate : candidates) {
+					const double error = quadric.error(candidate);
+					if (error < best) {
+						best = error;
+						target = candidate;
+					}
+				}
+			}
+			return Collapse{ std::max(quadric.error(target), 0.0), kept, removed, stamps[kept], stamps[removed], target };
+		};
+
+		std::priority_queue<Collapse> queue;
+		for (size_t c = 0; c < edges.size();) {
+			size_t next = c + 1;
+			while (next < edges.size() && edges[next].first == edges[c].first) {
+				next++;
+			}
+			const int from = int(edges[c].first >> 32);
+			const int to = int(edges[c].first & 0xffffffff);
+			if (next - c == 1) {
+				// Border edge, plane through it perpendicular to its face
+				const int *index = triangles[edges[c].second].indices;
+				const vec3 faceNormal = cross(positions[index[1]] - positions[index[0]], positions[index[2]] - positions[index[0]]);
+				const vec3 across = cross(positions[to] - positions[from], faceNormal);
+				if (across.lengthSquare() > 0.f) {
+					quadrics[from].addPlane(across.normalized(), positions[from], BORDER_WEIGHT);
+					quadrics[to].addPlane(across.normalized(), positions[from], BORDER_WEIGHT);
+				}
+			}
+			c = next;
+		}
+		for (size_t c = 0; c < edges.size(); c++) {
+			if (c == 0 || edges[c].first != edges[c - 1].first) {
+				queue.push(evaluate(int(edges[c].first >> 32), int(edges[c].first & 0xffffffff)));
+			}
+		}
+		edges = std::vector<std::pair<uint64_t, int>>();
+
+		// Moving @moved to @target must not turn any of its faces, other than the ones with @other, over
+		auto flips = [&](int moved, int other, const vec3 &target) {
+			for (const int face : vertexFaces[moved]) {
+				const int *index = triangles[face].indices;
+				if (removedFace[face] || index[0] == other || index[1] == other || index[2] == other) {
+					continue;
+				}
+				vec3 corners[3];
+				for (int r = 0; r < 3; r++) {
+					corners[r] = index[r] == moved ? target : positions[index[r]];
+				}
+				const vec3 before = cross(positions[index[1]] - positions[index[0]], positions[index[2]] - positions[index[0]]);
+				const vec3 after = cross(corners[1] - corners[0], corners[2] - corners[0]);
+				const float lengths = before.length() * after.length();
+				if (lengths == 0.f || dot(before, after) < MIN_FACE_ALIGNMENT * lengths) {
+					return true;
+				}
+			}
+			return false;
+		};
+
+		int faceLeft = faceCount;
+		int nextLevel = faceCount / 2;
+		double maxCost = 0.0;
+		std::vector<int> neighbours;
+		while (!queue.empty() && int(simplified.size()) < MAX_LEVELS) {
+			const Collapse collapse = queue.top();
+			queue.pop();
+			const int kept = collapse.kept;
+			const int removed = collapse.removed;
+			if (removedVertex[kept] || removedVertex[removed] || stamps[kept] != collapse.keptStamp || stamps[removed] != collapse.removedStamp) {
+				continue;
+			}
+			if (flips(kept, removed, collapse.target) || flips(removed, kept, collapse.target)) {
+				continue; // evaluated again when a neighbour changes
+			}
+
+			positions[kept] = collapse.target;
+			quadrics[kept] += quadrics[removed];
+			removedVertex[removed] = 1;
+			stamps[kept]++;
+			stamps[removed]++;
+			maxCost = std::max(maxCost, collapse.cost);
+			for (const int face : vertexFaces[removed]) {
+				if (removedFace[face]) {
+					continue;
+				}
+				int *index = triangles[face].indices;
+				if (index[0] == kept || index[1] == kept || index[2] == kept) {
+					removedFace[face] = 1;
+					faceLeft--;
+					continue;
+				}
+				for (int r = 0; r < 3; r++) {
+					if (index[r] == removed) {
+						index[r] = kept;
+					}
+				}
+				vertexFaces[kept].push_back(face);
+			}
+			vertexFaces[removed] = std::vector<int>();
+
+			std::vector<int> &keptFaces = vertexFaces[kept];
+			keptFaces.erase(std::remove_if(keptFaces.begin(), keptFaces.end(), [&](int face) { return removedFace[face] != 0; }), keptFaces.end());
+			neighbours.clear();
+			for (const int face : keptFaces) {
+				for (const int index : triangles[face].indices) {
+					if (index != kept) {
+						neighbours.push_back(index);
+					}
+				}
+			}
+			// Only the edges of @kept changed, the cost of the others depends on their own ends alone
+			std::sort(neighbours.begin(), neighbours.end());
+			neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+			for (const int neighbour : neighbours) {
+				queue.push(evaluate(kept, neighbour));
+			}
+
+			if (faceLeft > nextLevel) {
+				continue;
+			}
+			std::vector<int> remap(vertexCount, -1);
+			std::vector<vec3> levelVertices;
+			std::vector<Triangle> levelFaces;
+			levelFaces.reserve(faceLeft);
+			for (int c = 0; c < faceCount; c++) {
+				if (removedFace[c]) {
+					continue;
+				}
+				Triangle face;
+				for (int r = 0; r < 3; r++) {
+					int &index = remap[triangles[c].indices[r]];
+					if (index == -1) {
+						index = int(levelVertices.size());
+						levelVertices.push_back(positions[triangles[c].indices[r]]);
+					}
+					face.indices[r] = index;
+				}
+				levelFaces.push_back(face);
+			}
+			MeshGeometryPtr level = std::make_shared<MeshGeometry>();
+			for (const vec3 &position : levelVertices) {
+				level->box.add(position);
+			}
+			level->vertices.assign(std::move(levelVertices));
+			level->faces.assign(std::move(levelFaces));
+			level->vertexTotal = int(level->vertices.size());
+			level->faceTotal = int(level->faces.size());
+			level->reorder();
+			if (compressed) {
+				level->compress();
+			}
+			simplified.push_back({ level, float(sqrt(maxCost)) });
+
+			nextLevel = faceLeft / 2;
+			if (nextLevel < LOD_MIN_FACES / 2) {
+				break;
+			}
+		}
+		levelsBuilt = true;
+		printf("Simplified mesh with %d faces to %d levels, coarsest with %d faces, in %lldms\n", faceCount, int(simplified.size()),
+			simplified.empty() ? faceCount : simplified.back().geometry->faceCount(), (long long)timer.toMs(timer.elapsedNs()));
+	});
+}
+
+namespace {
+
+/// Start of binary mesh files, followed by the sections it points to
+///	Sections are stored in the byte order of the machine that wrote them and start at multiples of MESH_SECTION_ALIGNMENT
+struct BinaryMeshHeader {
+	char magic[4];
+	uint32_t version;
+	int64_t sourceSize; ///< Size of the converted file, -1 if there is none
+	int64_t sourceTime; ///< Modification time of the converted file
+	BBox bounds;
+	int32_t vertexCount;
+	int32_t faceCount;
+	uint64_t vertexOffset;
+	uint64_t faceOffset;
+	int32_t acceleratorType; ///< AcceleratorType of the accelerator section, -1 if there is none
+	uint32_t pad;
+	uint64_t acceleratorOffset;
+	uint64_t acceleratorSize;
+};
+
+const char BINARY_MESH_MAGIC[4] = { 'M', 'E', 'S', 'H' };
+const uint32_t BINARY_MESH_VERSION = 2; ///< 2 has reordered faces and vertices
+const uint64_t MESH_SECTION_ALIGNMENT = 64; ///< Cache line, so accelerators can use their nodes in place
+
+uint64_t alignSection(uint64_t offset) {
+	return (offset + MESH_SECTION_ALIGNMENT - 1) / MESH_SECTION_ALIGNMENT * MESH_SECTION_ALIGNMENT;
+}
+
+}
+
+const char *const MeshGeometry::BINARY_MESH_EXTENSION = ".mesh";
+
+bool MeshGeometry::load(const std::string &path, ThreadManager *threads) {
+	std::string extension = std::filesystem::path(path).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+		return char(std::tolower(c));
+	});
+	if (extension == BINARY_MESH_EXTENSION) {
+		if (!loadFromBinary(path)) {
+			printf("Error loading file \"%s\"\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+	if (extension == ".ply") {
+		return loadFromPly(path, threads);
+	}
+	return loadFromObj(path, threads);
+}
+
+void MeshGeometry::view(const vec3 *vertexData, int vertexCount, const Triangle *faceData, int faceCount, const BBox &bounds) {
+	vertices.view(vertexData, vertexCount);
+	faces.view(faceData, faceCount);
+	vertexTotal = vertexCount;
+	faceTotal = faceCount;
+	box = bounds;
+}
+
+bool MeshGeometry::loadFromBinary(const std::string &path, const std::string *source) {
+	Timer timer;
+	int64_t sourceSize = -1, sourceTime = 0;
+	if (source && !fileStamp(*source, sourceSize, sourceTime)) {
+		return false;
+	}
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(BinaryMeshHeader)) {
+		return false;
+	}
+	BinaryMeshHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, BINARY_MESH_MAGIC, sizeof(header.magic)) != 0 || header.version != BINARY_MESH_VERSION) {
+		printf("\"%s\" is not a binary mesh of version %d\n", path.c_str(), int(BINARY_MESH_VERSION));
+		return false;
+	}
+	if (source && (header.sourceSize != sourceSize || header.sourceTime != sourceTime)) {
+		return false; // converted from an older version of the source
+	}
+	auto fits = [&file](uint64_t offset, uint64_t bytes) {
+		return offset % MESH_SECTION_ALIGNMENT == 0 && offset <= file.size() && bytes <= file.size() - offset;
+	};
+	if (header.vertexCount < 0 || header.faceCount < 0
+		|| !fits(header.vertexOffset, uint64_t(header.vertexCount) * sizeof(vec3))
+		|| !fits(header.faceOffset, uint64_t(header.faceCount) * sizeof(Triangle))
+		|| (header.acceleratorType >= 0 && !fits(header.acceleratorOffset, header.acceleratorSize))) {
+		printf("Binary mesh \"%s\" is truncated\n", path.c_str());
+		return false;
+	}
+
+	binary = std::move(file);
+	view(reinterpret_cast<const vec3 *>(binary.data() + header.vertexOffset), header.vertexCount,
+		reinterpret_cast<const Triangle *>(binary.data() + header.faceOffset), header.faceCount, header.bounds);
+	binaryPath = path;
+	sourcePath = source ? *source : std::string();
+	savedAccelerator = header.acceleratorType >= 0 ? binary.data() + header.acceleratorOffset : nullptr;
+	savedAcceleratorSize = header.acceleratorType >= 0 ? size_t(header.acceleratorSize) : 0;
+	savedAcceleratorType = header.acceleratorType;
+	printf("Mapped \"%s\" with %d vertices and %d faces in %lldms\n", path.c_str(), header.vertexCount, header.faceCount, (long long)timer.toMs(timer.elapsedNs()));
+	return true;
+}
+
+bool MeshGeometry::saveBinary() {
+	return writeBinary(nullptr, AcceleratorType::Octtree);
+}
+
+bool MeshGeometry::writeBinary(const std::vector<char> *acceleratorData, AcceleratorType acceleratorType) {
+	if (binaryPath.empty()) {
+		return false;
+	}
+	static_assert(std::is_trivially_copyable<vec3>::value && std::is_trivially_copyable<Triangle>::value, "sections are written as raw memory");
+
+	BinaryMeshHeader header = {};
+	memcpy(header.magic, BINARY_MESH_MAGIC, sizeof(header.magic));
+	header.version = BINARY_MESH_VERSION;
+	header.sourceSize = -1;
+	if (!sourcePath.empty() && !fileStamp(sourcePath, header.sourceSize, header.sourceTime)) {
+		return false;
+	}
+	header.bounds = box;
+	header.vertexCount = int32_t(vertices.size());
+	header.faceCount = int32_t(faces.size());
+	header.vertexOffset = alignSection(sizeof(header));
+	header.faceOffset = alignSection(header.vertexOffset + vertices.size() * sizeof(vec3));
+
+	header.acceleratorType = -1;
+	if (acceleratorData) {
+		header.acceleratorType = int32_t(acceleratorType);
+		header.acceleratorOffset = alignSection(header.faceOffset + faces.size() * sizeof(Triangle));
+		header.acceleratorSize = acceleratorData->size();
+	}
+
+	// Written next to the target and moved over it, processes mapping the old file keep their view of it
+	const std::string temporaryPath = binaryPath + ".tmp";
+	FILE *file = fopen(temporaryPath.c_str(), "wb");
+	if (!file) {
+		printf("Can't write binary mesh \"%s\"\n", binaryPath.c_str());
+		return false;
+	}
+	uint64_t position = 0;
+	auto writeAt = [file, &position](uint64_t offset, const void *data, size_t bytes) {
+		static const char padding[MESH_SECTION_ALIGNMENT] = {};
+		const size_t paddingBytes = size_t(offset - position);
+		position = offset + bytes;
+		return fwrite(padding, 1, paddingBytes, file) == paddingBytes && fwrite(data, 1, bytes, file) == bytes;
+	};
+	bool written = writeAt(0, &header, sizeof(header))
+		&& writeAt(header.vertexOffset, vertices.data(), vertices.size() * sizeof(vec3))
+		&& writeAt(header.faceOffset, faces.data(), faces.size() * sizeof(Triangle));
+	if (written && acceleratorData) {
+		written = writeAt(header.acceleratorOffset, acceleratorData->data(), acceleratorData->size());
+	}
+	written = fclose(file) == 0 && written;
+
+	std::error_code error;
+	if (written) {
+		std::filesystem::rename(temporaryPath, binaryPath, error);
+	}
+	if (!written || error) {
+		// Windows can't replace a file that is mapped, the mesh is then used without saving its accelerator
+		printf("Can't write binary mesh \"%s\"\n", binaryPath.c_str());
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
+
+
+namespace {
+
+/// FNV-1a over 8 byte words, only needs to tell apart versions of files with the same size
+uint64_t hashContent(const char *data, size_t size) {
+	const uint64_t prime = 1099511628211ull;
+	uint64_t hash = 14695981039346656037ull;
+	size_t c = 0;
+	for (; c + sizeof(uint64_t) <= size; c += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + c, sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+	for (; c < size; c++) {
+		hash = (hash ^ uint8_t(data[c])) * prime;
+	}
+	return hash;
+}
+
+}
+
+MeshCache &MeshCache::get() {
+	static MeshCache cache;
+	return cache;
+}
+
+MeshGeometryPtr MeshCache::acquire(const std::string &path, const MeshLoadSettings &settings) {
+	int64_t size = -1, time = 0;
+	const bool stamped = fileStamp(path, size, time);
+	if (stamped) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Entry &entry : entries) {
+			for (const Source &source : entry.sources) {
+				if (entry.compressed == settings.compressed && source.path == path && source.size == size && source.time == time) {
+					entry.lastUse = ++useCounter;
+					return entry.geometry;
+				}
+			}
+		}
+	}
+
+	// Unknown version of the file, the content tells if it is really new
+	uint64_t contentHash = 0;
+	bool hashed = false;
+	if (stamped) {
+		MappedFile file;
+		if (file.open(path)) {
+			contentHash = hashContent(file.data(), file.size());
+			hashed = true;
+		}
+	}
+	auto findContent = [&]() -> Entry* {
+		for (Entry &entry : entries) {
+			if (entry.contentHash == contentHash && entry.contentSize == size && entry.compressed == settings.compressed) {
+				entry.sources.push_back({ path, size, time });
+				entry.lastUse = ++useCounter;
+				return &entry;
+			}
+		}
+		return nullptr;
+	};
+	if (hashed) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (Entry *entry = findContent()) {
+			return entry->geometry;
+		}
+	}
+
+	// Loaded without the lock, other files can be acquired meanwhile
+	MeshGeometryPtr geometry = std::make_shared<MeshGeometry>();
+	if (!geometry->load(path, settings.threads)) {
+		return geometry;
+	}
+	if (settings.compressed) {
+		geometry->compress();
+	}
+	if (!hashed) {
+		return geometry;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if (Entry *entry = findContent()) {
+		return entry->geometry; // loaded by another thread at the same time
+	}
+	entries.push_back({ geometry, { { path, size, time } }, contentHash, size, settings.compressed, ++useCounter });
+	evict();
+	return geometry;
+}
+
+void MeshCache::setCapacity(int64_t bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	capacity = bytes;
+	evict();
+}
+
+void MeshCache::evict() {
+	int64_t total = 0;
+	for (const Entry &entry : entries) {
+		total += entry.geometry->byteCount();
+	}
+	while (total > capacity) {
+		int oldest = -1;
+		for (int c = 0; c < int(entries.size()); c++) {
+			// only the cache holds it
+			if (entries[c].geometry.use_count() == 1 && (oldest == -1 || entries[c].lastUse < entries[oldest].lastUse)) {
+				oldest = c;
+			}
+		}
+		if (oldest == -1) {
+			break;
+		}
+		total -= entries[oldest].geometry->byteCount();
+		printf("Evicted \"%s\" from the mesh cache\n", entries[oldest].sources.front().path.c_str());
+		entries.erase(entries.begin() + oldest);
+	}
+}
 
 bool TriangleMesh::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
 	if (!box.testIntersect(ray)) {
 		return false;
 	}
-	if (accelerator && accelerator->isBuilt()) {
-		return accelerator->intersect(ray, tMin, tMax, intersection);
+	if (clustered) {
+		if (!clustered->intersect(ray, tMin, tMax, intersection)) {
+			return false;
+		}
+		intersection.material = material.get();
+		return true;
+	}
+	if (accelerator) {
+		geometry->buildAccelerator(*accelerator);
+		if (!accelerator->accelerator->intersect(ray, tMin, tMax, intersection)) {
+			return false;
+		}
+		intersection.material = material.get();
+		return true;
+	}
+	if (packed.count()) {
+		vec3 normal;
+		if (packed.intersect(ray, tMin, tMax, normal) == -1) {
+			return false;
+		}
+		intersection.t = tMax;
+		intersection.p = ray.origin + ray.dir * tMax;
+		intersection.normal = normal;
+		intersection.material = material.get();
+		return true;
 	}
 	bool haveRes = false;
-	for (int c = 0; c < faces.size(); c++) {
-		haveRes = haveRes || faces[c].intersect(ray, tMin, tMax, intersection);
+	for (int c = 0; c < faceCount(); c++) {
+		if (geometry->intersectPrimitive(c, ray, tMin, tMax, intersection)) {
+			tMax = intersection.t;
+			haveRes = true;
+		}
+	}
+	if (haveRes) {
+		intersection.material = material.get();
 	}
 	return haveRes;
 }
 
-
+void TriangleMesh::intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	if (accelerator) {
+		geometry->buildAccelerator(*accelerator);
+		// need to know which hits are new to set their material
+		bool meshHits[BATCH_CHUNK_RAYS];
+		for (int start = 0; start < count; start += BATCH_CHUNK_RAYS) {
+			const int chunk = std::min(count - start, BATCH_CHUNK_RAYS);
+			std::fill(meshHits, meshHits + chunk, false);
+			accelerator->accelerator->intersectBatch(rays + start, chunk, tMin, tMax + start, intersections + start, meshHits);
+			for (int c = 0; c < chunk; c++) {
+				if (meshHits[c]) {
+					intersections[start + c].material = material.get();
+					hits[start + c] = true;
+				}
+			}
+		}
+		return;
+	}
+	Primitive::intersectBatch(rays, count, tMin, tMax, intersections, hits);
+}
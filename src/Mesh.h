@@ -1,35 +1,435 @@
 #pragma once
 
 #include "Primitive.h"
+#include "Packed.h"
+#include "MappedFile.hpp"
 #include "Utils.hpp"
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-struct TriangleMesh : Primitive {
-	struct Triangle : Intersectable {
+/// Read only array of mesh data, either owned or pointing into a mapped mesh file
+template <typename T>
+struct MeshArray {
+	MeshArray() = default;
+	MeshArray(const MeshArray &) = delete;
+	MeshArray &operator=(const MeshArray &) = delete;
+
+	/// @brief Take ownership of @data
+	void assign(std::vector<T> &&data) {
+		owned = std::move(data);
+		items = owned.data();
+		count = owned.size();
+	}
+
+	/// @brief Point to @size items at @data without copying, the memory must outlive the array
+	void view(const T *data, size_t size) {
+		owned = std::vector<T>();
+		items = data;
+		count = size;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	const T *data() const {
+		return items;
+	}
+
+	const T *begin() const {
+		return items;
+	}
+
+	const T *end() const {
+		return items + count;
+	}
+
+	const T &operator[](size_t index) const {
+		return items[index];
+	}
+
+private:
+	std::vector<T> owned;
+	const T *items = nullptr;
+	size_t count = 0;
+};
+
+/// How mesh files are loaded, passed to TriangleMesh and MeshCache
+struct MeshLoadSettings {
+	ThreadManager *threads = nullptr; ///< Workers to parse files on, null to parse on the calling thread
+	bool compressed = false; ///< Keep geometry quantized, see MeshGeometry::compress
+	int64_t residentBytes = 0; ///< Above 0 meshes are paged in clusters keeping at most this many bytes in memory, see ClusteredGeometry
+};
+
+/// Vertices and faces of a mesh file, shared by every TriangleMesh made from the file through MeshCache
+///	Accelerators are built over the geometry, so meshes that differ only in material share them too
+struct MeshGeometry : PrimitiveList {
+	struct Triangle {
 		int indices[3];
-		TriangleMesh *owner = nullptr;
+	};
+	/// Position quantized to 16 bits per axis in the box of the mesh
+	struct QuantizedVertex {
+		uint16_t x, y, z;
+	};
+	/// Face of a mesh with at most 2^16 vertices
+	struct ShortTriangle {
+		uint16_t indices[3];
+	};
+	/// First index of a face and offsets of the other two from it, faces in strips and fans reference nearby vertices
+	struct DeltaTriangle {
+		int32_t first;
+		int16_t deltas[2];
+	};
+	enum class FaceEncoding : uint8_t {
+		Full, Short, Delta
+	};
+
+	MappedFile binary; ///< Binary mesh file the arrays point into, when loaded from one
+	MeshArray<vec3> vertices; ///< Empty when compressed
+	MeshArray<Triangle> faces; ///< Empty when compressed, unless faces can't be encoded smaller
+	BBox box;
 
-		Triangle(int v1, int v2, int v3, TriangleMesh *owner)
-			: indices{v1, v2, v3}, owner(owner)
-		{}
+	/// Accelerator over the geometry, made once for all meshes rendered with the same settings
+	struct SharedAccelerator {
+		AcceleratorPtr accelerator;
+		std::once_flag built; ///< Guards the build, so workers hitting an unbuilt mesh together build it once
+		std::atomic<bool> ready{false}; ///< Set after the build, checked first so built accelerators skip call_once
+		std::atomic<int64_t> byteCount{0}; ///< Memory taken by the built accelerator
+		std::atomic<bool> unsaved{false}; ///< Built instead of loaded and not written to the binary mesh file yet, see saveAccelerator
+		AcceleratorType type = AcceleratorType::Octtree;
+		NodeLayout nodeLayout = NodeLayout::Default;
+		bool hugePages = false;
+		int64_t rayBudget = 0; ///< Only compared for AcceleratorType::Auto, the other types don't depend on it
 
-		bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
-		bool boxIntersect(const BBox &box) override;
-		void expandBox(BBox& box) override;
+		/// Build info logged again by renders reusing the kept accelerator, see acceleratorFor
+		AcceleratorType builtType = AcceleratorType::Octtree;
+		uint32_t nodeCount = 0;
+		std::atomic<size_t> loggedRender{0}; ///< RenderLog::RenderCount of the last render that logged it
 	};
-	AcceleratorPtr accelerator;
-	std::vector<vec3> vertices;
-	std::vector<Triangle> faces;
-	std::unique_ptr<Material> material;
+	typedef std::shared_ptr<SharedAccelerator> SharedAcceleratorPtr;
+
+	/// @brief Load mesh file picking the format by extension, BINARY_MESH_EXTENSION, PLY or OBJ
+	bool load(const std::string &path, ThreadManager *threads = nullptr);
+
+	/// @brief Load vertex positions and faces of an OBJ file, polygons are split in triangle fans
+	///	       The file is mapped and split in chunks of lines parsed in parallel
+	///	       The mesh is reordered and converted to a binary mesh file next to it, later loads use that while the OBJ is unchanged
+	bool loadFromObj(const std::string &objPath, ThreadManager *threads = nullptr);
+
+	/// @brief Use @vertexCount vertices and @faceCount faces in @bounds at the given memory without copying, it must outlive the geometry
+	void view(const vec3 *vertexData, int vertexCount, const Triangle *faceData, int faceCount, const BBox &bounds);
+
+	/// @brief Sort faces along a Morton curve through their centroids and number vertices in order of first use
+	///	       Faces close in space, which accelerators put in the same leaves, then read vertices close in memory
+	void reorder(ThreadManager *threads = nullptr);
+
+	/// @brief Load vertex positions and faces of a binary little endian PLY file, polygons are split in triangle fans
+	///	       The file is mapped, vertices are copied in one block when they hold only float positions, faces are decoded in parallel
+	///	       Converted to a binary mesh file next to it like OBJ files
+	bool loadFromPly(const std::string &plyPath, ThreadManager *threads = nullptr);
+
+	/// @brief Map binary mesh file written by saveBinary, the arrays point into the mapping without copying
+	/// @param source - the file the binary was converted from, the binary is rejected if it changed since, null to skip the check
+	bool loadFromBinary(const std::string &path, const std::string *source = nullptr);
+
+	/// @brief Write the mesh to @binaryPath, without accelerator
+	///	       Written to a temporary file first, so processes mapping the old file keep a valid view
+	bool saveBinary();
+
+	/// Extension of binary mesh files, converted meshes add it to the name of their source
+	static const char *const BINARY_MESH_EXTENSION;
+
+	/// @brief Get accelerator made with @settings, not built yet when it is new
+	///	       Accelerators are kept in the geometry and reused by later renders, except for ones with a memory budget
+	///	       or a progressive build, which belong to the render that made them
+	SharedAcceleratorPtr acceleratorFor(const AcceleratorSettings &settings);
+
+	/// @brief Build @shared if it is not yet built, safe to call from many threads
+	///	       Accelerator saved in the binary mesh file is used instead when its type matches
+	void buildAccelerator(SharedAccelerator &shared);
 
-	TriangleMesh(const std::string &objFile, std::unique_ptr<Material> material)
-		: material(std::move(material)) {
-		loadFromObj(objFile);
+	/// @brief Write @shared to the binary mesh file if it was built since, so later loads can skip the build
+	///	       Call before or between renders, lazy builds happen on render workers that should not wait for the disk
+	void saveAccelerator(SharedAccelerator &shared);
+
+	/// @return memory taken by the arrays, mapped or owned, and the kept accelerators
+	int64_t byteCount() const;
+
+	/// @brief Replace vertices with ones quantized to 16 bits per axis and faces with 16 bit indices, or 32 bit
+	///	       first index and 16 bit offsets, when all of them fit. Faces keep full indices otherwise.
+	///	       Intersection decodes the corners, positions move by at most half a step of 1/65535 of the box.
+	///	       Accelerators saved for the exact positions don't match, compressed geometry is not saved nor loaded from binaries.
+	void compress();
+
+	bool isCompressed() const {
+		return compressed;
 	}
 
-	void onBeforeRender(AcceleratorType acceleratorType) override;
-	bool loadFromObj(const std::string &objPath);
+	/// Simplified version of the geometry
+	struct Level {
+		std::shared_ptr<MeshGeometry> geometry;
+		float error; ///< Estimate of the distance the simplified surface is off by
+	};
+
+	/// Meshes with fewer faces are not simplified, rays spend little time in them anyway
+	static const int LOD_MIN_FACES = 1024;
+
+	/// @brief Make simplified versions of the geometry with quadric edge collapse, each with half the faces of the one before,
+	///	       down to about LOD_MIN_FACES / 2. Made once and kept with the geometry, later calls return right away.
+	void buildLevels();
+
+	/// @return simplified versions from finest to coarsest, empty until buildLevels is done
+	const std::vector<Level> &levels() const {
+		static const std::vector<Level> none;
+		return levelsBuilt ? simplified : none;
+	}
+
+	int vertexCount() const {
+		return vertexTotal;
+	}
+
+	int faceCount() const {
+		return faceTotal;
+	}
+
+	/// @brief Get the corners of face @index, decoded when compressed
+	void corners(int index, vec3 &A, vec3 &B, vec3 &C) const {
+		if (!compressed) {
+			const Triangle &face = faces[index];
+			A = vertices[face.indices[0]];
+			B = vertices[face.indices[1]];
+			C = vertices[face.indices[2]];
+			return;
+		}
+		int first, second, third;
+		cornerIndices(index, first, second, third);
+		A = decode(quantizedVertices[first]);
+		B = decode(quantizedVertices[second]);
+		C = decode(quantizedVertices[third]);
+	}
+
+	/// @brief Get the vertex indices of face @index, decoded when compressed
+	void cornerIndices(int index, int &first, int &second, int &third) const {
+		if (faceEncoding == FaceEncoding::Short) {
+			const ShortTriangle &face = shortFaces[index];
+			first = face.indices[0];
+			second = face.indices[1];
+			third = face.indices[2];
+		} else if (faceEncoding == FaceEncoding::Delta) {
+			const DeltaTriangle &face = deltaFaces[index];
+			first = face.first;
+			second = face.first + face.deltas[0];
+			third = face.first + face.deltas[1];
+		} else {
+			const Triangle &face = faces[index];
+			first = face.indices[0];
+			second = face.indices[1];
+			third = face.indices[2];
+		}
+	}
+
+	/// @brief Get vertex at @index, decoded when compressed
+	vec3 vertex(int index) const {
+		return compressed ? decode(quantizedVertices[index]) : vertices[index];
+	}
+
+	int primitiveCount() const override;
+	/// Sets no material, the mesh intersected sets its own
+	bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+	bool primitiveBoxIntersect(int index, const BBox &box) override;
+	void expandPrimitiveBox(int index, BBox &box) override;
+private:
+	vec3 decode(const QuantizedVertex &vertex) const {
+		return quantizedOrigin + vec3(float(vertex.x), float(vertex.y), float(vertex.z)) * quantizedStep;
+	}
+
+	/// @brief Take the arrays parsed from @source, reorder them and convert the source to a binary mesh file
+	void setConverted(const std::string &source, std::vector<vec3> &&parsedVertices, std::vector<Triangle> &&parsedFaces, ThreadManager *threads);
+
+	/// @param acceleratorData - saved accelerator of @acceleratorType to add, null for none
+	bool writeBinary(const std::vector<char> *acceleratorData, AcceleratorType acceleratorType);
+
+	std::string binaryPath; ///< Binary mesh file the mesh is loaded from or converted to, empty if there is none
+	std::string sourcePath; ///< File the binary was converted from, empty if the binary was loaded directly
+	const char *savedAccelerator = nullptr; ///< Accelerator section of the mapped binary, null if there is none
+	size_t savedAcceleratorSize = 0;
+	int savedAcceleratorType = -1;
+
+	int vertexTotal = 0;
+	int faceTotal = 0;
+
+	bool compressed = false;
+	FaceEncoding faceEncoding = FaceEncoding::Full;
+	vec3 quantizedOrigin = vec3(0.f);
+	vec3 quantizedStep = vec3(0.f); ///< Size of one quantization step on each axis
+	std::vector<QuantizedVertex> quantizedVertices;
+	std::vector<ShortTriangle> shortFaces;
+	std::vector<DeltaTriangle> deltaFaces;
+
+	mutable std::mutex acceleratorMutex;
+	std::vector<SharedAcceleratorPtr> accelerators; ///< Kept for later renders
+
+	std::once_flag levelsOnce;
+	std::atomic<bool> levelsBuilt{false};
+	std::vector<Level> simplified;
+};
+
+typedef std::shared_ptr<MeshGeometry> MeshGeometryPtr;
+
+/// Geometry of mesh files loaded by the process, kept after the meshes using it are gone so the next render reuses it
+///	Files are matched by path while their size and modification time are unchanged, and by content hash after that,
+///	so a touched or copied file is not parsed again. Geometry no mesh uses is evicted, least recently used first,
+///	when the total memory of the cache goes over its capacity.
+struct MeshCache {
+	static MeshCache &get();
+
+	/// @brief Get the geometry of the mesh file at @path, loading it if it is not in the cache
+	///	       Compressed and full geometry of a file are cached apart
+	/// @return geometry of the file, empty if it can't be loaded
+	MeshGeometryPtr acquire(const std::string &path, const MeshLoadSettings &settings = MeshLoadSettings());
+
+	/// @brief Set the memory unused geometry and its accelerators may keep, evicting as needed
+	void setCapacity(int64_t bytes);
+
+	static const int64_t DEFAULT_CAPACITY = int64_t(1) << 30;
+private:
+	/// Version of a file the geometry was loaded from
+	struct Source {
+		std::string path;
+		int64_t size;
+		int64_t time;
+	};
+	struct Entry {
+		MeshGeometryPtr geometry;
+		std::vector<Source> sources; ///< Every path and version with this content
+		uint64_t contentHash;
+		int64_t contentSize;
+		bool compressed;
+		uint64_t lastUse;
+	};
+
+	/// @brief Evict unused entries, least recently used first, until the cache fits in its capacity
+	void evict();
+
+	std::mutex mutex;
+	std::vector<Entry> entries;
+	int64_t capacity = DEFAULT_CAPACITY;
+	uint64_t useCounter = 0;
+};
+
+struct ClusteredGeometry;
+
+/// Loaded mesh file, either whole geometry from MeshCache or paged in clusters
+struct MeshAsset {
+	MeshGeometryPtr geometry;
+	std::shared_ptr<ClusteredGeometry> clustered;
+
+	/// @brief Load the mesh file at @path, paged in clusters when @settings has resident bytes
+	static MeshAsset load(const std::string &path, const MeshLoadSettings &settings);
+
+	/// @brief Build the accelerators TriangleMesh::onBeforeRender builds for @settings, meshes of the asset then find them done
+	///	       Simplified levels are made here too when @settings uses them
+	///	       Only accelerators MeshGeometry keeps are reused, see MeshGeometry::acceleratorFor
+	void prebuild(const AcceleratorSettings &settings);
+};
+
+/// Loads mesh files on its own threads while the scene is being made, many files at once
+///	Each request loads its file and then builds its accelerator right away, so reading and parsing one mesh overlaps
+///	with building the accelerators of others and with the rest of the scene being made. A loader thread is started
+///	per request waiting for one, up to threadCount. The workers in the load settings go to the first request that is
+///	free to use them, so a lone mesh still parses and builds in parallel, while many meshes mostly run one per thread.
+struct MeshLoader {
+	typedef std::shared_future<MeshAsset> Future;
+
+	/// @param threadCount - most files loaded at once, 0 for one per hardware thread
+	explicit MeshLoader(int threadCount = 0);
+	~MeshLoader();
+
+	MeshLoader(const MeshLoader &) = delete;
+	MeshLoader &operator=(const MeshLoader &) = delete;
+
+	/// @brief Start loading the mesh file at @path, requests for a file already requested share its future
+	///	       The future is ready once the file is loaded, its accelerator may still be building after that
+	///	       Workers in @settings are borrowed until wait returns, they must not run anything else until then
+	/// @param prebuild - settings to build the accelerator of the mesh with once loaded, null to leave it to onBeforeRender
+	Future request(const std::string &path, const MeshLoadSettings &settings, const AcceleratorSettings *prebuild = nullptr);
+
+	/// @brief Wait until every request is loaded and its accelerator built
+	void wait();
+
+	/// @brief Faces of every requested mesh, waits for the ones still loading
+	int64_t faceCount();
+private:
+	struct Job {
+		std::string path;
+		MeshLoadSettings settings;
+		bool prebuild;
+		AcceleratorSettings build;
+		std::shared_ptr<std::promise<MeshAsset>> loaded;
+	};
+	struct Request {
+		std::string path;
+		bool compressed;
+		int64_t residentBytes;
+		Future future;
+	};
+
+	void work();
+	void run(Job &job);
+
+	int threadCount;
+	std::vector<std::thread> workers; ///< Started as requests come in, one per request waiting for a thread
+	ThreadManager *pool = nullptr; ///< Borrowed from the load settings of the first request that has workers
+	std::mutex poolMutex; ///< Held by the request scheduling on the pool, ThreadManager is not re-entrant
+
+	std::mutex mutex; ///< Guards everything below
+	std::condition_variable wake; ///< Signaled for new jobs and on stop
+	std::condition_variable idle; ///< Signaled when a job is done
+	std::deque<Job> jobs;
+	std::vector<Request> requests;
+	int busy = 0;
+	bool stopping = false;
+};
+
+struct TriangleMesh : Primitive {
+	typedef MeshGeometry::Triangle Triangle;
+	MeshGeometryPtr geometry; ///< Null when paged in clusters
+	std::shared_ptr<ClusteredGeometry> clustered; ///< Set instead of geometry when MeshLoadSettings::residentBytes is
+	MeshGeometry::SharedAcceleratorPtr accelerator;
+	std::vector<MeshGeometry::SharedAcceleratorPtr> levelAccelerators; ///< One per simplified level, empty when levels are not used
+	PackedTriangles packed; ///< Faces of meshes too small for an accelerator, for brute force with SSE
+	std::unique_ptr<Material> material;
+
+	/// @brief Make mesh of the file at @path, geometry loaded before by the process is reused through MeshCache
+	TriangleMesh(const std::string &path, std::unique_ptr<Material> material, const MeshLoadSettings &settings = MeshLoadSettings());
+
+	/// @brief Make mesh of a loaded file, see MeshLoader
+	TriangleMesh(const MeshAsset &asset, std::unique_ptr<Material> material);
+
+	/// @return true if onBeforeRender builds an accelerator for @faceCount faces with @settings, false for brute force
+	static bool usesAccelerator(const AcceleratorSettings &settings, int faceCount);
+
+	int vertexCount() const;
+	int faceCount() const;
+
+	void onBeforeRender(const AcceleratorSettings &settings) override;
 
 	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
-	bool intersectTriangle(const Ray& ray, const Triangle &t, Intersection &info);
+	void intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) override;
+
+	int levelFor(float footprint, float dither) const override;
+	bool intersectLevel(int level, const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
 };
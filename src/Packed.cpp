@@ -0,0 +1,161 @@
+#include "Packed.h"
+
+#include <xmmintrin.h>
+
+namespace {
+
+/// Lane set in @hitMask with the smallest of @t, -1 when none is closer than @closest, which is updated otherwise
+int closestLane(int hitMask, const float t[4], float &closest) {
+	int best = -1;
+	for (int lane = 0; lane < 4; lane++) {
+		if ((hitMask & (1 << lane)) && t[lane] < closest) {
+			closest = t[lane];
+			best = lane;
+		}
+	}
+	return best;
+}
+
+}
+
+void PackedTriangles::clear() {
+	packets.clear();
+	triangleCount = 0;
+}
+
+void PackedTriangles::add(const vec3 &A, const vec3 &B, const vec3 &C) {
+	const int lane = triangleCount % WIDTH;
+	if (lane == 0) {
+		packets.push_back(Packet{}); // zero lanes are degenerate, never hit
+	}
+	Packet &packet = packets.back();
+	const vec3 AB = B - A;
+	const vec3 AC = C - A;
+	const vec3 N = cross(AB, AC);
+	packet.ax[lane] = A.x; packet.ay[lane] = A.y; packet.az[lane] = A.z;
+	packet.abx[lane] = AB.x; packet.aby[lane] = AB.y; packet.abz[lane] = AB.z;
+	packet.acx[lane] = AC.x; packet.acy[lane] = AC.y; packet.acz[lane] = AC.z;
+	packet.nx[lane] = N.x; packet.ny[lane] = N.y; packet.nz[lane] = N.z;
+	triangleCount++;
+}
+
+void PackedTriangles::endPacket() {
+	triangleCount = (triangleCount + WIDTH - 1) / WIDTH * WIDTH;
+}
+
+int PackedTriangles::intersect(const Ray &ray, float tMin, float &tMax, vec3 &normal, int firstPacket, int count) const {
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+	const __m128 epsilon = _mm_set1_ps(1e-12f);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 minT = _mm_set1_ps(tMin);
+
+	int hit = -1;
+	alignas(16) float t[WIDTH];
+	for (int p = firstPacket; p < firstPacket + count; p++) {
+		const Packet &packet = packets[p];
+		const __m128 nx = _mm_load_ps(packet.nx), ny = _mm_load_ps(packet.ny), nz = _mm_load_ps(packet.nz);
+
+		// Same operations in the same order as TriangleMesh::intersectPrimitive, so both agree on every hit
+		const __m128 dcr = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz)));
+		__m128 valid = _mm_cmpge_ps(dcr, zero); // facing the ray
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(_mm_and_ps(dcr, absMask), epsilon));
+		if (!_mm_movemask_ps(valid)) {
+			continue;
+		}
+		const __m128 rdcr = _mm_div_ps(one, dcr);
+
+		const __m128 hx = _mm_sub_ps(ox, _mm_load_ps(packet.ax));
+		const __m128 hy = _mm_sub_ps(oy, _mm_load_ps(packet.ay));
+		const __m128 hz = _mm_sub_ps(oz, _mm_load_ps(packet.az));
+		const __m128 gamma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, hx), _mm_mul_ps(ny, hy)), _mm_mul_ps(nz, hz)), rdcr);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(gamma, minT), _mm_cmple_ps(gamma, _mm_set1_ps(tMax))));
+
+		const __m128 hdx = _mm_sub_ps(_mm_mul_ps(hy, dz), _mm_mul_ps(hz, dy));
+		const __m128 hdy = _mm_sub_ps(_mm_mul_ps(hz, dx), _mm_mul_ps(hx, dz));
+		const __m128 hdz = _mm_sub_ps(_mm_mul_ps(hx, dy), _mm_mul_ps(hy, dx));
+		const __m128 lambda2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(hdx, _mm_load_ps(packet.acx)), _mm_mul_ps(hdy, _mm_load_ps(packet.acy))), _mm_mul_ps(hdz, _mm_load_ps(packet.acz))), rdcr);
+		const __m128 lambda3 = _mm_mul_ps(_mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_load_ps(packet.abx), hdx), _mm_mul_ps(_mm_load_ps(packet.aby), hdy)), _mm_mul_ps(_mm_load_ps(packet.abz), hdz))), rdcr);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(lambda2, zero), _mm_cmple_ps(lambda2, one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(lambda3, zero), _mm_cmple_ps(lambda3, one)));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(lambda2, lambda3), one));
+
+		const int hitMask = _mm_movemask_ps(valid);
+		if (!hitMask) {
+			continue;
+		}
+		_mm_store_ps(t, gamma);
+		const int lane = closestLane(hitMask, t, tMax);
+		if (lane >= 0) {
+			hit = p * WIDTH + lane;
+			normal = vec3(packet.nx[lane], packet.ny[lane], packet.nz[lane]).normalized();
+		}
+	}
+	return hit;
+}
+
+void PackedSpheres::clear() {
+	packets.clear();
+	sphereCount = 0;
+}
+
+void PackedSpheres::add(const vec3 &center, float radius) {
+	const int lane = sphereCount % WIDTH;
+	if (lane == 0) {
+		// negative squared radius, the discriminant of the padding lanes is always negative
+		packets.push_back(Packet{{0.f}, {0.f}, {0.f}, {-1.f, -1.f, -1.f, -1.f}});
+	}
+	Packet &packet = packets.back();
+	packet.cx[lane] = center.x;
+	packet.cy[lane] = center.y;
+	packet.cz[lane] = center.z;
+	packet.r2[lane] = radius * radius;
+	sphereCount++;
+}
+
+void PackedSpheres::endPacket() {
+	sphereCount = (sphereCount + WIDTH - 1) / WIDTH * WIDTH;
+}
+
+int PackedSpheres::intersect(const Ray &ray, float tMin, float &tMax, int firstPacket, int count) const {
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+	const float a = dot(ray.dir, ray.dir);
+	const __m128 fourA = _mm_set1_ps(4 * a), twoA = _mm_set1_ps(2.f * a);
+	const __m128 zero = _mm_setzero_ps(), two = _mm_set1_ps(2.f);
+	const __m128 minT = _mm_set1_ps(tMin);
+
+	int hit = -1;
+	alignas(16) float t[WIDTH];
+	for (int p = firstPacket; p < firstPacket + count; p++) {
+		const Packet &packet = packets[p];
+		// Same operations in the same order as SpherePrim::intersect
+		const __m128 ocx = _mm_sub_ps(ox, _mm_load_ps(packet.cx));
+		const __m128 ocy = _mm_sub_ps(oy, _mm_load_ps(packet.cy));
+		const __m128 ocz = _mm_sub_ps(oz, _mm_load_ps(packet.cz));
+		const __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz)));
+		const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_load_ps(packet.r2));
+		const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(fourA, c));
+		__m128 valid = _mm_cmpge_ps(discriminant, zero);
+		if (!_mm_movemask_ps(valid)) {
+			continue;
+		}
+		const __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+		const __m128 distance = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), root), twoA);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(distance, minT), _mm_cmple_ps(distance, _mm_set1_ps(tMax))));
+
+		const int hitMask = _mm_movemask_ps(valid);
+		if (!hitMask) {
+			continue;
+		}
+		_mm_store_ps(t, distance);
+		const int lane = closestLane(hitMask, t, tMax);
+		if (lane >= 0) {
+			hit = p * WIDTH + lane;
+		}
+	}
+	return hit;
+}
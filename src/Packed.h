@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Utils.hpp"
+
+#include <vector>
+
+/// Primitives of small lists stored 4 to a packet, so brute force intersection tests a whole packet with SSE at once
+///	Used below MIN_ACCELERATED_PRIMITIVES, where building an accelerator is not worth it
+
+/// Triangles with precomputed edges and normal, padding lanes are degenerate and never hit
+struct PackedTriangles {
+	static const int WIDTH = 4;
+
+	void clear();
+	void add(const vec3 &A, const vec3 &B, const vec3 &C);
+	/// @return lanes in use, including padding from endPacket
+	int count() const {
+		return triangleCount;
+	}
+
+	/// @brief Pad the last packet, so the next triangle starts a new one
+	void endPacket();
+	int packetCount() const {
+		return int(packets.size());
+	}
+
+	/// @return memory taken by @triangles added from the start of a packet
+	static int64_t byteCount(int triangles) {
+		return int64_t((triangles + WIDTH - 1) / WIDTH) * int64_t(sizeof(Packet));
+	}
+
+	/// @brief Find the closest triangle facing the ray in [tMin, tMax], same culling as TriangleMesh::intersectPrimitive
+	/// @param tMax [in/out] - set to the distance of the hit
+	/// @param normal [out] - unit normal of the hit triangle
+	/// @return index of the triangle in order of add, counting padding lanes, -1 if none is hit
+	int intersect(const Ray &ray, float tMin, float &tMax, vec3 &normal) const {
+		return intersect(ray, tMin, tMax, normal, 0, packetCount());
+	}
+
+	/// @brief Same as intersect, testing only the packets in [@firstPacket, @firstPacket + @count)
+	int intersect(const Ray &ray, float tMin, float &tMax, vec3 &normal, int firstPacket, int count) const;
+
+private:
+	struct alignas(16) Packet {
+		float ax[WIDTH], ay[WIDTH], az[WIDTH];
+		float abx[WIDTH], aby[WIDTH], abz[WIDTH];
+		float acx[WIDTH], acy[WIDTH], acz[WIDTH];
+		float nx[WIDTH], ny[WIDTH], nz[WIDTH]; ///< AB x AC, not normalized
+	};
+	std::vector<Packet> packets;
+	int triangleCount = 0;
+};
+
+/// Spheres by center and radius, padding lanes have no radius and are never hit
+struct PackedSpheres {
+	static const int WIDTH = 4;
+
+	void clear();
+	void add(const vec3 &center, float radius);
+	/// @return lanes in use, including padding from endPacket
+	int count() const {
+		return sphereCount;
+	}
+
+	/// @brief Pad the last packet, so the next sphere starts a new one
+	void endPacket();
+	int packetCount() const {
+		return int(packets.size());
+	}
+
+	/// @brief Find the closest sphere the ray enters in [tMin, tMax], same test as SpherePrim::intersect
+	/// @param tMax [in/out] - set to the distance of the hit
+	/// @return index of the sphere in order of add, counting padding lanes, -1 if none is hit
+	int intersect(const Ray &ray, float tMin, float &tMax) const {
+		return intersect(ray, tMin, tMax, 0, packetCount());
+	}
+
+	/// @brief Same as intersect, testing only the packets in [@firstPacket, @firstPacket + @count)
+	int intersect(const Ray &ray, float tMin, float &tMax, int firstPacket, int count) const;
+
+private:
+	struct alignas(16) Packet {
+		float cx[WIDTH], cy[WIDTH], cz[WIDTH];
+		float r2[WIDTH]; ///< squared radius
+	};
+	std::vector<Packet> packets;
+	int sphereCount = 0;
+};
@@ -1,4 +1,24 @@
 #include "Primitive.h"
+#include "Mesh.h"
+#include "Threading.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+/// Integer hash with good avalanche, source: https://nullprogram.com/blog/2018/07/31/
+static uint32_t hashInt(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+/// Map hash to float in [0, 1)
+static float hashToFloat(uint32_t hash) {
+	return float(hash >> 8) * (1.f / float(1 << 24));
+}
 
 SpherePrim::SpherePrim(vec3 center, float radius, MaterialPtr material): center(center), radius(radius), material(std::move(material)) {
 	box.add(center);
@@ -24,87 +44,1089 @@ bool SpherePrim::intersect(const Ray &ray, float tMin, float tMax, Intersection
 	return false;
 }
 
-bool Instancer::Instance::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
-	const Ray local = {
-		(ray.origin - offset) / scale,
-		ray.dir
+void Intersectable::intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	for (int c = 0; c < count; c++) {
+		if (intersect(rays[c], tMin, tMax[c], intersections[c])) {
+			tMax[c] = intersections[c].t;
+			hits[c] = true;
+		}
+	}
+}
+
+void IntersectionAccelerator::intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	for (int c = 0; c < count; c++) {
+		if (intersect(rays[c], tMin, tMax[c], intersections[c])) {
+			tMax[c] = intersections[c].t;
+			hits[c] = true;
+		}
+	}
+}
+
+Ray Instancer::localRay(int instance, const Ray &ray) const {
+	const uint32_t index = instanceTransforms[instance];
+	Ray local;
+	if (index & GENERAL_TRANSFORM) {
+		const Transform &toLocal = transforms[index & ~GENERAL_TRANSFORM];
+		local.origin = toLocal.point(ray.origin);
+		local.dir = toLocal.vector(ray.dir);
+	} else {
+		const Placement &placement = placements[index];
+		local.origin = ray.origin * placement.scale + placement.offset;
+		local.dir = ray.dir * placement.scale;
+	}
+	return local;
+}
+
+void Instancer::toWorldIntersection(int instance, const Ray &ray, Intersection &intersection) const {
+	const uint32_t index = instanceTransforms[instance];
+	intersection.p = ray.at(intersection.t);
+	if (index & GENERAL_TRANSFORM) {
+		intersection.normal = transforms[index & ~GENERAL_TRANSFORM].transposedVector(intersection.normal).normalized();
+	} else {
+		intersection.normal = (intersection.normal * placements[index].scale).normalized();
+	}
+	if (instanceMaterials[instance]) {
+		intersection.material = materials[instanceMaterials[instance]].get();
+	}
+}
+
+bool Instancer::isIdentity(int instance) const {
+	return toLocal(instance).isIdentity() && !instanceMaterials[instance];
+}
+
+Transform Instancer::toLocal(int instance) const {
+	const uint32_t index = instanceTransforms[instance];
+	if (index & GENERAL_TRANSFORM) {
+		return transforms[index & ~GENERAL_TRANSFORM];
+	}
+	const Placement &placement = placements[index];
+	Transform result = Transform::scaling(vec3(placement.scale));
+	for (int r = 0; r < 3; r++) {
+		result.m[r][3] = placement.offset[r];
+	}
+	return result;
+}
+
+/// Instances flattened into triangles in the space of the instancer, faces of each instance are a run of whole packets
+///	Runs are the primitives of the accelerator, so each leaf is still brute forced with SSE, without transforming the ray
+struct Instancer::BakedInstances : PrimitiveList {
+	struct Run {
+		BBox bounds;
+		int firstPacket;
+		int packetCount;
+		Material *material;
 	};
-	if (primitive->intersect(local, tMin, tMax, intersection)) {
-		if (material) {
-			intersection.material = material.get();
+	PackedTriangles triangles;
+	std::vector<Run> runs;
+	std::vector<int> instances; ///< Instance each run is baked from, -1 for runs of removed instances
+	AcceleratorPtr accelerator;
+
+	/// @brief Drop the run of a removed instance, its packets stay until the instances are baked again
+	void removeRun(int index) {
+		runs[index].packetCount = 0;
+		runs[index].bounds = BBox();
+		instances[index] = -1;
+	}
+
+	int primitiveCount() const override {
+		return int(runs.size());
+	}
+
+	bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
+		const Run &run = runs[index];
+		if (run.packetCount == 0 || !run.bounds.testIntersect(ray)) {
+			return false;
 		}
+		vec3 normal;
+		if (triangles.intersect(ray, tMin, tMax, normal, run.firstPacket, run.packetCount) == -1) {
+			return false;
+		}
+		intersection.t = tMax;
+		intersection.p = ray.at(tMax);
+		intersection.normal = normal;
+		intersection.material = run.material;
+		return true;
+	}
+
+	bool primitiveBoxIntersect(int index, const BBox &box) override {
+		return !box.boxIntersection(runs[index].bounds).isEmpty();
+	}
+
+	void expandPrimitiveBox(int index, BBox &box) override {
+		box.add(runs[index].bounds);
+	}
+};
+
+/// Memory a baked instance takes in the accelerator over the runs, on top of its packets
+const int64_t BAKED_RUN_BYTES = 96;
+
+// Costs of a ray reaching an instance relative to one ray triangle test, on the scale of the SAH costs trees are built with
+const float BAKE_NODE_COST = 0.125f; ///< Visiting a node of a tree, same as the BVH traversal cost
+const float BAKE_TRANSFORM_COST = 1.f; ///< Moving the ray to the space of the instance, the prototype call and moving the hit back
+const float BAKE_PACKET_COST = 1.5f; ///< Testing one packet of PackedTriangles::WIDTH faces
+const int BAKE_LEAF_FACES = 4; ///< Faces tested in a leaf of the tree of a prototype
+
+/// @brief Cost of a ray against @faces faces baked as one run, the run is a leaf brute forced packet by packet
+static float bakedRunCost(int faces) {
+	return BAKE_PACKET_COST * float((faces + PackedTriangles::WIDTH - 1) / PackedTriangles::WIDTH);
+}
+
+/// @brief Cost of a ray against the instance of a mesh with @faces faces, through its transform and the mesh's own tree or packets
+static float instanceCost(const AcceleratorSettings &settings, int faces) {
+	if (!TriangleMesh::usesAccelerator(settings, faces)) {
+		return BAKE_TRANSFORM_COST + bakedRunCost(faces);
+	}
+	// One path down a balanced tree, each level tests both children
+	const float depth = std::log2(std::max(float(faces) / BAKE_LEAF_FACES, 1.f));
+	return BAKE_TRANSFORM_COST + 2.f * BAKE_NODE_COST * depth + float(BAKE_LEAF_FACES);
+}
+
+int Instancer::primitiveCount() const {
+	return baked ? int(listedInstances.size()) : instanceCount();
+}
+
+bool Instancer::intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	index = listedInstance(index);
+	const Ray local = localRay(index, ray);
+	const int level = instanceLevels.empty() ? 0 : instanceLevels[index];
+	if (prototypes[instancePrototypes[index]]->intersectLevel(level, local, tMin, tMax, intersection)) {
+		toWorldIntersection(index, ray, intersection);
 		return true;
 	}
 	return false;
 }
 
-bool Instancer::Instance::boxIntersect(const BBox &other) {
-	const BBox transformed {
-		primitive->box.min * scale + offset,
-		primitive->box.max * scale + offset
-	};
-	return !other.boxIntersection(transformed).isEmpty();
+bool Instancer::primitiveBoxIntersect(int index, const BBox &other) {
+	return !other.boxIntersection(instanceBounds[listedInstance(index)]).isEmpty();
 }
 
-void Instancer::Instance::expandBox(BBox &other) {
-	const BBox transformed {
-		primitive->box.min * scale + offset,
-		primitive->box.max * scale + offset
-	};
-	other.add(transformed);
+void Instancer::expandPrimitiveBox(int index, BBox &other) {
+	other.add(instanceBounds[listedInstance(index)]);
+}
+
+void Instancer::intersectPrimitiveBatch(int index, const Ray *rays, const int *rayIndices, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	if (count == 1) {
+		// Nothing to interleave, skip moving the ray through the chunk buffers
+		PrimitiveList::intersectPrimitiveBatch(index, rays, rayIndices, count, tMin, tMax, intersections, hits);
+		return;
+	}
+	intersectInstanceBatch(listedInstance(index), rays, rayIndices, count, tMin, tMax, intersections, hits);
+}
+
+void Instancer::intersectInstanceBatch(int instance, const Ray *rays, const int *rayIndices, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	Primitive *prototype = prototypes[instancePrototypes[instance]].get();
+	const int level = instanceLevels.empty() ? 0 : instanceLevels[instance];
+	Ray local[BATCH_CHUNK_RAYS];
+	float localMax[BATCH_CHUNK_RAYS];
+	Intersection localIntersections[BATCH_CHUNK_RAYS];
+	bool localHits[BATCH_CHUNK_RAYS]; // need to know which hits are new to transform them back
+	int localRays[BATCH_CHUNK_RAYS];
+	for (int start = 0; start < count; start += BATCH_CHUNK_RAYS) {
+		const int end = std::min(count, start + BATCH_CHUNK_RAYS);
+		// Rays missing the prototype are left out, as its own intersect would reject them first
+		int chunk = 0;
+		for (int c = start; c < end; c++) {
+			const int r = rayIndices ? rayIndices[c] : c;
+			local[chunk] = localRay(instance, rays[r]);
+			if (!prototype->box.testIntersect(local[chunk])) {
+				continue;
+			}
+			localMax[chunk] = tMax[r];
+			localHits[chunk] = false;
+			localRays[chunk++] = r;
+		}
+		if (chunk == 0) {
+			continue;
+		}
+		if (level == 0) {
+			prototype->intersectBatch(local, chunk, tMin, localMax, localIntersections, localHits);
+		} else {
+			for (int c = 0; c < chunk; c++) {
+				if (prototype->intersectLevel(level, local[c], tMin, localMax[c], localIntersections[c])) {
+					localMax[c] = localIntersections[c].t;
+					localHits[c] = true;
+				}
+			}
+		}
+		for (int c = 0; c < chunk; c++) {
+			if (localHits[c]) {
+				const int r = localRays[c];
+				intersections[r] = localIntersections[c];
+				toWorldIntersection(instance, rays[r], intersections[r]);
+				tMax[r] = localMax[c];
+				hits[r] = true;
+			}
+		}
+	}
 }
 
-void Instancer::onBeforeRender(AcceleratorType acceleratorType) {
-	for (int c = 0; c < instances.size(); c++) {
-		instances[c].primitive->onBeforeRender(acceleratorType);
+void Instancer::onBeforeRender(const AcceleratorSettings &settings) {
+	// Prototypes only placed as they are, like the meshes of the scene, are seen at full detail and get no levels
+	std::vector<bool> moved(prototypes.size(), false);
+	if (settings.lod.pixelAngle > 0.f) {
+		for (int c = 0; c < instanceCount(); c++) {
+			moved[instancePrototypes[c]] = moved[instancePrototypes[c]] || !toLocal(c).isIdentity();
+		}
 	}
-	if (instances.size() < 50) {
+	AcceleratorSettings prototypeSettings = settings;
+	for (int c = 0; c < prototypes.size(); c++) {
+		prototypeSettings.lod.instanced = moved[c];
+		prototypes[c]->onBeforeRender(prototypeSettings);
+	}
+	refitInstances();
+	pickLevels(settings.lod);
+	if (settings.type != AcceleratorType::Auto && instanceCount() < MIN_ACCELERATED_PRIMITIVES) {
+		if (baked) {
+			unbakeInstances(); // removed down to a list that is tested one by one, packing needs every instance listed
+		}
+		packInstances();
 		return;
 	}
 
+	// Every ray goes through the instance level, so it is always built before rendering
+	AcceleratorSettings instanceSettings = settings;
+	instanceSettings.buildMode = BuildMode::Eager;
+	acceleratorSettings = instanceSettings;
 	if (!accelerator) {
-		accelerator = makeAccelerator(acceleratorType);
+		if (!baked) {
+			bakeInstances(instanceSettings);
+		}
+		// Also made for instances added after all the others were baked
+		if (primitiveCount() > 0) {
+			accelerator = makeAccelerator(instanceSettings);
+		}
 	}
-	if (!accelerator->isBuilt()) {
+	if (accelerator && !accelerator->isBuilt()) {
 		accelerator->clear();
-		for (int c = 0; c < instances.size(); c++) {
-			accelerator->addPrimitive(&instances[c]);
+		accelerator->setPrimitives(this);
+		accelerator->build(IntersectionAccelerator::Purpose::Instances);
+	}
+}
+
+int Instancer::addInstance(SharedPrimPtr prim, const vec3& offset, float scale, SharedMaterialPtr material) {
+	return addInstance(std::move(prim), Transform::translation(offset) * Transform::scaling(vec3(scale)), std::move(material));
+}
+
+int Instancer::addInstance(SharedPrimPtr prim, const Transform &transform, SharedMaterialPtr material) {
+	if (material && !materialIndices.count(material.get()) && materials.size() > UINT16_MAX) {
+		printf("Can't add instance, more than %d material overrides in one instancer\n", int(UINT16_MAX));
+		return -1;
+	}
+	const BBox bounds = transform.box(prim->box);
+	box.add(bounds);
+	instanceBounds.push_back(bounds);
+
+	auto prototype = prototypeIndices.find(prim.get());
+	if (prototype == prototypeIndices.end()) {
+		prototype = prototypeIndices.emplace(prim.get(), uint32_t(prototypes.size())).first;
+		prototypeBoxes.push_back(prim->box);
+		prototypes.push_back(std::move(prim));
+	}
+	instancePrototypes.push_back(prototype->second);
+
+	// Inverted before picking the table, so rays through either are transformed the same
+	const Transform toLocal = transform.inverted();
+	const float scale = toLocal.m[0][0];
+	bool placement = toLocal.m[1][1] == scale && toLocal.m[2][2] == scale;
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++) {
+			placement = placement && (r == c || toLocal.m[r][c] == 0.f);
+		}
+	}
+	if (placement) {
+		instanceTransforms.push_back(placements.acquire({ vec3(toLocal.m[0][3], toLocal.m[1][3], toLocal.m[2][3]), scale }));
+	} else {
+		instanceTransforms.push_back(transforms.acquire(toLocal) | GENERAL_TRANSFORM);
+	}
+
+	uint16_t materialIndex = 0;
+	if (material) {
+		auto found = materialIndices.find(material.get());
+		if (found == materialIndices.end()) {
+			found = materialIndices.emplace(material.get(), uint16_t(materials.size())).first;
+			materials.push_back(std::move(material));
+		}
+		materialIndex = found->second;
+	}
+	instanceMaterials.push_back(materialIndex);
+	if (!instanceLevels.empty()) {
+		instanceLevels.push_back(0); // full detail until levels are picked again
+	}
+
+	const int instance = instanceCount() - 1;
+	if (baked) {
+		// Listed after the baked ones, it is baked with them when the instances are baked again
+		bakedSlots.push_back(int(listedInstances.size()));
+		listedInstances.push_back(instance);
+		updateAccelerator(bakedSlots.back(), true);
+	} else {
+		updateAccelerator(instance, true);
+	}
+	return instance;
+}
+
+void Instancer::removeInstance(int instance) {
+	const int last = instanceCount() - 1;
+	assert(instance >= 0 && instance <= last);
+	if (baked) {
+		unlistInstance(instance);
+	} else {
+		updateAccelerator(instance, false);
+	}
+	// Only instances touching the box can shrink it, the rest are removed without going over all instances
+	const BBox removed = instanceBounds[instance];
+	bool onEdge = false;
+	for (int c = 0; c < 3; c++) {
+		onEdge = onEdge || removed.min[c] <= box.min[c] || removed.max[c] >= box.max[c];
+	}
+	const uint32_t transform = instanceTransforms[instance];
+	if (transform & GENERAL_TRANSFORM) {
+		transforms.release(transform & ~GENERAL_TRANSFORM);
+	} else {
+		placements.release(transform);
+	}
+	if (instance != last) {
+		if (baked) {
+			// The moved instance keeps its run or slot in the list, so neither accelerator changes
+			const int slot = bakedSlots[last];
+			if (slot >= 0) {
+				listedInstances[slot] = instance;
+			} else {
+				baked->instances[-1 - slot] = instance;
+			}
+			bakedSlots[instance] = slot;
+		} else {
+			updateAccelerator(last, false);
+		}
+		instanceTransforms[instance] = instanceTransforms[last];
+		instancePrototypes[instance] = instancePrototypes[last];
+		instanceMaterials[instance] = instanceMaterials[last];
+		instanceBounds[instance] = instanceBounds[last];
+		if (!instanceLevels.empty()) {
+			instanceLevels[instance] = instanceLevels[last];
+		}
+	}
+	instancePrototypes.pop_back();
+	instanceTransforms.pop_back();
+	instanceMaterials.pop_back();
+	instanceBounds.pop_back();
+	if (!instanceLevels.empty()) {
+		instanceLevels.pop_back();
+	}
+	if (baked) {
+		bakedSlots.pop_back();
+	} else if (instance != last) {
+		updateAccelerator(instance, true);
+	}
+	if (onEdge) {
+		fitBox();
+	}
+}
+
+void Instancer::refitInstances() {
+	std::vector<bool> changed(prototypes.size(), false);
+	bool anyChanged = false;
+	for (int c = 0; c < int(prototypes.size()); c++) {
+		if (memcmp(&prototypes[c]->box, &prototypeBoxes[c], sizeof(BBox)) != 0) {
+			prototypeBoxes[c] = prototypes[c]->box;
+			changed[c] = true;
+			anyChanged = true;
+		}
+	}
+	if (!anyChanged) {
+		return;
+	}
+	for (int c = 0; c < instanceCount(); c++) {
+		if (!changed[instancePrototypes[c]]) {
+			continue;
+		}
+		instanceBounds[c] = toLocal(c).inverted().box(prototypeBoxes[instancePrototypes[c]]);
+		// Baked faces don't follow their prototype, only mesh prototypes with a fixed box are baked
+		const int index = baked ? bakedSlots[c] : c;
+		if (index >= 0) {
+			updateAccelerator(index, false);
+			updateAccelerator(index, true);
 		}
+	}
+	fitBox();
+}
+
+void Instancer::fitBox() {
+	box = BBox();
+	for (const BBox &bounds : instanceBounds) {
+		box.add(bounds);
+	}
+}
+
+void Instancer::unlistInstance(int instance) {
+	const int slot = bakedSlots[instance];
+	if (slot < 0) {
+		baked->removeRun(-1 - slot);
+		return;
+	}
+	const int lastSlot = int(listedInstances.size()) - 1;
+	updateAccelerator(slot, false);
+	if (slot != lastSlot) {
+		updateAccelerator(lastSlot, false);
+		listedInstances[slot] = listedInstances[lastSlot];
+		bakedSlots[listedInstances[slot]] = slot;
+	}
+	listedInstances.pop_back();
+	if (slot != lastSlot) {
+		updateAccelerator(slot, true);
+	}
+}
+
+void Instancer::packInstances() {
+	packedSpheres.clear();
+	packedInstances.clear();
+	unpackedInstances.clear();
+	for (int c = 0; c < instanceCount(); c++) {
+		const SpherePrim *sphere = dynamic_cast<const SpherePrim *>(prototypes[instancePrototypes[c]].get());
+		if (sphere && isIdentity(c)) {
+			packedSpheres.add(sphere->center, sphere->radius);
+			packedInstances.push_back(c);
+		} else {
+			unpackedInstances.push_back(c);
+		}
+	}
+	packed = true;
+}
+
+void Instancer::pickLevels(const LodSettings &lod) {
+	instanceLevels.clear();
+	if (lod.pixelAngle <= 0.f) {
+		return;
+	}
+	bool simplified = false;
+	instanceLevels.resize(instanceCount());
+	for (int c = 0; c < instanceCount(); c++) {
+		// Units of the prototype per unit of the instancer, the least stretched axis keeps the most detail
+		const Transform local = toLocal(c);
+		const float stretch = std::min({ local.vector(vec3(1, 0, 0)).length(), local.vector(vec3(0, 1, 0)).length(), local.vector(vec3(0, 0, 1)).length() });
+		const float footprint = lod.pixelAngle * lod.pixelError * instanceBounds[c].distance(lod.eye) * stretch;
+		const float dither = lod.blend ? hashToFloat(hashInt(uint32_t(c))) : 1.f;
+		const int level = prototypes[instancePrototypes[c]]->levelFor(footprint, dither);
+		instanceLevels[c] = uint8_t(std::min(level, int(UINT8_MAX)));
+		simplified = simplified || level > 0;
+	}
+	if (!simplified) {
+		instanceLevels.clear();
+	}
+}
+
+void Instancer::bakeInstances(const AcceleratorSettings &settings) {
+	if (settings.bakeBytes <= 0) {
+		return;
+	}
+	std::vector<int> prototypeInstances(prototypes.size(), 0);
+	for (int c = 0; c < instanceCount(); c++) {
+		prototypeInstances[instancePrototypes[c]]++;
+	}
+	// A prototype is worth baking when a flat run costs a ray less than the transform and the prototype's own traversal
+	struct Candidate {
+		float savedPerByte;
+		int64_t bytes;
+		int prototype;
+	};
+	std::vector<Candidate> candidates;
+	for (int c = 0; c < int(prototypes.size()); c++) {
+		const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(prototypes[c].get());
+		if (!mesh || !mesh->geometry || prototypeInstances[c] == 0) {
+			continue;
+		}
+		const int faces = mesh->faceCount();
+		const float saved = instanceCost(settings, faces) - bakedRunCost(faces);
+		if (saved <= 0.f) {
+			continue;
+		}
+		const int64_t bytes = prototypeInstances[c] * (PackedTriangles::byteCount(faces) + BAKED_RUN_BYTES);
+		candidates.push_back({ saved * prototypeInstances[c] / float(bytes), bytes, c });
+	}
+	// Most cost saved per byte first, prototypes that don't fit what is left are skipped for smaller ones after them
+	std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+		return a.savedPerByte > b.savedPerByte;
+	});
+	std::vector<char> bakedPrototype(prototypes.size(), 0);
+	int64_t bytes = 0;
+	bool any = false;
+	for (const Candidate &candidate : candidates) {
+		if (bytes + candidate.bytes > settings.bakeBytes) {
+			continue;
+		}
+		bytes += candidate.bytes;
+		bakedPrototype[candidate.prototype] = 1;
+		any = true;
+	}
+	if (!any) {
+		return;
+	}
+
+	Timer timer;
+	baked = std::make_shared<BakedInstances>();
+	listedInstances.clear();
+	bakedSlots.resize(instanceCount());
+	for (int c = 0; c < instanceCount(); c++) {
+		if (!bakedPrototype[instancePrototypes[c]]) {
+			bakedSlots[c] = int(listedInstances.size());
+			listedInstances.push_back(c);
+			continue;
+		}
+		bakedSlots[c] = -1 - int(baked->runs.size());
+		const TriangleMesh &mesh = static_cast<const TriangleMesh &>(*prototypes[instancePrototypes[c]]);
+		const MeshGeometry &geometry = *mesh.geometry;
+		const Transform toWorld = toLocal(c).inverted();
+		// Mirroring turns faces around, swapped corners keep them facing the same side as through the instance
+		const vec3 axisX = toWorld.vector(vec3(1, 0, 0)), axisY = toWorld.vector(vec3(0, 1, 0)), axisZ = toWorld.vector(vec3(0, 0, 1));
+		const bool mirrored = dot(cross(axisX, axisY), axisZ) < 0.f;
+
+		BakedInstances::Run run;
+		run.firstPacket = baked->triangles.packetCount();
+		run.material = instanceMaterials[c] ? materials[instanceMaterials[c]].get() : mesh.material.get();
+		for (int r = 0; r < geometry.faceCount(); r++) {
+			vec3 A, B, C;
+			geometry.corners(r, A, B, C);
+			A = toWorld.point(A);
+			B = toWorld.point(B);
+			C = toWorld.point(C);
+			if (mirrored) {
+				std::swap(B, C);
+			}
+			baked->triangles.add(A, B, C);
+			run.bounds.add(A);
+			run.bounds.add(B);
+			run.bounds.add(C);
+		}
+		baked->triangles.endPacket();
+		run.packetCount = baked->triangles.packetCount() - run.firstPacket;
+		baked->runs.push_back(run);
+		baked->instances.push_back(c);
+	}
+
+	baked->accelerator = makeAccelerator(settings);
+	baked->accelerator->setPrimitives(baked.get());
+	baked->accelerator->build(IntersectionAccelerator::Purpose::Instances);
+	printf("Baked %d instances into %d triangles, %d instances left, in %lldms\n", int(baked->instances.size()), baked->triangles.count(),
+		int(listedInstances.size()), (long long)timer.toMs(timer.elapsedNs()));
+}
+
+void Instancer::unbakeInstances() {
+	baked.reset();
+	listedInstances.clear();
+	bakedSlots.clear();
+	accelerator.reset(); // it lists the instances that were not baked, made again on next onBeforeRender
+}
+
+void Instancer::updateAccelerator(int index, bool inserted) {
+	packed = false; // repacked on next onBeforeRender
+	if (!accelerator || !accelerator->isBuilt()) {
+		return; // built on next onBeforeRender
+	}
+	const bool updated = inserted ? accelerator->insert(index) : accelerator->remove(index);
+	if (!updated) {
+		// Built from the current list which already has added instances, but still has removed ones
+		AcceleratorSettings dynamicSettings = acceleratorSettings;
+		dynamicSettings.type = AcceleratorType::DynamicBVH;
+		accelerator = makeAccelerator(dynamicSettings);
+		accelerator->setPrimitives(this);
 		accelerator->build(IntersectionAccelerator::Purpose::Instances);
+		if (!inserted) {
+			accelerator->remove(index);
+		}
 	}
 }
 
-void Instancer::addInstance(SharedPrimPtr prim, const vec3& offset, float scale, SharedMaterialPtr material) {
-	BBox primBox;
-	primBox.min = (prim->box.min * scale) + offset;
-	primBox.max = (prim->box.max * scale) + offset;
-	box.add(primBox);
-	Instance instance;
-	instance.primitive = std::move(prim);
-	instance.offset = offset;
-	instance.scale = scale;
-	instance.material = material;
-	instances.push_back(instance);
+bool Instancer::frustumCull(const Frustum &frustum, std::vector<PrimitiveRef> &visible) {
+	if (!frustum.testBox(box)) {
+		return true;
+	}
+
+	std::vector<int> candidates;
+	if (accelerator && accelerator->isBuilt()) {
+		accelerator->frustumCull(frustum, candidates);
+		// some accelerators reference the same primitive from many leaves
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	} else {
+		candidates.resize(primitiveCount());
+		for (int c = 0; c < candidates.size(); c++) {
+			candidates[c] = c;
+		}
+	}
+
+	if (baked) {
+		std::vector<int> runs;
+		baked->accelerator->frustumCull(frustum, runs);
+		std::sort(runs.begin(), runs.end());
+		runs.erase(std::unique(runs.begin(), runs.end()), runs.end());
+		for (const int run : runs) {
+			if (frustum.testBox(baked->runs[run].bounds)) {
+				visible.push_back({ baked.get(), run });
+			}
+		}
+	}
+
+	for (int c = 0; c < candidates.size(); c++) {
+		const int instance = listedInstance(candidates[c]);
+		if (!frustum.testBox(instanceBounds[instance])) {
+			continue;
+		}
+		if (isIdentity(instance) && prototypes[instancePrototypes[instance]]->frustumCull(frustum, visible)) {
+			continue;
+		}
+		visible.push_back({ this, candidates[c] });
+	}
+	return true;
 }
 
 bool Instancer::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
 	if (!box.testIntersect(ray)) {
 		return false;
 	}
+	if (baked) {
+		// Baked faces first, their closest hit shortens the ray for the instances left
+		bool hasHit = baked->accelerator->intersect(ray, tMin, tMax, intersection);
+		if (hasHit) {
+			tMax = intersection.t;
+		}
+		if (accelerator && accelerator->isBuilt() && accelerator->intersect(ray, tMin, tMax, intersection)) {
+			hasHit = true;
+		}
+		return hasHit;
+	}
 	if (accelerator && accelerator->isBuilt()) {
 		return accelerator->intersect(ray, tMin, tMax, intersection);
 	}
-	float closest = tMax;
 	bool hasHit = false;
-	for (int c = 0; c < instances.size(); c++) {
-		Intersection data;
-		if (instances[c].intersect(ray, tMin, tMax, data)) {
-			if (data.t < closest) {
-				intersection = data;
-				closest = data.t;
+	if (packed) {
+		float packedMax = tMax;
+		const int sphere = packedSpheres.intersect(ray, tMin, packedMax);
+		if (sphere != -1) {
+			// Identity instance, the prototype fills the intersection with its own distance, tested against the unnarrowed range
+			//	as the SSE and scalar tests may round differently
+			if (prototypes[instancePrototypes[packedInstances[sphere]]]->intersect(ray, tMin, tMax, intersection)) {
+				tMax = intersection.t;
 				hasHit = true;
 			}
 		}
+		for (int c = 0; c < unpackedInstances.size(); c++) {
+			if (intersectPrimitive(unpackedInstances[c], ray, tMin, tMax, intersection)) {
+				tMax = intersection.t;
+				hasHit = true;
+			}
+		}
+		return hasHit;
+	}
+	for (int c = 0; c < primitiveCount(); c++) {
+		if (intersectPrimitive(c, ray, tMin, tMax, intersection)) {
+			tMax = intersection.t;
+			hasHit = true;
+		}
+	}
+	return hasHit;
+}
+
+void Instancer::intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	// Same box test as intersect, chunks with rays missing the box pass on only the ones inside
+	Ray inside[BATCH_CHUNK_RAYS];
+	float insideMax[BATCH_CHUNK_RAYS];
+	Intersection insideIntersections[BATCH_CHUNK_RAYS];
+	bool insideHits[BATCH_CHUNK_RAYS];
+	int insideRays[BATCH_CHUNK_RAYS];
+	for (int start = 0; start < count; start += BATCH_CHUNK_RAYS) {
+		const int chunk = std::min(count - start, BATCH_CHUNK_RAYS);
+		int insideCount = 0;
+		for (int c = start; c < start + chunk; c++) {
+			if (box.testIntersect(rays[c])) {
+				insideRays[insideCount++] = c;
+			}
+		}
+		if (insideCount == chunk) {
+			intersectListedBatch(rays + start, chunk, tMin, tMax + start, intersections + start, hits + start);
+			continue;
+		}
+		for (int c = 0; c < insideCount; c++) {
+			inside[c] = rays[insideRays[c]];
+			insideMax[c] = tMax[insideRays[c]];
+			insideHits[c] = false;
+		}
+		intersectListedBatch(inside, insideCount, tMin, insideMax, insideIntersections, insideHits);
+		for (int c = 0; c < insideCount; c++) {
+			if (insideHits[c]) {
+				const int r = insideRays[c];
+				tMax[r] = insideMax[c];
+				intersections[r] = insideIntersections[c];
+				hits[r] = true;
+			}
+		}
+	}
+}
+
+void Instancer::intersectListedBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+	if (count == 0) {
+		return;
+	}
+	if (baked) {
+		baked->accelerator->intersectBatch(rays, count, tMin, tMax, intersections, hits);
+		if (accelerator && accelerator->isBuilt()) {
+			accelerator->intersectBatch(rays, count, tMin, tMax, intersections, hits);
+		}
+		return;
+	}
+	if (accelerator && accelerator->isBuilt()) {
+		accelerator->intersectBatch(rays, count, tMin, tMax, intersections, hits);
+		return;
+	}
+	for (int c = 0; c < primitiveCount(); c++) {
+		intersectInstanceBatch(c, rays, nullptr, count, tMin, tMax, intersections, hits);
+	}
+}
+
+bool intersectClosest(const std::vector<PrimitiveRef> &prims, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	bool hasHit = false;
+	for (int c = 0; c < prims.size(); c++) {
+		if (prims[c].intersect(ray, tMin, tMax, intersection)) {
+			tMax = intersection.t;
+			hasHit = true;
+		}
 	}
 	return hasHit;
 }
+
+InstanceGrid::InstanceGrid(SharedPrimPtr prototype, const vec3 &origin, const vec3 &spacing, int countX, int countY, int countZ,
+	float scale, std::vector<SharedMaterialPtr> materials, float jitter)
+	: prototype(std::move(prototype))
+	, materials(std::move(materials))
+	, origin(origin)
+	, spacing(spacing)
+	, counts{countX, countY, countZ}
+	, scale(scale)
+	, jitter(jitter) {
+	const BBox &prototypeBox = this->prototype->box;
+	vec3 farthest;
+	for (int c = 0; c < 3; c++) {
+		assert(spacing[c] > 0.f && counts[c] > 0);
+		// extent of a single instance around its lattice point
+		const float low = prototypeBox.min[c] * scale - jitter * spacing[c];
+		const float high = prototypeBox.max[c] * scale + jitter * spacing[c];
+		box.min[c] = origin[c] + low;
+		box.max[c] = origin[c] + (counts[c] - 1) * spacing[c] + high;
+
+		reach[c] = std::max(0, int(ceilf(std::max(-low, high) / spacing[c] - 0.5f)));
+		farthest[c] = std::max(-low, high);
+		cellBounds.min[c] = origin[c] - (reach[c] + 0.5f) * spacing[c];
+		cellBounds.max[c] = origin[c] + (counts[c] - 1 + reach[c] + 0.5f) * spacing[c];
+	}
+	prototypeRadius = farthest.length();
+}
+
+void InstanceGrid::onBeforeRender(const AcceleratorSettings &settings) {
+	AcceleratorSettings prototypeSettings = settings;
+	prototypeSettings.lod.instanced = true;
+	prototype->onBeforeRender(prototypeSettings);
+	lod = settings.lod;
+}
+
+int64_t InstanceGrid::instanceCount() const {
+	return int64_t(counts[0]) * counts[1] * counts[2];
+}
+
+bool InstanceGrid::intersectInstance(const int point[3], const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	const uint32_t hash = hashInt(point[0] + hashInt(point[1] + hashInt(point[2])));
+	vec3 position = origin + vec3(float(point[0]), float(point[1]), float(point[2])) * spacing;
+	if (jitter > 0.f) {
+		uint32_t axisHash = hash;
+		for (int c = 0; c < 3; c++) {
+			axisHash = hashInt(axisHash);
+			position[c] += (2.f * hashToFloat(axisHash) - 1.f) * jitter * spacing[c];
+		}
+	}
+
+	// direction is not normalized, so distances along the local ray match the ones along @ray
+	Ray local;
+	local.origin = (ray.origin - position) / scale;
+	local.dir = ray.dir / scale;
+	int level = 0;
+	if (lod.pixelAngle > 0.f) {
+		const float distance = std::max((lod.eye - position).length() - prototypeRadius, 0.f);
+		const float dither = lod.blend ? hashToFloat(hashInt(hash)) : 1.f;
+		level = prototype->levelFor(lod.pixelAngle * lod.pixelError * distance / scale, dither);
+	}
+	if (!prototype->intersectLevel(level, local, tMin, tMax, intersection)) {
+		return false;
+	}
+	intersection.p = ray.at(intersection.t);
+	if (!materials.empty()) {
+		intersection.material = materials[hash % materials.size()].get();
+	}
+	return true;
+}
+
+bool InstanceGrid::intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	float tEnter = 0.f, tLeave = tMax;
+	if (!cellBounds.intersectP(ray, tEnter, tLeave)) {
+		return false;
+	}
+	tEnter = std::max(tEnter, tMin);
+	if (tEnter > tLeave) {
+		return false;
+	}
+
+	// Walk the cells, cell coordinates include the reach border so the lattice point of a cell is cell - reach
+	int cell[3], step[3], end[3];
+	float tNext[3], tDelta[3];
+	const vec3 entry = ray.at(tEnter);
+	for (int c = 0; c < 3; c++) {
+		const int cellCount = counts[c] + 2 * reach[c];
+		cell[c] = std::min(std::max(int(floorf((entry[c] - cellBounds.min[c]) / spacing[c])), 0), cellCount - 1);
+		if (ray.dir[c] > 0.f) {
+			step[c] = 1;
+			end[c] = cellCount;
+			tNext[c] = (cellBounds.min[c] + (cell[c] + 1) * spacing[c] - ray.origin[c]) / ray.dir[c];
+			tDelta[c] = spacing[c] / ray.dir[c];
+		} else if (ray.dir[c] < 0.f) {
+			step[c] = -1;
+			end[c] = -1;
+			tNext[c] = (cellBounds.min[c] + cell[c] * spacing[c] - ray.origin[c]) / ray.dir[c];
+			tDelta[c] = -spacing[c] / ray.dir[c];
+		} else {
+			step[c] = 0;
+			end[c] = -1;
+			tNext[c] = FLT_MAX;
+			tDelta[c] = FLT_MAX;
+		}
+	}
+
+	bool hasHit = false;
+	while (true) {
+		// every instance that can extend into the current cell
+		int from[3], to[3];
+		for (int c = 0; c < 3; c++) {
+			from[c] = std::max(cell[c] - 2 * reach[c], 0);
+			to[c] = std::min(cell[c], counts[c] - 1);
+		}
+		int point[3];
+		for (point[2] = from[2]; point[2] <= to[2]; point[2]++) {
+			for (point[1] = from[1]; point[1] <= to[1]; point[1]++) {
+				for (point[0] = from[0]; point[0] <= to[0]; point[0]++) {
+					if (intersectInstance(point, ray, tMin, tMax, intersection)) {
+						tMax = intersection.t;
+						hasHit = true;
+					}
+				}
+			}
+		}
+
+		const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+		// nothing in the next cells can be closer than a hit inside the current one
+		if (tMax <= tNext[axis] || tNext[axis] > tLeave) {
+			break;
+		}
+		cell[axis] += step[axis];
+		if (cell[axis] == end[axis]) {
+			break;
+		}
+		tNext[axis] += tDelta[axis];
+	}
+	return hasHit;
+}
+
+int SphereSet::addMaterial(SharedMaterialPtr material) {
+	if (materials.size() > UINT16_MAX) {
+		printf("Can't add material, more than %d materials in one sphere set\n", int(UINT16_MAX));
+		return -1;
+	}
+	materials.push_back(std::move(material));
+	return int(materials.size()) - 1;
+}
+
+void SphereSet::addSphere(const vec3 &center, float radius, int material) {
+	if (material < 0 || material >= int(materials.size())) {
+		printf("Can't add sphere, material %d is not one of the %d in the sphere set\n", material, int(materials.size()));
+		return;
+	}
+	centerX.push_back(center.x);
+	centerY.push_back(center.y);
+	centerZ.push_back(center.z);
+	radii.push_back(radius);
+	sphereMaterials.push_back(material);
+	box.add(center - vec3(radius));
+	box.add(center + vec3(radius));
+	nodes.clear(); // rebuilt on next onBeforeRender
+}
+
+void SphereSet::onBeforeRender(const AcceleratorSettings &settings) {
+	if (!nodes.empty() || radii.empty()) {
+		return;
+	}
+	Timer timer;
+	const int count = sphereCount();
+	std::vector<BBox> sphereBounds(count);
+	parallelFor(settings.threads, count, [&](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			const vec3 center(centerX[c], centerY[c], centerZ[c]);
+			sphereBounds[c] = BBox{center - vec3(radii[c]), center + vec3(radii[c])};
+		}
+	});
+	std::vector<int> ids(count);
+	std::iota(ids.begin(), ids.end(), 0);
+
+	nodes.reserve(2 * (count / PackedSpheres::WIDTH + 1));
+	packed.clear();
+	packedSpheres.clear();
+	buildNode(ids.data(), count, sphereBounds, 0);
+	printf("Built sphere BVH with %d spheres, %d nodes in %lldms\n", count, int(nodes.size()), (long long)timer.toMs(timer.elapsedNs()));
+}
+
+void SphereSet::buildNode(int *ids, int count, const std::vector<BBox> &sphereBounds, int depth) {
+	const int index = int(nodes.size());
+	nodes.push_back({});
+
+	BBox bounds, centroidBounds;
+	for (int c = 0; c < count; c++) {
+		bounds.add(sphereBounds[ids[c]]);
+		centroidBounds.add(vec3(centerX[ids[c]], centerY[ids[c]], centerZ[ids[c]]));
+	}
+	nodes[index].bounds = bounds;
+
+	const int axis = centroidBounds.maxExtent();
+	const float axisMin = centroidBounds.min[axis];
+	const float extent = centroidBounds.max[axis] - axisMin;
+	if (count <= PackedSpheres::WIDTH || depth >= MAX_DEPTH || !(extent > 0.f)) {
+		// Coincident centers can't be split, such leaves take more than a packet
+		nodes[index].offset = packed.packetCount();
+		for (int c = 0; c < count; c++) {
+			packed.add(vec3(centerX[ids[c]], centerY[ids[c]], centerZ[ids[c]]), radii[ids[c]]);
+			packedSpheres.push_back(ids[c]);
+		}
+		packed.endPacket();
+		packedSpheres.resize(packed.count(), -1);
+		nodes[index].packetCount = packed.packetCount() - nodes[index].offset;
+		return;
+	}
+
+	const float *centers = axis == 0 ? centerX.data() : (axis == 1 ? centerY.data() : centerZ.data());
+	auto binOf = [&](int id) {
+		return std::min(int(BIN_COUNT * (centers[id] - axisMin) / extent), BIN_COUNT - 1);
+	};
+	int binCounts[BIN_COUNT] = {};
+	BBox binBounds[BIN_COUNT];
+	for (int c = 0; c < count; c++) {
+		const int bin = binOf(ids[c]);
+		binCounts[bin]++;
+		binBounds[bin].add(sphereBounds[ids[c]]);
+	}
+
+	// Sweep from the right for the cost of each right side, then from the left to pick the cheapest split
+	float rightCost[BIN_COUNT];
+	BBox right;
+	int rightCount = 0;
+	for (int c = BIN_COUNT - 1; c > 0; c--) {
+		right.add(binBounds[c]);
+		rightCount += binCounts[c];
+		rightCost[c] = rightCount ? rightCount * right.area() : 0.f;
+	}
+	int bestSplit = 1;
+	float bestCost = FLT_MAX;
+	BBox left;
+	int leftCount = 0;
+	for (int c = 1; c < BIN_COUNT; c++) {
+		left.add(binBounds[c - 1]);
+		leftCount += binCounts[c - 1];
+		if (leftCount == 0 || leftCount == count) {
+			continue;
+		}
+		const float cost = leftCount * left.area() + rightCost[c];
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = c;
+		}
+	}
+
+	const int *middle = std::partition(ids, ids + count, [&](int id) {
+		return binOf(id) < bestSplit;
+	});
+	const int leftSize = int(middle - ids);
+	buildNode(ids, leftSize, sphereBounds, depth + 1);
+	nodes[index].offset = int(nodes.size());
+	nodes[index].packetCount = 0;
+	buildNode(ids + leftSize, count - leftSize, sphereBounds, depth + 1);
+}
+
+/// Slab test of a ray against a box, only entries in [tMin, tMax] count
+///	@param entry [out] - distance the ray enters the box at
+static bool enterBounds(const BBox &bounds, const Ray &ray, const vec3 &invDir, float tMin, float tMax, float &entry) {
+	float t0 = tMin, t1 = tMax;
+	for (int i = 0; i < 3; i++) {
+		float tNear = (bounds.min[i] - ray.origin[i]) * invDir[i];
+		float tFar = (bounds.max[i] - ray.origin[i]) * invDir[i];
+		if (tNear > tFar) {
+			std::swap(tNear, tFar);
+		}
+		tFar *= 1 + 2 * bounds.gamma(3);
+		// written so that NaN from a zero direction component leaves the interval unchanged
+		t0 = tNear > t0 ? tNear : t0;
+		t1 = tFar < t1 ? tFar : t1;
+	}
+	entry = t0;
+	return t0 <= t1;
+}
+
+bool SphereSet::intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+	const vec3 invDir = ray.dir.inverted();
+	float entry;
+	if (nodes.empty() || !enterBounds(nodes[0].bounds, ray, invDir, tMin, tMax, entry)) {
+		return false;
+	}
+
+	// Far children waiting to be visited, with the distance the ray enters them at
+	int stack[MAX_DEPTH + 1];
+	float stackEntry[MAX_DEPTH + 1];
+	int stackSize = 0;
+	int current = 0;
+	int hit = -1;
+	while (true) {
+		const Node &node = nodes[current];
+		if (node.packetCount) {
+			const int lane = packed.intersect(ray, tMin, tMax, node.offset, node.packetCount);
+			if (lane != -1) {
+				hit = lane;
+			}
+		} else {
+			const int first = current + 1, second = node.offset;
+			float firstEntry, secondEntry;
+			const bool hitFirst = enterBounds(nodes[first].bounds, ray, invDir, tMin, tMax, firstEntry);
+			const bool hitSecond = enterBounds(nodes[second].bounds, ray, invDir, tMin, tMax, secondEntry);
+			if (hitFirst && hitSecond) {
+				const bool firstCloser = firstEntry <= secondEntry;
+				stack[stackSize] = firstCloser ? second : first;
+				stackEntry[stackSize++] = firstCloser ? secondEntry : firstEntry;
+				current = firstCloser ? first : second;
+				continue;
+			} else if (hitFirst || hitSecond) {
+				current = hitFirst ? first : second;
+				continue;
+			}
+		}
+
+		// skip children entered behind the closest hit found after they were pushed
+		while (stackSize && stackEntry[stackSize - 1] > tMax) {
+			stackSize--;
+		}
+		if (!stackSize) {
+			break;
+		}
+		current = stack[--stackSize];
+	}
+
+	if (hit == -1) {
+		return false;
+	}
+	const int sphere = packedSpheres[hit];
+	const vec3 center(centerX[sphere], centerY[sphere], centerZ[sphere]);
+	intersection.t = tMax;
+	intersection.p = ray.at(tMax);
+	intersection.normal = (intersection.p - center) / radii[sphere];
+	intersection.material = materials[sphereMaterials[sphere]].get();
+	return true;
+}
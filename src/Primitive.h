@@ -2,17 +2,105 @@
 
 #include "Utils.hpp"
 #include "Material.h"
+#include "Packed.h"
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <string_view>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+struct ThreadManager;
 
 enum class AcceleratorType
 {
 	Octtree,
 	BVH,
-	KDTree
+	KDTree,
+	DynamicBVH,
+	PLOCBVH, ///< BVH built bottom up by merging nearest neighbour clusters
+	Auto ///< Measure candidate accelerators and parameters for each primitive list and pick the cheapest
+};
+
+/// When acceleration structures are built relative to the start of rendering
+enum class BuildMode
+{
+	Eager, ///< Fully built before the first ray
+	Lazy, ///< Built on the first ray that reaches them, never built if not needed
+	Progressive ///< Fast coarse BVH is built before the first ray, a SAH BVH replaces it when built in background, whatever the requested type
+};
+
+/// Order of nodes in memory for accelerators that support more than one
+enum class NodeLayout
+{
+	Default, ///< Whatever the accelerator prefers
+	DepthFirst, ///< Parent, first subtree, second subtree
+	Treelets ///< Siblings share a cache line, subtrees a few levels deep share a page
+};
+
+/// Bytes all accelerators of a render may take together, shared by them through AcceleratorSettings::memory
+struct MemoryBudget {
+	std::atomic<int64_t> limit{0};
+	std::atomic<int64_t> used{0}; ///< Bytes taken by accelerators currently built
+	std::atomic<int64_t> expectedPrimitives{0}; ///< Primitives of the accelerators still to be built, 0 when not known
+
+	/// @return bytes the next build may take, 0 when the budget is spent
+	int64_t available() const {
+		return std::max<int64_t>(limit - used, 0);
+	}
+
+	/// @return bytes a build over @primitives may take, its part of what is left by its share of the expected primitives
+	///	        So the first accelerators built can't starve the ones after them
+	int64_t share(int64_t primitives) const {
+		const int64_t left = available();
+		const int64_t expected = expectedPrimitives;
+		if (expected <= primitives) {
+			return left;
+		}
+		return int64_t(double(left) * double(primitives) / double(expected));
+	}
+
+	/// @brief Called after a build over @primitives, so the ones still to come share what it left
+	void built(int64_t primitives) {
+		int64_t expected = expectedPrimitives;
+		while (!expectedPrimitives.compare_exchange_weak(expected, std::max<int64_t>(expected - primitives, 0))) {
+		}
+	}
+};
+
+/// How instances pick simplified versions of their prototypes, see Primitive::levelFor
+///	The level of an instance is picked once from its distance to the eye, so every ray, also ones bouncing off it, sees the same surface
+struct LodSettings {
+	vec3 eye = vec3(0.f); ///< Position the scene is seen from
+	float pixelAngle = 0.f; ///< Angle one pixel spans seen from @eye, 0 to always use full detail
+	float pixelError = 1.f; ///< Pixels a simplified surface may be off by
+	bool blend = false; ///< Instances between two levels take either at random, so the change of detail has no visible edge
+	bool instanced = false; ///< Set by instancers for prototypes they move or scale, only those get simplified levels
 };
 
+/// How acceleration structures for the scene are made, passed to Primitive::onBeforeRender
+struct AcceleratorSettings {
+	AcceleratorType type = AcceleratorType::BVH;
+	BuildMode buildMode = BuildMode::Eager;
+	int64_t rayBudget = 0; ///< Expected number of rays for the whole render, used by AcceleratorType::Auto to weigh build time
+	ThreadManager *threads = nullptr; ///< Idle workers that builds made before rendering can be parallelized on
+	ThreadManager *spareThreads = nullptr; ///< Workers the render doesn't use, BuildMode::Progressive refines on them while the others render
+	MemoryBudget *memory = nullptr; ///< Budget shared by every accelerator made with these settings, null for no limit
+	NodeLayout nodeLayout = NodeLayout::Default;
+	bool hugePages = false; ///< Back big trees with huge pages where the system allows it
+	int64_t bakeBytes = 0; ///< Memory each instancer may spend flattening instances of small meshes into one, 0 to keep all instances, see Instancer
+	LodSettings lod;
+};
+
+/// Primitive lists smaller than this are intersected without an accelerator, unless AcceleratorType::Auto decides otherwise
+///	Triangles and spheres of such lists are packed for SSE brute force, see Packed.h
+const int MIN_ACCELERATED_PRIMITIVES = 50;
+
+/// Rays a primitive passing a batch on keeps on the stack, bigger batches are passed on in chunks of this many
+const int BATCH_CHUNK_RAYS = 16;
+
 /// Data for an intersection between a ray and scene primitive
 struct Intersection {
 	float t = -1.f; ///< Position of the intersection along the ray
@@ -31,6 +119,15 @@ struct Intersectable {
 	/// @return true when intersection is found, false otherwise
 	virtual bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) = 0;
 
+	/// @brief Intersect many independent rays, default implementation intersects them one by one
+	/// @param rays - the rays
+	/// @param count - number of rays
+	/// @param tMin - near clip distance for all rays
+	/// @param tMax [in/out] - far clip distance for each ray, updated with the distance of found intersections
+	/// @param intersections [out] - data for each ray, written only when closer intersection is found
+	/// @param hits [out] - set to true for each ray a closer intersection is found for, left unchanged otherwise
+	virtual void intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits);
+
 	/// @brief Test intersection of the primitive with a box, used by IntersectionAccelerator
 	/// @param box - bounding box to test against
 	virtual bool boxIntersect(const BBox &box) = 0;
@@ -42,13 +139,58 @@ struct Intersectable {
 	virtual ~Intersectable() = default;
 };
 
+/// Interface for a list of primitives that are referenced only by their index
+///	Used for elements which are too many to be separate Intersectable objects, like triangles or instances
+struct PrimitiveList {
+	/// @brief Get the number of primitives in the list
+	virtual int primitiveCount() const = 0;
+
+	/// @brief Same as Intersectable::intersect for the primitive at @index
+	virtual bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) = 0;
+
+	/// @brief Same as Intersectable::boxIntersect for the primitive at @index
+	virtual bool primitiveBoxIntersect(int index, const BBox &box) = 0;
+
+	/// @brief Same as Intersectable::expandBox for the primitive at @index
+	virtual void expandPrimitiveBox(int index, BBox &box) = 0;
+
+	/// @return true when intersectPrimitiveBatch is cheaper than intersecting the rays one by one
+	///	        Accelerators then gather the rays of a batch that reach the same primitive and pass them on together
+	virtual bool batchesPrimitives() const {
+		return false;
+	}
+
+	/// @brief Same as Intersectable::intersectBatch for the primitive at @index, with the rays at @rayIndices of the arrays
+	virtual void intersectPrimitiveBatch(int index, const Ray *rays, const int *rayIndices, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) {
+		for (int c = 0; c < count; c++) {
+			const int r = rayIndices[c];
+			if (intersectPrimitive(index, rays[r], tMin, tMax[r], intersections[r])) {
+				tMax[r] = intersections[r].t;
+				hits[r] = true;
+			}
+		}
+	}
+
+	virtual ~PrimitiveList() = default;
+};
+
+/// Reference to a single element of a PrimitiveList
+struct PrimitiveRef {
+	PrimitiveList *list;
+	int index;
+
+	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) const {
+		return list->intersectPrimitive(index, ray, tMin, tMax, intersection);
+	}
+};
+
 /// Base class for scene object
 struct Primitive : Intersectable {
 	BBox box;
 
 	/// @brief Called after scene is fully created and before rendering starts
 	///	       Used to build acceleration structures
-	virtual void onBeforeRender(AcceleratorType acceleratorType) {}
+	virtual void onBeforeRender(const AcceleratorSettings &settings) {}
 
 	/// @brief Default implementation intersecting the bbox of the primitive, overriden if possible more efficiently
 	bool boxIntersect(const BBox& other) override {
@@ -60,6 +202,28 @@ struct Primitive : Intersectable {
 		other.add(box);
 	}
 
+	/// @brief Collect the parts of this primitive that could be hit by rays inside the frustum
+	/// @param frustum - the frustum to cull against
+	/// @param visible [out] - list to append the potentially visible parts to
+	/// @return false if the primitive can't be split in parts, then the caller must reference it as a whole
+	virtual bool frustumCull(const Frustum &frustum, std::vector<PrimitiveRef> &visible) {
+		return false;
+	}
+
+	/// @brief Pick the coarsest simplified version of the primitive that is off by at most @footprint
+	/// @param footprint - allowed error at the distance the primitive is seen from, in the space of the primitive
+	/// @param dither - in [0, 1], when the footprint is @dither of the way from a level to the next one the next one is picked,
+	///                 1 to never pick a level off by more than @footprint
+	/// @return level to pass to intersectLevel, 0 for the primitive itself
+	virtual int levelFor(float footprint, float dither) const {
+		return 0;
+	}
+
+	/// @brief Intersect the simplified version of the primitive at @level returned by levelFor
+	virtual bool intersectLevel(int level, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+		return intersect(ray, tMin, tMax, intersection);
+	}
+
 	~Primitive() override = default;
 };
 
@@ -74,9 +238,28 @@ struct IntersectionAccelerator {
 		Instances
 	};
 
-	/// @brief Add the primitive to the accelerated list
-	/// @param prim - non owning pointer
-	virtual void addPrimitive(Intersectable *prim) = 0;
+	/// Overrides for the build parameters, zero keeps the default the accelerator picks for the Purpose
+	struct BuildParameters {
+		static constexpr int64_t UNLIMITED = -1; ///< maxBytes of builds without memory limit
+
+		int maxDepth = 0;
+		int maxLeafPrimitives = 0; ///< Nodes with this many primitives or less are not split
+		float intersectionCost = 0.f; ///< Cost of intersecting a primitive relative to traversing a node, for SAH builds
+		int64_t maxBytes = UNLIMITED; ///< Memory the built tree should fit in, builders fall back to coarser trees to stay under it, 0 for the coarsest tree
+		NodeLayout layout = NodeLayout::Default;
+		bool hugePages = false;
+		bool quiet = false; ///< Print no progress, for builds of many small trees
+	};
+
+	/// @brief Set parameters used by the next build, accelerators ignore the ones they don't have
+	virtual void setParameters(const BuildParameters &parameters) {}
+
+	/// @brief Set workers to parallelize the next build on, build must then be called from the thread scheduling tasks on them
+	virtual void setThreadManager(ThreadManager *threads) {}
+
+	/// @brief Set the primitives to accelerate, all of them are referenced only by index
+	/// @param list - non owning pointer, must outlive the accelerator
+	virtual void setPrimitives(PrimitiveList *list) = 0;
 
 	/// @brief Clear all data allocated by the accelerator
 	virtual void clear() = 0;
@@ -88,15 +271,50 @@ struct IntersectionAccelerator {
 	/// @brief Check if the accelerator is built
 	virtual bool isBuilt() const = 0;
 
+	/// @brief Memory taken by the built structure, 0 when nothing is built
+	virtual int64_t byteCount() const { return 0; }
+
 	/// @brief Implement intersect from Intersectable but don't inherit the Interface
 	virtual bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) = 0;
 
+	/// @brief Collect indices of all primitives in nodes overlapping the frustum, may contain duplicates
+	/// @param frustum - the frustum to cull against
+	/// @param visible [out] - list to append the primitive indices to
+	virtual void frustumCull(const Frustum &frustum, std::vector<int> &visible) = 0;
+
+	/// @brief Same as Intersectable::intersectBatch, implementation can interleave the rays to hide memory latency
+	virtual void intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits);
+
+	/// @brief Add primitive at @index of the list to the built accelerator without rebuilding it
+	/// @return false if the accelerator can't be updated in place, then it must be rebuilt
+	virtual bool insert(int index) { return false; }
+
+	/// @brief Remove primitive at @index of the list from the built accelerator without rebuilding it
+	/// @return false if the accelerator can't be updated in place, then it must be rebuilt
+	virtual bool remove(int index) { return false; }
+
+	/// @brief Append the built structure to @data, so it can be used again by load for the same primitives
+	/// @return false if the accelerator can't be saved
+	virtual bool save(std::vector<char> &data) const { return false; }
+
+	/// @brief Use structure written by save instead of building, @data can be used in place and must outlive the accelerator
+	/// @return false if @data can't be used, then the accelerator must be built
+	virtual bool load(const char *data, size_t size) { return false; }
+
 	virtual ~IntersectionAccelerator() = default;
 };
 
 typedef std::unique_ptr<IntersectionAccelerator> AcceleratorPtr;
 AcceleratorPtr makeAccelerator(AcceleratorType acceleratorType);
 
+/// @brief Make accelerator of the type in @settings, wrapped so it follows the build mode
+///	       Progressive one is usable right after a fast coarse build, and switches to a SAH BVH once it is built on spare threads
+AcceleratorPtr makeAccelerator(const AcceleratorSettings &settings);
+
+/// @brief Find the closest intersection with a list of primitives, without any acceleration
+/// @return true when intersection is found, false otherwise
+bool intersectClosest(const std::vector<PrimitiveRef> &prims, const Ray &ray, float tMin, float tMax, Intersection &intersection);
+
 /// Simple smooth sphere primitive
 struct SpherePrim : Primitive {
 	vec3 center;
@@ -108,27 +326,272 @@ struct SpherePrim : Primitive {
 	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
 };
 
-/// Primitive that contains a list of other primitives along with offset and scale for each one
-///	Each primitive is tested on intersect call and intersected with its offset and scale
-struct Instancer : Primitive {
+/// Primitive that contains a list of other primitives along with affine transform for each one
+///	Each primitive is tested on intersect call and intersected with its transform
+///	Instances are stored in a table of small indices to shared prototypes, transforms and materials
+///	Instances of meshes with few faces can be baked, their faces copied in the space of the instancer under their own
+///	accelerator, so rays reach them without transforms and prototype calls, see AcceleratorSettings::bakeBytes
+struct Instancer : Primitive, PrimitiveList {
 private:
-	struct Instance : Intersectable {
-		SharedPrimPtr primitive;
+	struct BakedInstances;
+
+	/// Uniform scale and translation from the space of the instancer to the space of the prototype, how most instances are placed
+	///	A third of the size of a Transform, so instances placed differently each still take little memory
+	struct Placement {
 		vec3 offset;
 		float scale;
-		SharedMaterialPtr material;
+	};
+	static_assert(sizeof(Placement) == 16, "placements are compared and hashed as bytes");
+
+	/// Values instances refer to by index, each distinct value is stored once and its slot is reused after the last instance using it is removed
+	template <typename Value>
+	struct SharedTable {
+		/// @return index of @value, added if no instance uses it yet
+		uint32_t acquire(const Value &value) {
+			auto found = indices.find(value);
+			if (found != indices.end()) {
+				users[found->second]++;
+				return found->second;
+			}
+			uint32_t index = uint32_t(values.size());
+			if (freeIndices.empty()) {
+				values.push_back(value);
+				users.push_back(1);
+			} else {
+				index = freeIndices.back();
+				freeIndices.pop_back();
+				values[index] = value;
+				users[index] = 1;
+			}
+			indices.emplace(value, index);
+			return index;
+		}
+
+		/// @brief Drop one user of the value at @index, the value is freed with the last one
+		void release(uint32_t index) {
+			if (--users[index] == 0) {
+				indices.erase(values[index]);
+				freeIndices.push_back(index);
+			}
+		}
 
-		bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
-		bool boxIntersect(const BBox &other) override;
-		void expandBox(BBox &other) override;
+		const Value &operator[](uint32_t index) const {
+			return values[index];
+		}
+	private:
+		// Equal bytes are the same value, so -0 and 0 are kept apart, which only costs a duplicate
+		struct BytesHash {
+			size_t operator()(const Value &value) const {
+				return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char *>(&value), sizeof(Value)));
+			}
+		};
+		struct BytesEqual {
+			bool operator()(const Value &a, const Value &b) const {
+				return memcmp(&a, &b, sizeof(Value)) == 0;
+			}
+		};
+		std::vector<Value> values;
+		std::vector<uint32_t> users; ///< Instances using each value, 0 for free slots
+		std::vector<uint32_t> freeIndices;
+		std::unordered_map<Value, uint32_t, BytesHash, BytesEqual> indices;
 	};
-	std::vector<Instance> instances;
+
+	/// Set in instanceTransforms for instances that are not only scaled and moved, the rest of the bits index transforms
+	static const uint32_t GENERAL_TRANSFORM = 1u << 31;
+
+	std::vector<SharedPrimPtr> prototypes; ///< Each instanced primitive once
+	std::vector<BBox> prototypeBoxes; ///< Box of each prototype when the bounds of its instances were taken, see refitInstances
+	SharedTable<Placement> placements;
+	SharedTable<Transform> transforms; ///< From the space of the instancer to the space of the prototype, for instances rotated or scaled unevenly
+	std::vector<SharedMaterialPtr> materials{ nullptr }; ///< Material overrides, index 0 is reserved for no override
+
+	// Instance table, one element per instance in each
+	std::vector<uint32_t> instancePrototypes;
+	std::vector<uint32_t> instanceTransforms; ///< Index in placements, or in transforms with GENERAL_TRANSFORM set
+	std::vector<uint16_t> instanceMaterials;
+	std::vector<BBox> instanceBounds; ///< Cached bounds of each instance in the space of the instancer
+	std::vector<uint8_t> instanceLevels; ///< Level of detail of each instance, empty when all use full detail
+
+	std::shared_ptr<BakedInstances> baked; ///< Null when no instance is baked
+	std::vector<int> listedInstances; ///< Instances that are not baked, the primitives of the accelerator while some are baked
+	std::vector<int> bakedSlots; ///< While some are baked, index of each instance in listedInstances, or -1 - index of its baked run
+
+	std::unordered_map<const Primitive*, uint32_t> prototypeIndices;
+	std::unordered_map<const Material*, uint16_t> materialIndices;
 
 	AcceleratorPtr accelerator;
+	AcceleratorSettings acceleratorSettings; ///< Of the last onBeforeRender, the accelerator is made again with them when edits can't update it
+
+	// Lists too small for an accelerator, spheres placed as they are get intersected 4 at a time
+	PackedSpheres packedSpheres;
+	std::vector<int> packedInstances; ///< Instance of each packed sphere
+	std::vector<int> unpackedInstances; ///< Instances tested one by one
+	bool packed = false; ///< Cleared when instances change, intersect then tests all instances one by one
+
+	/// @brief Transform a ray from the space of the instancer to the space of the instanced primitive
+	///	       Direction is not normalized, so distances along the local ray match the ones along @ray
+	Ray localRay(int instance, const Ray &ray) const;
+
+	/// @brief Transform intersection found with localRay(@ray) back to the space of the instancer
+	void toWorldIntersection(int instance, const Ray &ray, Intersection &intersection) const;
+
+	/// @brief Check if the instance places the primitive as is, without transform or material override
+	bool isIdentity(int instance) const;
+
+	/// @return transform from the space of the instancer to the space of the prototype of @instance
+	Transform toLocal(int instance) const;
+
+	/// @brief Intersect the rays at @rayIndices with @instance, moved to its space in chunks on the stack
+	/// @param rayIndices - rays of the arrays to intersect, null for the first @count
+	void intersectInstanceBatch(int instance, const Ray *rays, const int *rayIndices, int count, float tMin, float *tMax, Intersection *intersections, bool *hits);
+
+	/// @brief intersectBatch without the test against the box of the instancer
+	void intersectListedBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits);
+
+	/// @brief Update an already built accelerator after a primitive of its list is added or removed
+	///	       Accelerators that can't be updated in place are replaced by a DynamicBVH so following edits are cheap
+	/// @param index - in the list the accelerator is built over, see listedInstance
+	void updateAccelerator(int index, bool inserted);
+
+	/// @brief Take a removed instance out of the baked runs or the list, while some are baked
+	void unlistInstance(int instance);
+
+	/// @brief Take the bounds of instances again for prototypes whose box changed, like nested instancers edited since they were added
+	void refitInstances();
+
+	/// @brief Take the box of the instancer again from the bounds of its instances
+	void fitBox();
+
+	/// @brief Split the instances of a small list into packed spheres and the rest
+	void packInstances();
+
+	/// @brief Map index in the list the accelerator is built over to instance
+	int listedInstance(int index) const {
+		return baked ? listedInstances[index] : index;
+	}
+
+	/// @brief Copy the faces of instances in the space of the instancer, for prototypes where a flat run costs rays less
+	///	       than the transform and the prototype's own traversal, most saved per byte first while they fit in @settings
+	void bakeInstances(const AcceleratorSettings &settings);
+
+	/// @brief Return baked instances to the instance level, done when too few instances are left to use an accelerator
+	void unbakeInstances();
+
+	/// @brief Pick the level of detail of each instance from its distance to the eye in @lod
+	///	       The eye is taken in the space of the instancer, nested instancers are expected to be placed without transform
+	void pickLevels(const LodSettings &lod);
 public:
-	void onBeforeRender(AcceleratorType acceleratorType) override;
+	void onBeforeRender(const AcceleratorSettings &settings) override;
+
+	/// @return index of the new instance, -1 when it can't be added
+	int addInstance(SharedPrimPtr prim, const vec3 &offset = vec3(0.f), float scale = 1.f, SharedMaterialPtr material = nullptr);
+
+	/// @brief Add instance with arbitrary affine transform
+	/// @param transform - from the space of the primitive to the space of the instancer, must be invertible
+	/// @return index of the new instance, -1 when it can't be added, when it overrides the material with one more than the table holds
+	int addInstance(SharedPrimPtr prim, const Transform &transform, SharedMaterialPtr material = nullptr);
 
-	void addInstance(SharedPrimPtr prim, const vec3 &offset = vec3(0.f), float scale = 1.f, SharedMaterialPtr material = nullptr);
+	/// @brief Remove instance, the last instance is moved to its index
+	///	       Bounds of the instancer shrink to the instances left, instancers using it take them on their next onBeforeRender
+	///	       Prototypes and materials stay referenced, faces of a baked instance until it is baked again
+	void removeInstance(int instance);
+
+	int instanceCount() const {
+		return int(instancePrototypes.size());
+	}
+
+	/// @brief Collect instances that could be visible in the frustum
+	///	       Identity instances of nested primitives are expanded, so the result holds the innermost instances
+	bool frustumCull(const Frustum &frustum, std::vector<PrimitiveRef> &visible) override;
+
+	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+	void intersectBatch(const Ray *rays, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) override;
+
+	int primitiveCount() const override;
+	bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+	bool primitiveBoxIntersect(int index, const BBox &box) override;
+	void expandPrimitiveBox(int index, BBox &box) override;
+	bool batchesPrimitives() const override {
+		return true;
+	}
+	void intersectPrimitiveBatch(int index, const Ray *rays, const int *rayIndices, int count, float tMin, float *tMax, Intersection *intersections, bool *hits) override;
+};
+
+/// Lattice of instances of a single prototype, described implicitly without any per instance data
+///	Instance at lattice point (x, y, z) is placed at origin + (x, y, z) * spacing, rays walk the cells around the points with 3D DDA
+///	Per instance material and position jitter are derived from a hash of the lattice point
+struct InstanceGrid : Primitive {
+	/// @param prototype - the instanced primitive
+	/// @param origin - position of the first instance
+	/// @param spacing - distance between neighbouring lattice points on each axis, must be positive
+	/// @param countX, countY, countZ - number of lattice points on each axis
+	/// @param scale - uniform scale of each instance
+	/// @param materials - palette of materials to pick from for each instance, empty to keep the prototype's material
+	/// @param jitter - max random offset of each instance from its lattice point, as fraction of the spacing
+	InstanceGrid(SharedPrimPtr prototype, const vec3 &origin, const vec3 &spacing, int countX, int countY, int countZ,
+		float scale = 1.f, std::vector<SharedMaterialPtr> materials = {}, float jitter = 0.f);
+
+	void onBeforeRender(const AcceleratorSettings &settings) override;
+
+	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+
+	/// @brief Get the total number of instances described by the grid
+	int64_t instanceCount() const;
+private:
+	/// @brief Intersect the instance at a lattice point
+	bool intersectInstance(const int point[3], const Ray &ray, float tMin, float tMax, Intersection &intersection);
+
+	SharedPrimPtr prototype;
+	std::vector<SharedMaterialPtr> materials;
+	vec3 origin;
+	vec3 spacing;
+	int counts[3];
+	float scale;
+	float jitter;
+	int reach[3]; ///< How many cells away from its own an instance can extend on each axis
+	BBox cellBounds; ///< Bounds of all cells walked by rays, including the @reach border around lattice cells
+	float prototypeRadius; ///< Distance from the lattice point to the farthest corner of an instance
+	LodSettings lod; ///< Levels are picked per instance while walking, there are too many instances to keep them
+};
+
+/// Many spheres stored as arrays instead of a SpherePrim each, for particles and point clouds with millions of spheres
+///	Spheres are intersected through their own BVH, with the spheres of each leaf in one packet tested with SSE
+struct SphereSet : Primitive {
+	/// @return index of the material, to pass to addSphere, -1 when the set already has as many materials as the index can hold
+	int addMaterial(SharedMaterialPtr material);
+
+	/// @param material - index returned by addMaterial, the sphere is not added when it is -1 or any other index not in the set
+	void addSphere(const vec3 &center, float radius, int material);
+
+	int sphereCount() const {
+		return int(radii.size());
+	}
+
+	void onBeforeRender(const AcceleratorSettings &settings) override;
 
 	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+private:
+	static const int BIN_COUNT = 16; ///< Buckets the centroids are sorted in to evaluate SAH splits
+	static const int MAX_DEPTH = 64;
+
+	struct Node {
+		BBox bounds;
+		int offset; ///< First packet of a leaf, second child of an inner node, the first child follows its parent
+		int packetCount; ///< 0 for inner nodes
+	};
+
+	/// @brief Build the subtree of the spheres in @ids with binned SAH, adding the leaves to @packed
+	/// @param sphereBounds - bounds of each sphere
+	void buildNode(int *ids, int count, const std::vector<BBox> &sphereBounds, int depth);
+
+	// One element per sphere in each
+	std::vector<float> centerX, centerY, centerZ;
+	std::vector<float> radii;
+	std::vector<uint16_t> sphereMaterials;
+
+	std::vector<SharedMaterialPtr> materials;
+
+	std::vector<Node> nodes; ///< Depth first, root at 0
+	PackedSpheres packed; ///< Spheres in the order of the leaves
+	std::vector<int> packedSpheres; ///< Sphere of each lane in @packed, -1 for padding
 };
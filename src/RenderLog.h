@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <mutex>
 #include <imgui.h>
 
 class RenderLog : public Module<RenderLog>
@@ -16,18 +17,76 @@ public:
 		Entry entry;
 		entry.scene = scene;
 		entry.samples = samples;
+		// Refine threads of the previous render may still be logging their builds
+		std::lock_guard<std::mutex> lock(m_AccelMutex);
 		m_Logs.push_back(entry);
 	}
 
-	// Logs info about building an accelerator structure. Can be called multiple times per render.
+	// Number of renders begun, identifies the current render
+	size_t RenderCount() const
+	{
+		return m_Logs.size();
+	}
+
+	struct AccelBuild
+	{
+		AcceleratorType accel;
+		float time;
+		uint32_t nodeCount;
+		uint32_t byteCount;
+		bool logged; ///< False when nothing was built since muting
+	};
+
+	// Logs info about building an accelerator structure. Can be called multiple times per render, also from render threads.
 	void AccelInfo(AcceleratorType accel, float time, uint32_t nodeCount, uint32_t byteCount)
 	{
+		if (s_AccelMuted)
+		{
+			s_LastMutedAccel = { accel, time, nodeCount, byteCount, true };
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_AccelMutex);
 		m_Logs.back().accelTime += time;
 		m_Logs.back().nodeCount += nodeCount;
 		m_Logs.back().bytes += byteCount;
 		m_Logs.back().accel = accel;
 	}
 
+	// While muted, accelerator builds on the calling thread are kept aside instead of logged, used for trial builds
+	// Returns the previous state, so nested mutes can restore it
+	bool MuteAccelInfo(bool mute)
+	{
+		const bool wasMuted = s_AccelMuted;
+		s_AccelMuted = mute;
+		if (mute)
+		{
+			s_LastMutedAccel = {}; // builds that log nothing must not report the one before
+		}
+		return wasMuted;
+	}
+
+	// Info of the last build made on the calling thread while muted
+	AccelBuild LastMutedAccelInfo() const
+	{
+		return s_LastMutedAccel;
+	}
+
+	// Logs which accelerator the tuner picked. Can be called multiple times per render, also from render threads.
+	void TuneInfo(const std::string& decision)
+	{
+		std::lock_guard<std::mutex> lock(m_AccelMutex);
+		std::string& tuning = m_Logs.back().tuning;
+		if (!tuning.empty())
+			tuning += "; ";
+		tuning += decision;
+	}
+
+	// Logs the memory budget of the accelerators, shown next to the memory they took
+	void BudgetInfo(uint64_t bytes)
+	{
+		m_Logs.back().budgetBytes = bytes;
+	}
+
 	void RenderEnd(float renderTime)
 	{
 		m_Logs.back().renderTime = renderTime;
@@ -46,7 +105,7 @@ public:
 			ImGui::BeginDisabled(disabled);
 		ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_SortMulti | ImGuiTableFlags_Sortable |
 			ImGuiTableFlags_Resizable | ImGuiTableFlags_Hideable | ImGuiTableFlags_ScrollY;
-		if (ImGui::BeginTable("##consoleTable", 10, flags))
+		if (ImGui::BeginTable("##consoleTable", 11, flags))
 		{
 			ImGui::TableSetupColumn("Scene");
 			ImGui::TableSetupColumn("Vertices");
@@ -58,6 +117,7 @@ public:
 			ImGui::TableSetupColumn("Accelerator Memory");
 			ImGui::TableSetupColumn("Render Time");
 			ImGui::TableSetupColumn("Total Time");
+			ImGui::TableSetupColumn("Tuning");
 			ImGui::TableHeadersRow();
 
 			for (auto& entry : m_Logs)
@@ -73,19 +133,24 @@ public:
 				ImGui::TableNextColumn();
 				ImGui::Text("%d", entry.samples);
 				ImGui::TableNextColumn();
-				const std::vector<const char*> optionsAcc = { "Octtree", "BVH", "KDTree" };
+				const std::vector<const char*> optionsAcc = { "Octtree", "BVH", "KDTree", "Dynamic BVH", "PLOC BVH", "Auto" };
 				ImGui::Text(optionsAcc[(uint32_t)entry.accel]);
 				ImGui::TableNextColumn();
 				ImGui::Text("%f", entry.accelTime);
 				ImGui::TableNextColumn();
 				ImGui::Text("%d", entry.nodeCount);
 				ImGui::TableNextColumn();
-				ImGui::Text("%d", entry.bytes);
+				if (entry.budgetBytes > 0)
+					ImGui::Text("%u / %llu", entry.bytes, (unsigned long long)entry.budgetBytes);
+				else
+					ImGui::Text("%u", entry.bytes);
 				ImGui::TableNextColumn();
 				ImGui::Text("%f", entry.renderTime);
 				ImGui::TableNextColumn();
 				ImGui::Text("%f", entry.renderTime + entry.accelTime);
 				ImGui::TableNextColumn();
+				ImGui::Text(entry.tuning.c_str());
+				ImGui::TableNextColumn();
 			}
 
 			bool needSort = false;
@@ -111,6 +176,7 @@ public:
 						case 7: ret = l.bytes < r.bytes; break;
 						case 8: ret = l.renderTime < r.renderTime; break;
 						case 9: ret = l.renderTime + l.accelTime < r.renderTime + r.accelTime; break;
+						case 10: ret = l.tuning < r.tuning; break;
 						}
 						return ascending ? ret : !ret;
 					});
@@ -130,17 +196,24 @@ private:
 		float accelTime = 0;
 		uint32_t nodeCount = 0;
 		uint32_t bytes = 0;
+		uint64_t budgetBytes = 0; // 0 when not limited
 		uint32_t samples = 0;
 		uint32_t verts = 0;
 		uint32_t faces = 0;
 		AcceleratorType accel = AcceleratorType::Octtree;
+		std::string tuning;
 	};
 
 	Entry m_Tmp;
 	std::vector<Entry> m_Logs;
+	std::mutex m_AccelMutex;
+	static inline thread_local bool s_AccelMuted = false;
+	static inline thread_local AccelBuild s_LastMutedAccel = {};
 };
 
 #define LOG_RENDER_BEGIN(scene, samples) RenderLog::Get().RenderBegin(scene, samples)
 #define LOG_MESH_INFO(verts, faces) RenderLog::Get().MeshInfo(verts,faces);
 #define LOG_ACCEL_BUILD(accel, time, nodes, bytes) RenderLog::Get().AccelInfo(accel, time, nodes, bytes)
+#define LOG_ACCEL_TUNE(decision) RenderLog::Get().TuneInfo(decision)
+#define LOG_MEMORY_BUDGET(bytes) RenderLog::Get().BudgetInfo(bytes)
 #define LOG_RENDER_END(time) RenderLog::Get().RenderEnd(time)
\ No newline at end of file
@@ -275,4 +275,30 @@ private:
 
 inline void Task::runOn(ThreadManager &tm) {
 	tm.runThreads(*this);
+}
+
+/// Split [0, count) in equal consecutive ranges and call @function(begin, end) for each one on a separate worker
+/// Runs everything on the calling thread when @tm is null, must be called only from the thread scheduling tasks on @tm
+template <typename Function>
+void parallelFor(ThreadManager *tm, int count, const Function &function) {
+	if (!tm || tm->getThreadCount() < 2 || count < 2) {
+		function(0, count);
+		return;
+	}
+
+	struct RangeTask : Task {
+		const Function &function;
+		int count;
+
+		RangeTask(const Function &function, int count) : function(function), count(count) {}
+
+		void run(int threadIndex, int threadCount) override {
+			const int begin = int(int64_t(count) * threadIndex / threadCount);
+			const int end = int(int64_t(count) * (threadIndex + 1) / threadCount);
+			if (begin < end) {
+				function(begin, end);
+			}
+		}
+	} task(function, count);
+	task.runOn(*tm);
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <ostream>
 #include <random>
 #include <cassert>
+#include <algorithm>
 
 static const int MAX_RAY_DEPTH = 35;
 const float PI = 3.14159265358979323846;
@@ -242,6 +243,12 @@ struct BBox {
 		        min.z - 1e-6 <= point.z && point.z <= max.z + 1e-6);
 	}
 
+	/// @brief Get distance from @point to the closest point of the box, 0 for points inside
+	float distance(const vec3 &point) const {
+		const vec3 outside = ::max(::max(min - point, point - max), vec3(0.f));
+		return outside.length();
+	}
+
 	inline float gamma(int n) const {
 		return (n * std::numeric_limits<float>::epsilon() * 0.5) / (1 - n * std::numeric_limits<float>::epsilon() * 0.5);
 	}
@@ -387,3 +394,171 @@ struct BBox {
 		return false;
 	}
 };
+
+/// Affine transform, top 3 rows of a 4x4 matrix applied to column vectors
+struct Transform {
+	float m[3][4];
+
+	static Transform identity() {
+		return scaling(vec3(1.f));
+	}
+
+	static Transform translation(const vec3 &offset) {
+		Transform result = identity();
+		for (int c = 0; c < 3; c++) {
+			result.m[c][3] = offset[c];
+		}
+		return result;
+	}
+
+	static Transform scaling(const vec3 &scale) {
+		Transform result;
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				result.m[r][c] = r == c ? scale[r] : 0.f;
+			}
+		}
+		return result;
+	}
+
+	/// @brief Rotation around an axis through the origin
+	/// @param axis - the axis, does not need to be normalized
+	/// @param angle - counter clockwise angle in radians
+	static Transform rotation(const vec3 &axis, float angle) {
+		const vec3 a = axis.normalized();
+		const float s = sinf(angle);
+		const float c = cosf(angle);
+		const float t = 1.f - c;
+		Transform result = identity();
+		result.m[0][0] = t * a.x * a.x + c;       result.m[0][1] = t * a.x * a.y - s * a.z; result.m[0][2] = t * a.x * a.z + s * a.y;
+		result.m[1][0] = t * a.x * a.y + s * a.z; result.m[1][1] = t * a.y * a.y + c;       result.m[1][2] = t * a.y * a.z - s * a.x;
+		result.m[2][0] = t * a.x * a.z - s * a.y; result.m[2][1] = t * a.y * a.z + s * a.x; result.m[2][2] = t * a.z * a.z + c;
+		return result;
+	}
+
+	/// @brief Compose two transforms, @other is applied first
+	Transform operator*(const Transform &other) const {
+		Transform result;
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				result.m[r][c] = m[r][0] * other.m[0][c] + m[r][1] * other.m[1][c] + m[r][2] * other.m[2][c];
+			}
+			result.m[r][3] += m[r][3];
+		}
+		return result;
+	}
+
+	vec3 point(const vec3 &p) const {
+		return {
+			m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+			m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+			m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3],
+		};
+	}
+
+	vec3 vector(const vec3 &v) const {
+		return {
+			m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+			m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+			m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z,
+		};
+	}
+
+	/// @brief Multiply by the transpose of the linear part, used on the inverse transform to map normals
+	vec3 transposedVector(const vec3 &v) const {
+		return {
+			m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+			m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+			m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z,
+		};
+	}
+
+	/// @brief Compute the inverse transform, the linear part must not be singular
+	Transform inverted() const {
+		const float cofactors[3][3] = {
+			{ m[1][1] * m[2][2] - m[1][2] * m[2][1], m[1][2] * m[2][0] - m[1][0] * m[2][2], m[1][0] * m[2][1] - m[1][1] * m[2][0] },
+			{ m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1] },
+			{ m[0][1] * m[1][2] - m[0][2] * m[1][1], m[0][2] * m[1][0] - m[0][0] * m[1][2], m[0][0] * m[1][1] - m[0][1] * m[1][0] },
+		};
+		const float det = m[0][0] * cofactors[0][0] + m[0][1] * cofactors[0][1] + m[0][2] * cofactors[0][2];
+		assert(fabs(det) > 1e-12f);
+		const float invDet = 1.f / det;
+
+		Transform result;
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 3; c++) {
+				result.m[r][c] = cofactors[c][r] * invDet;
+			}
+		}
+		for (int r = 0; r < 3; r++) {
+			result.m[r][3] = -(result.m[r][0] * m[0][3] + result.m[r][1] * m[1][3] + result.m[r][2] * m[2][3]);
+		}
+		return result;
+	}
+
+	/// @brief Compute the axis aligned box containing the transformed box (Arvo's method)
+	BBox box(const BBox &other) const {
+		BBox result;
+		for (int r = 0; r < 3; r++) {
+			result.min[r] = result.max[r] = m[r][3];
+			for (int c = 0; c < 3; c++) {
+				const float a = m[r][c] * other.min[c];
+				const float b = m[r][c] * other.max[c];
+				result.min[r] += std::min(a, b);
+				result.max[r] += std::max(a, b);
+			}
+		}
+		return result;
+	}
+
+	bool isIdentity() const {
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				if (m[r][c] != (r == c ? 1.f : 0.f)) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+/// Infinite pyramid with apex at @origin, bounding a bundle of rays sharing that origin
+struct Frustum {
+	vec3 origin;
+	vec3 normals[4]; ///< Inward facing normals of the side planes, all of them pass through @origin
+
+	Frustum() = default;
+
+	/// @brief Construct the frustum spanned by the directions of its 4 edges
+	/// @param apex - the common origin of all rays in the frustum
+	/// @param edges - edge directions, ordered around the frustum (either winding)
+	Frustum(const vec3 &apex, const vec3 edges[4])
+		: origin(apex) {
+		const vec3 center = edges[0] + edges[1] + edges[2] + edges[3];
+		for (int c = 0; c < 4; c++) {
+			normals[c] = cross(edges[c], edges[(c + 1) % 4]);
+			if (dot(normals[c], center) < 0.f) {
+				normals[c] = -normals[c];
+			}
+		}
+	}
+
+	/// @brief Conservative check if any part of the box can be inside the frustum
+	/// @return false only if the box is fully outside at least one of the side planes
+	bool testBox(const BBox &box) const {
+		for (int c = 0; c < 4; c++) {
+			const vec3 &n = normals[c];
+			// corner of the box furthest along the plane normal
+			const vec3 corner{
+				n.x >= 0.f ? box.max.x : box.min.x,
+				n.y >= 0.f ? box.max.y : box.min.y,
+				n.z >= 0.f ? box.max.z : box.min.z
+			};
+			if (dot(n, corner - origin) < 0.f) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
@@ -14,7 +14,7 @@
 
 #include "RenderLog.h"
 #include "Primitive.h"
-#include "threading.hpp"
+#include "Threading.hpp"
 #include "Image.hpp"
 #include "ImGui.h"
 
@@ -265,11 +265,11 @@ void Window::onImGuiRender()
 		ImGui::BeginDisabled(true);
 	
 	BeginPropertyGrid();
-	const std::vector<const char*> optionsAcc = { "Octtree", "BVH", "KDTree" };
+	const std::vector<const char*> optionsAcc = { "Octtree", "BVH", "KDTree", "Dynamic BVH", "PLOC BVH", "Auto" };
 	PropertyDropdown("Accelerator", optionsAcc, m_CurrentRenderProperties.accelerator);
 
 	static uint32_t selectedScene = 0;
-	const std::vector<const char*> optionsSc = { "Example", "Dragon", "Instanced Cubes", "Instanced Dragons", "CustomMesh" };
+	const std::vector<const char*> optionsSc = { "Example", "Dragon", "Instanced Cubes", "Instanced Dragons", "Procedural Dragons", "Sphere Cloud", "CustomMesh" };
 	if (PropertyDropdown("Scene", optionsSc, m_CurrentRenderProperties.sceneType))
 	{
 		if (m_CurrentRenderProperties.sceneType == SceneType::Example)
@@ -280,9 +280,26 @@ void Window::onImGuiRender()
 			m_CurrentRenderProperties.samples = 2;
 		else if (m_CurrentRenderProperties.sceneType == SceneType::InstancedDragons)
 			m_CurrentRenderProperties.samples = 10;
+		else if (m_CurrentRenderProperties.sceneType == SceneType::ProceduralDragons)
+			m_CurrentRenderProperties.samples = 4;
+		else if (m_CurrentRenderProperties.sceneType == SceneType::SphereCloud)
+			m_CurrentRenderProperties.samples = 4;
 	}
 
 	Property("Samples", m_CurrentRenderProperties.samples);
+	const std::vector<const char*> optionsBuild = { "Eager", "Lazy", "Progressive" };
+	PropertyDropdown("Build", optionsBuild, m_CurrentRenderProperties.buildMode);
+	Property("Memory Budget (MB)", m_CurrentRenderProperties.memoryBudgetMB);
+	const std::vector<const char*> optionsLayout = { "Default", "Depth First", "Treelets" };
+	PropertyDropdown("Node Layout", optionsLayout, m_CurrentRenderProperties.nodeLayout);
+	Property("Huge Pages", m_CurrentRenderProperties.hugePages);
+	Property("Bake Instances (MB)", m_CurrentRenderProperties.bakeInstancesMB);
+	Property("Compress Meshes", m_CurrentRenderProperties.compressMeshes);
+	Property("Out of Core Meshes (MB)", m_CurrentRenderProperties.residentMeshMB);
+	Property("LOD Error (pixels)", m_CurrentRenderProperties.lodPixelError);
+	Property("Blend LOD", m_CurrentRenderProperties.lodBlend);
+	Property("Edit Instances", m_CurrentRenderProperties.editInstances);
+	Property("Mesh Cache (MB)", m_CurrentRenderProperties.meshCacheMB);
 
 	std::string path = m_CurrentRenderProperties.scenePath.string();
 	if (PropertyFilepath("Open Mesh", path))
@@ -42,6 +42,8 @@ enum class SceneType
 	Dragon,
 	InstancedCubes,
 	InstancedDragons,
+	ProceduralDragons,
+	SphereCloud,
 	CustomMesh
 };
 
@@ -50,6 +52,17 @@ struct RenderProperties
 	AcceleratorType accelerator = AcceleratorType::Octtree;
 	SceneType sceneType = SceneType::Example;
 	uint32_t samples = 4;
+	BuildMode buildMode = BuildMode::Eager;
+	uint32_t memoryBudgetMB = 0; // for all accelerators of the render, 0 for no limit
+	NodeLayout nodeLayout = NodeLayout::Default;
+	bool hugePages = false;
+	uint32_t bakeInstancesMB = 0; // memory each instancer may spend flattening instances of small meshes, 0 to keep them all
+	bool compressMeshes = false; // quantized vertices and short indices, less memory for slightly moved positions
+	uint32_t residentMeshMB = 0; // meshes paged in clusters keeping at most this much in memory, 0 to load them whole
+	uint32_t lodPixelError = 0; // pixels far instances of simplified meshes may be off by, 0 for full detail everywhere
+	bool lodBlend = false; // instances between two levels of detail take either at random
+	uint32_t editInstances = 0; // instances moved after the render, which is then rendered again to time the edit
+	uint32_t meshCacheMB = 1024; // mesh files and accelerators kept for the next render, 0 to load them again every time
 	Path scenePath;
 };
 
@@ -2,6 +2,7 @@
 
 #define WINDOW // Renders are a bit slower with this
 
+#include <functional>
 #include <random>
 #include <vector>
 #include <cmath>
@@ -15,7 +16,7 @@
 #endif
 
 #include "RenderLog.h"
-#include "threading.hpp"
+#include "Threading.hpp"
 #include "Material.h"
 #include "Primitive.h"
 #include "Image.hpp"
@@ -49,9 +50,12 @@ struct Camera {
 	}
 };
 
-vec3 raytrace(const Ray& r, Instancer& prims, int depth = 0) {
-	Intersection data;
-	if (prims.intersect(r, 0.001f, FLT_MAX, data)) {
+vec3 raytrace(const Ray& r, Instancer& prims, int depth = 0);
+
+/// @brief Compute the color for a ray once its closest intersection is known
+/// @param hasHit - if the ray intersected anything, @data is valid only when true
+vec3 shade(const Ray& r, bool hasHit, const Intersection& data, Instancer& prims, int depth) {
+	if (hasHit) {
 		Ray scatter;
 		Color attenuation;
 		if (depth < MAX_RAY_DEPTH && data.material->shade(r, data, attenuation, scatter)) {
@@ -67,6 +71,12 @@ vec3 raytrace(const Ray& r, Instancer& prims, int depth = 0) {
 	return (1.f - f) * vec3(1.f) + f * vec3(0.5f, 0.7f, 1.f);
 }
 
+vec3 raytrace(const Ray& r, Instancer& prims, int depth) {
+	Intersection data;
+	const bool hasHit = prims.intersect(r, 0.001f, FLT_MAX, data);
+	return shade(r, hasHit, data, prims, depth);
+}
+
 /// The whole scene description
 struct Scene : Task {
 	Scene(AcceleratorType accelerator, uint32_t samples) : accelerator(accelerator), samplesPerPixel(samples) {}
@@ -78,13 +88,78 @@ struct Scene : Task {
 	int samplesPerPixel = 4; // samples are here
 	std::string name;
 	std::atomic<int> renderedPixels;
+	std::atomic<int> nextTile;
+	MemoryBudget accelMemory; // before the primitives, so it outlives their accelerators
+	std::shared_ptr<ThreadManager> spareThreads; // progressive builds refine on these, also outlives the accelerators using them
 	Instancer primitives;
 	Camera camera;
 	ImageData image;
 	AcceleratorType accelerator;
+	BuildMode buildMode = BuildMode::Eager;
+	int64_t memoryBudget = 0; // bytes for all accelerators, 0 for no limit
+	NodeLayout nodeLayout = NodeLayout::Default;
+	bool hugePages = false;
+	int64_t bakeBytes = 0; // memory each instancer may spend baking instances of small meshes, 0 to keep all of them two level
+	float lodPixelError = 0.f; // pixels simplified meshes may be off by, 0 to render full detail everywhere
+	bool lodBlend = false;
+	MeshLoadSettings meshLoad; // workers and compression for loading meshes
+	MeshLoader meshLoader; // loads the meshes of the scene in the background while it is being made
+	std::function<void(int)> moveInstances; // moves the given number of random instances, set by scenes that can be edited
+
+	AcceleratorSettings acceleratorSettings(ThreadManager *tm) {
+		AcceleratorSettings settings;
+		settings.type = accelerator;
+		settings.buildMode = buildMode;
+		settings.rayBudget = int64_t(width) * height * samplesPerPixel;
+		settings.threads = tm;
+		if (buildMode == BuildMode::Progressive && tm) {
+			if (!spareThreads) {
+				// Cores left over by the render workers, at least one so refining doesn't wait for the render to end
+				const int spare = std::max<int>(int(std::thread::hardware_concurrency()) - tm->getThreadCount(), 1);
+				spareThreads = std::shared_ptr<ThreadManager>(new ThreadManager(spare), [](ThreadManager *threads) {
+					threads->stop();
+					delete threads;
+				});
+				spareThreads->start();
+			}
+			settings.spareThreads = spareThreads.get();
+		}
+		settings.nodeLayout = nodeLayout;
+		settings.hugePages = hugePages;
+		settings.bakeBytes = bakeBytes;
+		if (memoryBudget > 0) {
+			accelMemory.limit = memoryBudget;
+			settings.memory = &accelMemory;
+		}
+		if (lodPixelError > 0.f) {
+			settings.lod.eye = camera.origin;
+			settings.lod.pixelAngle = camera.up.length() / height; // up spans the image height at unit distance
+			settings.lod.pixelError = lodPixelError;
+			settings.lod.blend = lodBlend;
+		}
+		return settings;
+	}
+
+	/// Start loading a mesh file, call after initImage so the accelerator built with it matches the render
+	///	Request every mesh first and get each future only where its mesh is used, so loads overlap each other and the scene setup
+	///	Meshes @instanced by an instancer get their simplified levels prepared along, the ones added as they are don't use them
+	MeshLoader::Future loadMesh(const std::string &path, bool instanced = false) {
+		AcceleratorSettings settings = acceleratorSettings(nullptr);
+		settings.lod.instanced = instanced;
+		// Accelerators with a budget or refined while rendering are made per render, only eager ones are built ahead
+		const bool prebuild = settings.buildMode == BuildMode::Eager && !settings.memory;
+		return meshLoader.request(path, meshLoad, prebuild ? &settings : nullptr);
+	}
 
-	void onBeforeRender() {
-		primitives.onBeforeRender(accelerator);
+	void onBeforeRender(ThreadManager &tm) {
+		// The scene is renderable once every mesh is loaded and prebuilt, which also gives @tm back from the loader
+		meshLoader.wait();
+		const AcceleratorSettings settings = acceleratorSettings(&tm);
+		if (settings.memory) {
+			// Each mesh gets a share of the budget by its faces, instancers and other lists take what is left
+			accelMemory.expectedPrimitives = meshLoader.faceCount();
+		}
+		primitives.onBeforeRender(settings);
 	}
 
 	void initImage(int w, int h) {
@@ -102,27 +177,100 @@ struct Scene : Task {
 		runOn(tm);
 	}
 
+	static const int TILE_SIZE = 16; ///< Size in pixels of the square tiles threads take work in
+	static const int MAX_TILE_CANDIDATES = 32; ///< Above this many culled primitives traversing the whole scene is faster
+
+	void onBeforeRun(int threadCount) override {
+		renderedPixels = 0;
+		nextTile = 0;
+	}
+
+	/// @brief Get the frustum containing all primary rays for pixels in [x0, x1) x [y0, y1)
+	Frustum tileFrustum(int x0, int y0, int x1, int y1) const {
+		const float u0 = float(x0) / float(width), u1 = float(x1) / float(width);
+		const float v0 = float(y0) / float(height), v1 = float(y1) / float(height);
+		const vec3 edges[4] = {
+			camera.getRay(u0, v0).dir,
+			camera.getRay(u1, v0).dir,
+			camera.getRay(u1, v1).dir,
+			camera.getRay(u0, v1).dir,
+		};
+		return Frustum(camera.origin, edges);
+	}
+
+	/// Primary rays of a tile along with their closest hits, reused between tiles
+	struct TileRays {
+		std::vector<Ray> rays;
+		std::vector<float> tMax;
+		std::vector<Intersection> intersections;
+		std::unique_ptr<bool[]> hits;
+		int capacity = 0;
+
+		void resize(int count) {
+			rays.resize(count);
+			tMax.assign(count, FLT_MAX);
+			intersections.resize(count);
+			if (capacity < count) {
+				hits.reset(new bool[count]);
+				capacity = count;
+			}
+			std::fill(hits.get(), hits.get() + count, false);
+		}
+	};
+
 	void run(int threadIndex, int threadCount) override {
 		const int total = width * height;
-		const int incrementPrint = total / 100;
-		for (int idx = threadIndex; idx < total; idx += threadCount) {
-			const int r = idx / width;
-			const int c = idx % width;
-
-			Color avg(0);
-			for (int s = 0; s < samplesPerPixel; s++) {
-				const float u = float(c + randFloat()) / float(width);
-				const float v = float(r + randFloat()) / float(height);
-				const Ray& ray = camera.getRay(u, v);
-				const vec3 sample = raytrace(ray, primitives);
-				avg += sample;
+		const int incrementPrint = std::max(total / 100, 1);
+		const int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+		const int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+		std::vector<PrimitiveRef> visible;
+		TileRays primary;
+		for (int tile = nextTile++; tile < tilesX * tilesY; tile = nextTile++) {
+			const int x0 = (tile % tilesX) * TILE_SIZE;
+			const int y0 = (tile / tilesX) * TILE_SIZE;
+			const int x1 = std::min(x0 + TILE_SIZE, width);
+			const int y1 = std::min(y0 + TILE_SIZE, height);
+
+			primary.resize((x1 - x0) * (y1 - y0) * samplesPerPixel);
+			int rayCount = 0;
+			for (int r = y0; r < y1; r++) {
+				for (int c = x0; c < x1; c++) {
+					for (int s = 0; s < samplesPerPixel; s++) {
+						const float u = float(c + randFloat()) / float(width);
+						const float v = float(r + randFloat()) / float(height);
+						primary.rays[rayCount++] = camera.getRay(u, v);
+					}
+				}
+			}
+
+			// all primary rays of the tile share the same top level candidates, find them once
+			visible.clear();
+			primitives.frustumCull(tileFrustum(x0, y0, x1, y1), visible);
+			if (visible.size() <= MAX_TILE_CANDIDATES) {
+				for (int i = 0; i < rayCount; i++) {
+					primary.hits[i] = intersectClosest(visible, primary.rays[i], 0.001f, FLT_MAX, primary.intersections[i]);
+				}
+			} else {
+				// trace all primary rays together, so traversal can interleave them
+				primitives.intersectBatch(primary.rays.data(), rayCount, 0.001f, primary.tMax.data(), primary.intersections.data(), primary.hits.get());
 			}
 
-			avg /= samplesPerPixel;
-			image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
-			const int completed = renderedPixels.fetch_add(1, std::memory_order_relaxed);
-			if (completed % incrementPrint == 0) {
-				printf("\r%d%% ", int(float(completed) / float(total) * 100));
+			int rayIndex = 0;
+			for (int r = y0; r < y1; r++) {
+				for (int c = x0; c < x1; c++) {
+					Color avg(0);
+					for (int s = 0; s < samplesPerPixel; s++, rayIndex++) {
+						const vec3 sample = shade(primary.rays[rayIndex], primary.hits[rayIndex], primary.intersections[rayIndex], primitives, 0);
+						avg += sample;
+					}
+
+					avg /= samplesPerPixel;
+					image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
+					const int completed = renderedPixels.fetch_add(1, std::memory_order_relaxed);
+					if (completed % incrementPrint == 0) {
+						printf("\r%d%% ", int(float(completed) / float(total) * 100));
+					}
+				}
 			}
 		}
 	}
@@ -134,22 +282,28 @@ void sceneExample(Scene& scene) {
 	// scene.initImage(800, 600, 4);
 	scene.initImage(800, 600);
 	scene.camera.lookAt(90.f, { -0.1f, 5, -0.1f }, { 0, 0, 0 });
+	MeshLoader::Future cube = scene.loadMesh(MESH_FOLDER "/cube.obj", true);
 
-	TriangleMesh* triangleMesh = new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{ Color(1, 0, 0) }));
+	const float r = 0.6f;
+	PrimPtr spheres[] = {
+		PrimPtr(new SpherePrim{ vec3(2, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }),
+		PrimPtr(new SpherePrim{ vec3(0, 0, 2), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }),
+		PrimPtr(new SpherePrim{ vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }),
+	};
+
+	TriangleMesh* triangleMesh = new TriangleMesh(cube.get(), MaterialPtr(new Lambert{ Color(1, 0, 0) }));
 	SharedPrimPtr mesh(triangleMesh);
 	Instancer* instancer = new Instancer;
 	instancer->addInstance(mesh, vec3(2, 0, 0));
-	LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 	instancer->addInstance(mesh, vec3(0, 0, 2));
-	LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 	instancer->addInstance(mesh, vec3(2, 0, 2));
-	LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 	scene.addPrimitive(PrimPtr(instancer));
-
-	const float r = 0.6f;
-	scene.addPrimitive(PrimPtr(new SpherePrim{ vec3(2, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }));
-	scene.addPrimitive(PrimPtr(new SpherePrim{ vec3(0, 0, 2), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }));
-	scene.addPrimitive(PrimPtr(new SpherePrim{ vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)}) }));
+	for (PrimPtr &sphere : spheres) {
+		scene.addPrimitive(std::move(sphere));
+	}
 }
 
 void sceneManyHeavyMeshes(Scene& scene) {
@@ -159,6 +313,7 @@ void sceneManyHeavyMeshes(Scene& scene) {
 	// scene.initImage(1280, 720, 10);
 	scene.initImage(1280, 720);
 	scene.camera.lookAt(90.f, { 0, 3, -count }, { 0, 3, count });
+	MeshLoader::Future dragon = scene.loadMesh(MESH_FOLDER "/dragon.obj", true);
 
 	SharedMaterialPtr instanceMaterials[] = {
 		SharedMaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}),
@@ -174,7 +329,7 @@ void sceneManyHeavyMeshes(Scene& scene) {
 		const int rng = int(randFloat() * materialCount);
 		return instanceMaterials[rng];
 	};
-	TriangleMesh* triangleMesh = new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
+	TriangleMesh* triangleMesh = new TriangleMesh(dragon.get(), MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
 	SharedPrimPtr mesh(triangleMesh);
 	Instancer* instancer = new Instancer;
 
@@ -182,14 +337,72 @@ void sceneManyHeavyMeshes(Scene& scene) {
 	
 	for (int c = -count; c <= count; c++) {
 		for (int r = -count; r <= count; r++) {
-			LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+			LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 			instancer->addInstance(mesh, vec3(c, 0, r), 0.05f, getRandomMaterial());
-			LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+			LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 			instancer->addInstance(mesh, vec3(c, 6, r), 0.05f, getRandomMaterial());
 		}
 	}
 
 	scene.addPrimitive(PrimPtr(instancer));
+	scene.moveInstances = [instancer, mesh, count, getRandomMaterial](int moves) {
+		for (int c = 0; c < moves && instancer->instanceCount() > 0; c++) {
+			instancer->removeInstance(std::min(int(randFloat() * instancer->instanceCount()), instancer->instanceCount() - 1));
+			instancer->addInstance(mesh, vec3(count * (2 * randFloat() - 1), 3, count * (2 * randFloat() - 1)), 0.05f, getRandomMaterial());
+		}
+	};
+}
+
+void sceneProceduralDragons(Scene& scene) {
+	scene.name = "procedural-dragons";
+	const int count = 1000;
+
+	scene.initImage(1280, 720);
+	scene.camera.lookAt(90.f, { 0, 3, -count }, { 0, 3, count });
+	MeshLoader::Future dragon = scene.loadMesh(MESH_FOLDER "/dragon.obj", true);
+
+	std::vector<SharedMaterialPtr> instanceMaterials = {
+		SharedMaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}),
+		SharedMaterialPtr(new Lambert{Color(0.7, 0.2, 0.1)}),
+		SharedMaterialPtr(new Lambert{Color(0.1, 0.2, 0.7)}),
+		SharedMaterialPtr(new Metal{Color(0.8, 0.1, 0.1), 0.3f}),
+		SharedMaterialPtr(new Metal{Color(0.1, 0.7, 0.1), 0.6f}),
+		SharedMaterialPtr(new Metal{Color(0.1, 0.1, 0.7), 0.9f}),
+	};
+
+	TriangleMesh* triangleMesh = new TriangleMesh(dragon.get(), MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
+	SharedPrimPtr mesh(triangleMesh);
+
+	// 2001 x 2 x 2001 dragons, none of which are stored - placement and material come from the lattice
+	InstanceGrid* grid = new InstanceGrid(mesh, vec3(-count, 0, -count), vec3(1, 6, 1), 2 * count + 1, 2, 2 * count + 1, 0.05f, instanceMaterials, 0.2f);
+	printf("Procedural grid with %lld instances\n", (long long)grid->instanceCount());
+	scene.addPrimitive(PrimPtr(grid));
+}
+
+void sceneSphereCloud(Scene& scene) {
+	scene.name = "sphere-cloud";
+	const int count = 1000000;
+	const float radius = 10.f;
+
+	scene.initImage(1280, 720);
+	scene.camera.lookAt(90.f, { 0, 2, -1.4f * radius }, { 0, 0, 0 });
+
+	SphereSet* spheres = new SphereSet;
+	const int sphereMaterials[] = {
+		spheres->addMaterial(SharedMaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)})),
+		spheres->addMaterial(SharedMaterialPtr(new Lambert{Color(0.7, 0.2, 0.1)})),
+		spheres->addMaterial(SharedMaterialPtr(new Lambert{Color(0.1, 0.2, 0.7)})),
+		spheres->addMaterial(SharedMaterialPtr(new Metal{Color(0.8, 0.8, 0.8), 0.3f})),
+	};
+	const int materialCount = std::size(sphereMaterials);
+
+	for (int c = 0; c < count; c++) {
+		const int material = sphereMaterials[std::min(int(randFloat() * materialCount), materialCount - 1)];
+		spheres->addSphere(randomUnitSphere() * radius, 0.02f + 0.04f * randFloat(), material);
+	}
+	printf("Sphere cloud with %d spheres\n", spheres->sphereCount());
+	scene.addPrimitive(PrimPtr(spheres));
 }
 
 void sceneManySimpleMeshes(Scene& scene) {
@@ -199,28 +412,37 @@ void sceneManySimpleMeshes(Scene& scene) {
 	// scene.initImage(800, 600, 2);
 	scene.initImage(800, 600);
 	scene.camera.lookAt(90.f, { 0, 2, count }, { 0, 0, 0 });
+	MeshLoader::Future cube = scene.loadMesh(MESH_FOLDER "/cube.obj", true);
 
-	TriangleMesh* triangleMesh = new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{ Color(1, 0, 0) }));
+	TriangleMesh* triangleMesh = new TriangleMesh(cube.get(), MaterialPtr(new Lambert{ Color(1, 0, 0) }));
 	SharedPrimPtr mesh(triangleMesh);
 	Instancer* instancer = new Instancer;
 
 	for (int c = -count; c <= count; c++) {
 		for (int r = -count; r <= count; r++) {
-			LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+			LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 			instancer->addInstance(mesh, vec3(c, 0, r), 0.5f);
 		}
 	}
 
 	scene.addPrimitive(PrimPtr(instancer));
+	scene.moveInstances = [instancer, mesh, count](int moves) {
+		for (int c = 0; c < moves && instancer->instanceCount() > 0; c++) {
+			instancer->removeInstance(std::min(int(randFloat() * instancer->instanceCount()), instancer->instanceCount() - 1));
+			instancer->addInstance(mesh, vec3(count * (2 * randFloat() - 1), 1, count * (2 * randFloat() - 1)), 0.5f);
+		}
+	};
 }
 
 void sceneHeavyMesh(Scene& scene) {
 	scene.name = "dragon";
 	// scene.initImage(800, 600, 4);
 	scene.initImage(800, 600);
+	MeshLoader::Future dragon = scene.loadMesh(MESH_FOLDER "/dragon.obj");
 	scene.camera.lookAt(90.f, { 8, 10, 7 }, { 0, 0, 0 });
-	TriangleMesh* triangleMesh = new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
-	LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+
+	TriangleMesh* triangleMesh = new TriangleMesh(dragon.get(), MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 	scene.addPrimitive(PrimPtr(triangleMesh));
 }
 
@@ -228,9 +450,11 @@ void sceneCustomMesh(Scene& scene, const std::string& filepath)
 {
 	scene.name = filepath;
 	scene.initImage(1280, 720);
+	MeshLoader::Future custom = scene.loadMesh(filepath);
 	scene.camera.lookAt(90.0f, { 8, 10, 7 }, { 0, 0, 0 });
-	TriangleMesh* triangleMesh = new TriangleMesh(filepath, MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
-	LOG_MESH_INFO((uint32_t)triangleMesh->vertices.size(), (uint32_t)triangleMesh->faces.size());
+
+	TriangleMesh* triangleMesh = new TriangleMesh(custom.get(), MaterialPtr(new Lambert{ Color(0.2, 0.7, 0.1) }));
+	LOG_MESH_INFO((uint32_t)triangleMesh->vertexCount(), (uint32_t)triangleMesh->faceCount());
 	scene.addPrimitive(PrimPtr(triangleMesh));
 }
 
@@ -249,13 +473,15 @@ int main(int argc, char *argv[]) {
 		sceneExample,
 		sceneHeavyMesh,
 		sceneManySimpleMeshes,
-		sceneManyHeavyMeshes
+		sceneManyHeavyMeshes,
+		sceneProceduralDragons,
+		sceneSphereCloud
 	};
 	
 	while (true)
 	{
 		RenderProperties props = window.waitForTask();
-		const char* scenes[] = { "Example", "Dragon", "Instanced Cubes", "Instanced Dragons" };
+		const char* scenes[] = { "Example", "Dragon", "Instanced Cubes", "Instanced Dragons", "Procedural Dragons", "Sphere Cloud" };
 		if (props.sceneType == SceneType::CustomMesh)
 			LOG_RENDER_BEGIN(props.scenePath.string(), props.samples);
 		else
@@ -263,6 +489,18 @@ int main(int argc, char *argv[]) {
 		tm.start();
 
 		Scene scene(props.accelerator, props.samples);
+		scene.buildMode = props.buildMode;
+		scene.memoryBudget = int64_t(props.memoryBudgetMB) << 20;
+		scene.nodeLayout = props.nodeLayout;
+		scene.hugePages = props.hugePages;
+		scene.bakeBytes = int64_t(props.bakeInstancesMB) << 20;
+		scene.lodPixelError = float(props.lodPixelError);
+		scene.lodBlend = props.lodBlend;
+		scene.meshLoad.threads = &tm;
+		scene.meshLoad.compressed = props.compressMeshes;
+		scene.meshLoad.residentBytes = int64_t(props.residentMeshMB) << 20;
+		LOG_MEMORY_BUDGET(scene.memoryBudget);
+		MeshCache::get().setCapacity(int64_t(props.meshCacheMB) << 20);
 		printf("Loading scene...\n");
 		if (props.sceneType == SceneType::CustomMesh)
 			sceneCustomMesh(scene, props.scenePath.string());
@@ -272,20 +510,32 @@ int main(int argc, char *argv[]) {
 		window.setContext(&scene.image);
 
 		printf("Preparing \"%s\" scene...\n", scene.name.c_str());
-		scene.onBeforeRender();
-		printf("Starting rendering\n");
-		{
+		scene.onBeforeRender(tm);
+		auto renderScene = [&scene, &tm](const std::string& resultImage) {
+			printf("Starting rendering\n");
+			{
+				Timer timer;
+				scene.render(tm);
+				LOG_RENDER_END(Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
+				printf("Render time: %gms\n", Timer::toMs<float>(timer.elapsedNs()));
+			}
+			printf("Saving image to \"%s\"...\n", resultImage.c_str());
+			const PNGImage& png = scene.image.createPNGData();
+			const int success = stbi_write_png(resultImage.c_str(), scene.width, scene.height, PNGImage::componentCount(), png.data.data(), sizeof(PNGImage::Pixel) * scene.width);
+			if (success == 0) {
+				printf("Failed to write image \"%s\"\n", resultImage.c_str());
+			}
+		};
+		renderScene(scene.name + ".png");
+
+		if (props.editInstances > 0 && scene.moveInstances) {
+			// Rendered again after a few edits, like an interactive session, the instance accelerators are updated in place
+			LOG_RENDER_BEGIN(scene.name + " edited", props.samples);
 			Timer timer;
-			scene.render(tm);
-			LOG_RENDER_END(Timer::toMs<float>(timer.elapsedNs()) / 1000.0f);
-			printf("Render time: %gms\n", Timer::toMs<float>(timer.elapsedNs()));
-		}
-		const std::string resultImage = scene.name + ".png";
-		printf("Saving image to \"%s\"...\n", resultImage.c_str());
-		const PNGImage& png = scene.image.createPNGData();
-		const int success = stbi_write_png(resultImage.c_str(), scene.width, scene.height, PNGImage::componentCount(), png.data.data(), sizeof(PNGImage::Pixel) * scene.width);
-		if (success == 0) {
-			printf("Failed to write image \"%s\"\n", resultImage.c_str());
+			scene.moveInstances(int(props.editInstances));
+			scene.onBeforeRender(tm);
+			printf("Moved %d instances in %gms\n", int(props.editInstances), Timer::toMs<float>(timer.elapsedNs()));
+			renderScene(scene.name + "-edited.png");
 		}
 
 		printf("Done.\n");
@@ -0,0 +1,72 @@
+#include "RenderLog.h"
+#include "Primitive.h"
+
+#include <cstdio>
+
+/// Boxes placed at growing distances, merging nearest neighbours alone chains them into one level per box
+struct GeometricBoxes : PrimitiveList {
+	std::vector<BBox> boxes;
+
+	GeometricBoxes(int count) {
+		float x = 1.f;
+		for (int c = 0; c < count; c++, x *= 3.f) {
+			BBox box;
+			box.add(vec3(x, 0, 0));
+			box.add(vec3(x * 1.0001f + 1e-3f, 1, 1));
+			boxes.push_back(box);
+		}
+	}
+
+	int primitiveCount() const override {
+		return int(boxes.size());
+	}
+
+	bool intersectPrimitive(int index, const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
+		float t0 = tMin, t1 = tMax;
+		if (!boxes[index].intersectP(ray, t0, t1)) {
+			return false;
+		}
+		intersection.t = t0;
+		return true;
+	}
+
+	bool primitiveBoxIntersect(int index, const BBox &box) override {
+		return true;
+	}
+
+	void expandPrimitiveBox(int index, BBox &box) override {
+		box.add(boxes[index]);
+	}
+};
+
+/// Build PLOC over more boxes than the traversal stack holds and check every box is found and the tree can be loaded back
+int main() {
+	RenderLog::StartUp();
+	LOG_RENDER_BEGIN("PLOC depth", 1);
+
+	const int boxCount = 78;
+	GeometricBoxes list(boxCount);
+	AcceleratorPtr accel = makeAccelerator(AcceleratorType::PLOCBVH);
+	accel->setPrimitives(&list);
+	accel->build(IntersectionAccelerator::Purpose::Instances);
+
+	int hits = 0;
+	for (int c = 0; c < boxCount; c++) {
+		const vec3 center = 0.5f * (list.boxes[c].min + list.boxes[c].max);
+		Intersection intersection;
+		hits += accel->intersect(Ray(vec3(center.x, 0.5f, -5.f), vec3(0, 0, 1)), 0.f, FLT_MAX, intersection);
+	}
+
+	std::vector<int> visible;
+	const vec3 edges[4] = { vec3(-1, -1, 1).normalized(), vec3(1, -1, 1).normalized(), vec3(1, 1, 1).normalized(), vec3(-1, 1, 1).normalized() };
+	accel->frustumCull(Frustum(vec3(0, 0.5f, -5.f), edges), visible);
+
+	// load validates the saved tree fits the traversal stack
+	std::vector<char> data;
+	AcceleratorPtr loaded = makeAccelerator(AcceleratorType::PLOCBVH);
+	loaded->setPrimitives(&list);
+	const bool reloaded = accel->save(data) && loaded->load(data.data(), data.size());
+
+	printf("Hit %d of %d boxes, culled to %d, reloaded %d\n", hits, boxCount, int(visible.size()), int(reloaded));
+	return hits == boxCount && !visible.empty() && reloaded ? 0 : 1;
+}